@@ -0,0 +1,82 @@
+--[[
+  bench/channel.lua
+  lua-pthread
+
+  number of the channel operations per second on a single thread and between
+  the producer and consumer threads.
+--]]
+local pthread = require('pthread')
+
+
+local function producer( ch, n )
+    for i = 1, n do
+        ch:send( i )
+    end
+end
+
+
+local function consumer( ch, n )
+    for _ = 1, n do
+        ch:recv()
+    end
+end
+
+
+return function( ctx )
+    local results = {}
+    local now = ctx.now
+    local n = ctx.iterations( 200000 )
+    local ch = pthread.channel( 1024 )
+    local t0 = now()
+
+    -- uncontended send and recv pairs
+    for i = 1, n do
+        ch:send( i )
+        ch:recv()
+    end
+    results[#results + 1] = {
+        name = 'send_recv_same_thread', unit = 'ops/s',
+        value = n / ( ( now() - t0 ) / 1e9 )
+    }
+
+    -- producers and consumers of the same number
+    for _, nthread in ipairs( ctx.concurrency() ) do
+        local per = math.max( 1, math.floor( n / nthread ) )
+        local ths = {}
+
+        ch = pthread.channel( 1024 )
+        t0 = now()
+        for i = 1, nthread do
+            ths[#ths + 1] = assert( pthread.new( producer, ch, per ) )
+            ths[#ths + 1] = assert( pthread.new( consumer, ch, per ) )
+        end
+        for _, th in ipairs( ths ) do
+            assert( th:join() )
+        end
+        results[#results + 1] = {
+            name = 'send_recv_threads', unit = 'ops/s', threads = nthread,
+            value = per * nthread / ( ( now() - t0 ) / 1e9 )
+        }
+    end
+
+    -- pool submission and completion
+    local pool = pthread.pool( ctx.threads, { results = true } )
+    local function task( i )
+        return i
+    end
+    t0 = now()
+    for i = 1, math.floor( n / 10 ) do
+        pool:submit( task, i )
+    end
+    local done = 0
+    while done < math.floor( n / 10 ) do
+        done = done + #pool:collect()
+    end
+    results[#results + 1] = {
+        name = 'pool_submit_collect', unit = 'ops/s', threads = ctx.threads,
+        value = done / ( ( now() - t0 ) / 1e9 )
+    }
+    pool:close()
+
+    return results
+end
@@ -0,0 +1,172 @@
+--[[
+  bench/run.lua
+  lua-pthread
+
+  run the benchmarks and print the results as JSON to track them across the
+  releases.
+
+  usage: lua bench/run.lua [--threads=n] [--scale=n] [--out=file] [name ...]
+
+    --threads=n  maximum number of the concurrent threads. (default 4)
+    --scale=n    multiplier of the number of the iterations. (default 1)
+    --out=file   write the results to the file instead of stdout.
+    name         names of the benchmarks to run; spawn, transfer and channel.
+                 all benchmarks are run if omitted.
+--]]
+local pthread = require('pthread')
+local NAMES = { 'spawn', 'transfer', 'channel' }
+
+
+local function dirname( path )
+    return path:match('^(.*)[/\\]') or '.'
+end
+
+
+local function encode( val, buf )
+    local t = type( val )
+
+    if t == 'table' then
+        -- arrays are encoded as arrays, others as objects with sorted keys
+        if #val > 0 or next( val ) == nil then
+            buf[#buf + 1] = '['
+            for i, v in ipairs( val ) do
+                if i > 1 then
+                    buf[#buf + 1] = ','
+                end
+                encode( v, buf )
+            end
+            buf[#buf + 1] = ']'
+        else
+            local keys = {}
+
+            for k in pairs( val ) do
+                keys[#keys + 1] = tostring( k )
+            end
+            table.sort( keys )
+            buf[#buf + 1] = '{'
+            for i, k in ipairs( keys ) do
+                if i > 1 then
+                    buf[#buf + 1] = ','
+                end
+                encode( k, buf )
+                buf[#buf + 1] = ':'
+                encode( val[k], buf )
+            end
+            buf[#buf + 1] = '}'
+        end
+    elseif t == 'string' then
+        buf[#buf + 1] = '"' .. val:gsub( '[%c"\\]', function( c )
+            return string.format( '\\u%04x', c:byte() )
+        end ) .. '"'
+    elseif t == 'number' then
+        if val ~= val or val == math.huge or val == -math.huge then
+            buf[#buf + 1] = 'null'
+        elseif val == math.floor( val ) and math.abs( val ) < 2^53 then
+            buf[#buf + 1] = string.format( '%d', val )
+        else
+            buf[#buf + 1] = string.format( '%.6g', val )
+        end
+    elseif t == 'boolean' then
+        buf[#buf + 1] = tostring( val )
+    else
+        buf[#buf + 1] = 'null'
+    end
+
+    return buf
+end
+
+
+-- helpers for the benchmarks
+local ctx = {
+    threads = 4,
+    scale = 1,
+    now = pthread.now_ns,
+}
+
+
+function ctx.iterations( n )
+    return math.max( 1, math.floor( n * ctx.scale ) )
+end
+
+
+-- summary of the samples in nanoseconds
+function ctx.percentiles( samples )
+    local n = #samples
+
+    table.sort( samples )
+    local function at( p )
+        return samples[math.max( 1, math.ceil( n * p ) )]
+    end
+
+    return {
+        count = n,
+        min = samples[1],
+        p50 = at( 0.5 ),
+        p90 = at( 0.9 ),
+        p99 = at( 0.99 ),
+        max = samples[n],
+    }
+end
+
+
+-- counts of 1, 2, 4 ... up to the threads option
+function ctx.concurrency()
+    local list = {}
+    local n = 1
+
+    while n < ctx.threads do
+        list[#list + 1] = n
+        n = n * 2
+    end
+    list[#list + 1] = ctx.threads
+
+    return list
+end
+
+
+local function main( args )
+    local names = {}
+    local out = io.stdout
+    local results = {}
+
+    for _, v in ipairs( args ) do
+        local k, val = v:match('^%-%-(%w+)=(.+)$')
+
+        if k == 'threads' or k == 'scale' then
+            ctx[k] = assert( tonumber( val ), 'invalid ' .. k .. ' option' )
+        elseif k == 'out' then
+            out = assert( io.open( val, 'w' ) )
+        elseif k then
+            error( 'unknown option: ' .. v )
+        else
+            names[#names + 1] = v
+        end
+    end
+    if #names == 0 then
+        names = NAMES
+    end
+
+    for _, name in ipairs( names ) do
+        local bench = dofile( dirname( arg[0] ) .. '/' .. name .. '.lua' )
+
+        io.stderr:write( 'running ', name, '...\n' )
+        for _, res in ipairs( bench( ctx ) ) do
+            res.bench = name
+            results[#results + 1] = res
+        end
+    end
+
+    out:write( table.concat( encode({
+        lua = _VERSION,
+        threads = ctx.threads,
+        scale = ctx.scale,
+        time = os.time(),
+        results = results,
+    }, {} ) ), '\n' )
+    if out ~= io.stdout then
+        out:close()
+    end
+end
+
+
+main({ ... })
@@ -0,0 +1,81 @@
+--[[
+  bench/spawn.lua
+  lua-pthread
+
+  latency of pthread.new and th:join, and the number of spawns per second
+  while running multiple threads at once.
+--]]
+local pthread = require('pthread')
+
+local function noop()
+end
+
+
+return function( ctx )
+    local results = {}
+    local samples = {}
+    local now = ctx.now
+
+    -- warm up the dump cache of the function
+    pthread.new( noop ):join()
+
+    -- latency of the spawn and the join
+    for i = 1, ctx.iterations( 500 ) do
+        local t0 = now()
+        local th = assert( pthread.new( noop ) )
+        local t1 = now()
+
+        assert( th:join() )
+        samples[i] = { t1 - t0, now() - t1 }
+    end
+    local spawn, join, total = {}, {}, {}
+    for i, v in ipairs( samples ) do
+        spawn[i], join[i], total[i] = v[1], v[2], v[1] + v[2]
+    end
+    results[#results + 1] = {
+        name = 'spawn_latency', unit = 'ns', value = ctx.percentiles( spawn )
+    }
+    results[#results + 1] = {
+        name = 'join_latency', unit = 'ns', value = ctx.percentiles( join )
+    }
+    results[#results + 1] = {
+        name = 'spawn_join_latency', unit = 'ns',
+        value = ctx.percentiles( total )
+    }
+
+    -- throughput with the threads running at once
+    for _, n in ipairs( ctx.concurrency() ) do
+        local rounds = math.max( 1, math.floor( ctx.iterations( 500 ) / n ) )
+        local ths = {}
+        local t0 = now()
+
+        for _ = 1, rounds do
+            for i = 1, n do
+                ths[i] = assert( pthread.new( noop ) )
+            end
+            for i = 1, n do
+                assert( ths[i]:join() )
+            end
+        end
+        results[#results + 1] = {
+            name = 'spawns_per_sec', unit = 'ops/s', threads = n,
+            value = rounds * n / ( ( now() - t0 ) / 1e9 )
+        }
+    end
+
+    -- handshake waits for the start of the thread
+    samples = {}
+    for i = 1, ctx.iterations( 200 ) do
+        local t0 = now()
+        local th = assert( pthread.new({ fn = noop, handshake = true }) )
+
+        samples[i] = now() - t0
+        assert( th:join() )
+    end
+    results[#results + 1] = {
+        name = 'handshake_latency', unit = 'ns',
+        value = ctx.percentiles( samples )
+    }
+
+    return results
+end
@@ -0,0 +1,112 @@
+--[[
+  bench/transfer.lua
+  lua-pthread
+
+  throughput of the values passed between the threads by the payload size
+  and shape. the values are encoded by the sender and decoded by the receiver
+  in the same way for the arguments, the results and the channels.
+--]]
+local pthread = require('pthread')
+local SIZES = { 64, 1024, 16 * 1024, 256 * 1024 }
+
+
+local SHAPES = {
+    string = function( size )
+        return string.rep( 'x', size )
+    end,
+    -- array of integers
+    array = function( size )
+        local t = {}
+
+        for i = 1, math.max( 1, math.floor( size / 8 ) ) do
+            t[i] = i
+        end
+        return t
+    end,
+    -- map of the short string keys
+    map = function( size )
+        local t = {}
+
+        for i = 1, math.max( 1, math.floor( size / 16 ) ) do
+            t['key' .. i] = i + 0.5
+        end
+        return t
+    end,
+    -- tables of 8 fields nested in 4 levels
+    nested = function( size )
+        local function node( depth, budget )
+            local t = {}
+
+            for i = 1, 8 do
+                if depth < 4 and budget > 64 then
+                    t[i] = node( depth + 1, budget / 8 )
+                else
+                    t[i] = 'leaf' .. i
+                end
+            end
+            return t
+        end
+        return node( 1, size )
+    end,
+}
+local SHAPE_NAMES = { 'string', 'array', 'map', 'nested' }
+
+
+local function echo( ... )
+    return ...
+end
+
+
+-- encoded size of the value
+local function encsize( val )
+    local th = assert( pthread.new( echo, val ) )
+    local size = th:stats().bytes_in
+
+    th:join()
+    return size
+end
+
+
+return function( ctx )
+    local results = {}
+    local now = ctx.now
+    local ch = pthread.channel( 1 )
+
+    for _, shape in ipairs( SHAPE_NAMES ) do
+        for _, size in ipairs( SIZES ) do
+            local val = SHAPES[shape]( size )
+            local bytes = encsize( val )
+            local iter = ctx.iterations( math.max( 10, math.floor(
+                                                    4 * 1024 * 1024 / bytes ) ) )
+            local t0 = now()
+            local elapsed
+
+            -- encode and decode through a channel on the same thread
+            for _ = 1, iter do
+                ch:send( val )
+                ch:recv()
+            end
+            elapsed = ( now() - t0 ) / 1e9
+            results[#results + 1] = {
+                name = 'channel_transfer', unit = 'bytes/s', shape = shape,
+                size = size, encoded = bytes, value = bytes * iter / elapsed,
+                ops = iter / elapsed,
+            }
+
+            -- arguments and results of the thread
+            iter = math.max( 1, math.floor( iter / 10 ) )
+            t0 = now()
+            for _ = 1, iter do
+                assert( pthread.new( echo, val ):join() )
+            end
+            elapsed = ( now() - t0 ) / 1e9
+            results[#results + 1] = {
+                name = 'thread_transfer', unit = 'bytes/s', shape = shape,
+                size = size, encoded = bytes,
+                value = bytes * 2 * iter / elapsed, ops = iter / elapsed,
+            }
+        end
+    end
+
+    return results
+end
@@ -0,0 +1,204 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  alloc.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  allocator of the states. small blocks are carved out of the slabs owned
+ *  by each state and recycled through the free list of their size class, so
+ *  that the threads do not contend on the global malloc. a state is used by
+ *  only one thread at a time, therefore no lock is required.
+ */
+
+#include "lpthread.h"
+
+#define ARENA_ALIGN     16
+#define ARENA_MAXSMALL  512
+#define ARENA_NCLASS    ( ARENA_MAXSMALL / ARENA_ALIGN )
+#define ARENA_SLABSIZE  ( 64 * 1024 )
+
+#define sizeclass( size )   ( ( (size) + ARENA_ALIGN - 1 ) / ARENA_ALIGN - 1 )
+
+
+typedef struct block_s {
+    struct block_s *next;
+} block_t;
+
+
+typedef struct slab_s {
+    struct slab_s *next;
+} slab_t;
+
+
+struct lpt_arena_s {
+    int pooled;
+    // updated only by the owner thread, and read by the stats of the others
+    atomic_size_t used;
+    size_t limit;
+    char *cur;
+    char *end;
+    slab_t *slabs;
+    block_t *freelist[ARENA_NCLASS];
+};
+
+
+lpt_arena_t *lpt_arena_new( int pooled, size_t limit )
+{
+    lpt_arena_t *a = calloc( 1, sizeof( lpt_arena_t ) );
+
+    if( a ){
+        atomic_init( &a->used, 0 );
+        a->pooled = pooled;
+        a->limit = limit;
+    }
+
+    return a;
+}
+
+
+void lpt_arena_free( lpt_arena_t *a )
+{
+    slab_t *slab = a->slabs;
+
+    while( slab ){
+        slab_t *next = slab->next;
+        free( slab );
+        slab = next;
+    }
+    free( a );
+}
+
+
+size_t lpt_arena_used( lpt_arena_t *a )
+{
+    return atomic_load_explicit( &a->used, memory_order_relaxed );
+}
+
+
+static inline void addused( lpt_arena_t *a, size_t add, size_t sub )
+{
+    atomic_store_explicit( &a->used, lpt_arena_used( a ) + add - sub,
+                           memory_order_relaxed );
+}
+
+
+static void *small_alloc( lpt_arena_t *a, size_t cls )
+{
+    size_t size = ( cls + 1 ) * ARENA_ALIGN;
+    block_t *blk = a->freelist[cls];
+    slab_t *slab = NULL;
+
+    if( blk ){
+        a->freelist[cls] = blk->next;
+        return blk;
+    }
+    // carve out of the current slab
+    else if( (size_t)( a->end - a->cur ) < size )
+    {
+        if( !( slab = malloc( ARENA_SLABSIZE ) ) ){
+            return NULL;
+        }
+        slab->next = a->slabs;
+        a->slabs = slab;
+        // keep the alignment of the blocks
+        a->cur = (char*)slab + ARENA_ALIGN;
+        a->end = (char*)slab + ARENA_SLABSIZE;
+    }
+    blk = (block_t*)a->cur;
+    a->cur += size;
+
+    return blk;
+}
+
+
+static inline void release( lpt_arena_t *a, void *ptr, size_t size )
+{
+    if( a->pooled && size <= ARENA_MAXSMALL ){
+        size_t cls = sizeclass( size );
+
+        ((block_t*)ptr)->next = a->freelist[cls];
+        a->freelist[cls] = (block_t*)ptr;
+    }
+    else {
+        free( ptr );
+    }
+}
+
+
+static void *resize( lpt_arena_t *a, void *ptr, size_t osize, size_t nsize )
+{
+    void *nptr = NULL;
+
+    if( !a->pooled || ( osize > ARENA_MAXSMALL && nsize > ARENA_MAXSMALL ) ){
+        nptr = realloc( ptr, nsize );
+    }
+    // same size class
+    else if( ptr && osize <= ARENA_MAXSMALL && nsize <= ARENA_MAXSMALL &&
+             sizeclass( osize ) == sizeclass( nsize ) ){
+        return ptr;
+    }
+    else if( ( nptr = ( nsize <= ARENA_MAXSMALL ) ?
+                      small_alloc( a, sizeclass( nsize ) ) :
+                      malloc( nsize ) ) && ptr ){
+        memcpy( nptr, ptr, osize < nsize ? osize : nsize );
+        release( a, ptr, osize );
+    }
+
+    // lua 5.1 to 5.3 assume that shrinking a block never fails. the block is
+    // kept as is, and it is large enough for the size class of nsize if it
+    // is released to the free list later.
+    if( !nptr && ptr && nsize < osize ){
+        return ptr;
+    }
+
+    return nptr;
+}
+
+
+void *lpt_arena_alloc( void *ud, void *ptr, size_t osize, size_t nsize )
+{
+    lpt_arena_t *a = (lpt_arena_t*)ud;
+    void *nptr = NULL;
+
+    // osize is the type of the object if ptr is NULL
+    if( !ptr ){
+        osize = 0;
+    }
+
+    if( nsize == 0 ){
+        if( ptr ){
+            release( a, ptr, osize );
+            addused( a, 0, osize );
+        }
+        return NULL;
+    }
+    // exceeds the memory limit
+    else if( a->limit && nsize > osize &&
+             lpt_arena_used( a ) + nsize - osize > a->limit ){
+        return NULL;
+    }
+    else if( ( nptr = resize( a, ptr, osize, nsize ) ) ){
+        addused( a, nsize, osize );
+    }
+
+    return nptr;
+}
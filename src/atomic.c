@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  atomic.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  atomic integers that are shared by the threads. the counters are updated
+ *  without a lock, so that they can be used on the hot path.
+ */
+
+#include "lpthread.h"
+
+
+typedef struct {
+    lpt_shared_t shared;
+    // placed on its own cache line to avoid the false sharing
+    char pad[LPT_CACHELINE];
+    _Atomic(int64_t) val;
+} lpt_atomic_t;
+
+
+static void counter_free( lpt_shared_t *obj )
+{
+    free( obj );
+}
+
+
+static const lpt_shared_type_t ATOMIC_TYPE = {
+    .tname = ATOMIC_MT,
+    .init = lpt_atomic_init,
+    .free = counter_free
+};
+
+
+static inline lpt_atomic_t *checkatomic( lua_State *L )
+{
+    return (lpt_atomic_t*)lpt_shared_check( L, 1, ATOMIC_MT );
+}
+
+
+static int load_lua( lua_State *L )
+{
+    lpt_atomic_t *a = checkatomic( L );
+
+    lua_pushinteger( L, (lua_Integer)atomic_load( &a->val ) );
+
+    return 1;
+}
+
+
+static int store_lua( lua_State *L )
+{
+    lpt_atomic_t *a = checkatomic( L );
+
+    atomic_store( &a->val, (int64_t)lauxh_checkinteger( L, 2 ) );
+
+    return 0;
+}
+
+
+static int exchange_lua( lua_State *L )
+{
+    lpt_atomic_t *a = checkatomic( L );
+    int64_t val = (int64_t)lauxh_checkinteger( L, 2 );
+
+    lua_pushinteger( L, (lua_Integer)atomic_exchange( &a->val, val ) );
+
+    return 1;
+}
+
+
+static int add_lua( lua_State *L )
+{
+    lpt_atomic_t *a = checkatomic( L );
+    int64_t n = (int64_t)luaL_optinteger( L, 2, 1 );
+
+    // returns the new value. it is computed in unsigned to wrap around as
+    // the atomic operation does
+    lua_pushinteger( L, (lua_Integer)(int64_t)(
+        (uint64_t)atomic_fetch_add( &a->val, n ) + (uint64_t)n ) );
+
+    return 1;
+}
+
+
+static int sub_lua( lua_State *L )
+{
+    lpt_atomic_t *a = checkatomic( L );
+    int64_t n = (int64_t)luaL_optinteger( L, 2, 1 );
+
+    // returns the new value. it is computed in unsigned to wrap around as
+    // the atomic operation does
+    lua_pushinteger( L, (lua_Integer)(int64_t)(
+        (uint64_t)atomic_fetch_sub( &a->val, n ) - (uint64_t)n ) );
+
+    return 1;
+}
+
+
+static int cas_lua( lua_State *L )
+{
+    lpt_atomic_t *a = checkatomic( L );
+    int64_t expected = (int64_t)lauxh_checkinteger( L, 2 );
+    int64_t desired = (int64_t)lauxh_checkinteger( L, 3 );
+
+    lua_pushboolean( L, atomic_compare_exchange_strong( &a->val, &expected,
+                                                        desired ) );
+    // expected holds the current value on failure
+    lua_pushinteger( L, (lua_Integer)expected );
+
+    return 2;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, ATOMIC_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_atomic_new( lua_State *L )
+{
+    int64_t val = (int64_t)luaL_optinteger( L, 1, 0 );
+    lpt_atomic_t *a = malloc( sizeof( lpt_atomic_t ) );
+
+    if( !a ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    atomic_init( &a->shared.refcnt, 0 );
+    a->shared.type = &ATOMIC_TYPE;
+    atomic_init( &a->val, val );
+    lpt_shared_push( L, (lpt_shared_t*)a );
+
+    return 1;
+}
+
+
+void lpt_atomic_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "load", load_lua },
+        { "store", store_lua },
+        { "exchange", exchange_lua },
+        { "add", add_lua },
+        { "sub", sub_lua },
+        { "cas", cas_lua },
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &ATOMIC_TYPE, mmethod, method );
+}
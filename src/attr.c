@@ -0,0 +1,245 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  attr.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  attributes of the threads created by pthread.new and pthread.pool.
+ */
+
+// required for the cpu affinity functions
+#define _GNU_SOURCE
+#include <sched.h>
+#include "lpthread.h"
+
+
+static void checkcpus( lua_State *L, int idx, lpt_attr_t *attr )
+{
+    int i = 1;
+
+    luaL_checktype( L, idx, LUA_TTABLE );
+    lua_rawgeti( L, idx, i );
+    while( !lua_isnil( L, -1 ) )
+    {
+        lua_Integer cpu = lauxh_checkinteger( L, -1 );
+
+        if( cpu < 0 || cpu >= LPT_MAXCPU ){
+            luaL_error( L, "cpu number out of range: %d", (int)cpu );
+        }
+        attr->cpus[cpu / 8] |= 1 << ( cpu % 8 );
+        lua_pop( L, 1 );
+        lua_rawgeti( L, idx, ++i );
+    }
+    lua_pop( L, 1 );
+}
+
+
+// add the cpus of the numa node from the sysfs cpulist such as "0-3,8-11"
+static void addnode( lua_State *L, int node, lpt_attr_t *attr )
+{
+    char path[64];
+    char list[1024];
+    FILE *fp = NULL;
+    char *ptr = list;
+    size_t len = 0;
+
+    snprintf( path, sizeof( path ),
+              "/sys/devices/system/node/node%d/cpulist", node );
+    if( !( fp = fopen( path, "r" ) ) ){
+        luaL_error( L, "numa node %d is not available: %s", node,
+                    strerror( errno ) );
+    }
+    len = fread( list, 1, sizeof( list ) - 1, fp );
+    fclose( fp );
+    list[len] = 0;
+
+    while( *ptr >= '0' && *ptr <= '9' )
+    {
+        long head = strtol( ptr, &ptr, 10 );
+        long tail = head;
+
+        if( *ptr == '-' ){
+            tail = strtol( ptr + 1, &ptr, 10 );
+        }
+        for(; head <= tail && head < LPT_MAXCPU; head++ ){
+            attr->cpus[head / 8] |= 1 << ( head % 8 );
+        }
+        if( *ptr == ',' ){
+            ptr++;
+        }
+    }
+}
+
+
+static inline int hascpu( const lpt_attr_t *attr, int cpu )
+{
+    return attr->cpus[cpu / 8] & ( 1 << ( cpu % 8 ) );
+}
+
+
+void lpt_attr_parse( lua_State *L, int idx, lpt_attr_t *attr )
+{
+    int cpu = 0;
+
+    memset( attr, 0, sizeof( lpt_attr_t ) );
+    attr->policy = -1;
+
+    if( !idx ){
+        return;
+    }
+
+    lua_getfield( L, idx, "stacksize" );
+    if( !lua_isnil( L, -1 ) ){
+        lua_Integer size = lauxh_checkinteger( L, -1 );
+
+        if( size <= 0 ){
+            luaL_error( L, "stacksize must be greater than 0" );
+        }
+        attr->stacksize = (size_t)size;
+    }
+    lua_pop( L, 1 );
+
+    lua_getfield( L, idx, "policy" );
+    if( !lua_isnil( L, -1 ) )
+    {
+        static const char *const names[] = { "other", "fifo", "rr", NULL };
+        static const int policies[] = { SCHED_OTHER, SCHED_FIFO, SCHED_RR };
+
+        attr->policy = policies[luaL_checkoption( L, -1, NULL, names )];
+    }
+    lua_pop( L, 1 );
+
+    lua_getfield( L, idx, "priority" );
+    if( !lua_isnil( L, -1 ) ){
+        if( attr->policy == -1 ){
+            luaL_error( L, "priority requires the policy option" );
+        }
+        attr->priority = (int)lauxh_checkinteger( L, -1 );
+    }
+    lua_pop( L, 1 );
+
+    lua_getfield( L, idx, "cpus" );
+    if( !lua_isnil( L, -1 ) ){
+        checkcpus( L, lua_gettop( L ), attr );
+    }
+    lua_pop( L, 1 );
+
+    lua_getfield( L, idx, "numa" );
+    if( !lua_isnil( L, -1 ) ){
+        addnode( L, (int)lauxh_checkinteger( L, -1 ), attr );
+    }
+    lua_pop( L, 1 );
+
+    lua_getfield( L, idx, "pin" );
+    attr->pin = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+
+    for(; cpu < LPT_MAXCPU; cpu++ ){
+        if( hascpu( attr, cpu ) ){
+            attr->ncpu++;
+        }
+    }
+
+#if !defined(__linux__)
+    if( attr->ncpu ){
+        luaL_error( L, "cpu affinity is not supported on this platform" );
+    }
+#endif
+}
+
+
+#if defined(__linux__)
+// returns the nth cpu in the set
+static int nthcpu( const lpt_attr_t *attr, int nth )
+{
+    int cpu = 0;
+
+    for(; cpu < LPT_MAXCPU; cpu++ )
+    {
+        if( hascpu( attr, cpu ) && nth-- == 0 ){
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+#endif
+
+
+int lpt_attr_init( pthread_attr_t *pattr, const lpt_attr_t *attr, int nth )
+{
+    int rc = pthread_attr_init( pattr );
+
+    if( rc ){
+        return rc;
+    }
+    else if( attr->stacksize &&
+             ( rc = pthread_attr_setstacksize( pattr, attr->stacksize ) ) ){
+        goto FAILED;
+    }
+    else if( attr->policy != -1 )
+    {
+        struct sched_param param = {
+            .sched_priority = attr->priority
+        };
+
+        if( ( rc = pthread_attr_setinheritsched( pattr,
+                                                 PTHREAD_EXPLICIT_SCHED ) ) ||
+            ( rc = pthread_attr_setschedpolicy( pattr, attr->policy ) ) ||
+            ( rc = pthread_attr_setschedparam( pattr, &param ) ) ){
+            goto FAILED;
+        }
+    }
+
+#if defined(__linux__)
+    if( attr->ncpu )
+    {
+        cpu_set_t set;
+        int cpu = 0;
+
+        CPU_ZERO( &set );
+        // pin to one of the cpus
+        if( attr->pin && nth >= 0 ){
+            CPU_SET( nthcpu( attr, nth % attr->ncpu ), &set );
+        }
+        else {
+            for(; cpu < LPT_MAXCPU; cpu++ ){
+                if( hascpu( attr, cpu ) ){
+                    CPU_SET( cpu, &set );
+                }
+            }
+        }
+        if( ( rc = pthread_attr_setaffinity_np( pattr, sizeof( cpu_set_t ),
+                                                &set ) ) ){
+            goto FAILED;
+        }
+    }
+#else
+    (void)nth;
+#endif
+
+    return 0;
+
+FAILED:
+    pthread_attr_destroy( pattr );
+    return rc;
+}
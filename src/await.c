@@ -0,0 +1,125 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  await.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *
+ *  await methods of the threads, channels and pools. when called from a
+ *  coroutine, these methods yield the file descriptor to wait for instead of
+ *  blocking the os thread, so that an event loop running on a single thread
+ *  can wait for many threads at once. the loops are written in lua since the
+ *  c functions cannot be continued after the yield on lua 5.1.
+ */
+
+#include "lpthread.h"
+
+#define AWAIT_CACHE "pthread.await.cache"
+
+// globals are not used since the libraries may not be opened in the state
+static const char AWAIT_SRC[] =
+"local yieldable, yield = ...\n"
+"return {\n"
+"    thread = function( th )\n"
+"        local fd = yieldable() and th:fd()\n"
+"        if fd then\n"
+"            while th:is_running() do\n"
+"                yield( fd )\n"
+"            end\n"
+"        end\n"
+"        return th:join()\n"
+"    end,\n"
+"    channel = function( ch )\n"
+"        local fd = yieldable() and ch:fd()\n"
+"        if fd then\n"
+"            while true do\n"
+"                local val, err = ch:try_recv()\n"
+"                if val ~= nil or err then\n"
+"                    return val, err\n"
+"                end\n"
+"                yield( fd )\n"
+"            end\n"
+"        end\n"
+"        return ch:recv()\n"
+"    end,\n"
+"    pool = function( pool, n )\n"
+"        local fd = yieldable() and pool:fd()\n"
+"        if fd then\n"
+"            while true do\n"
+"                -- clear the descriptor before checking the results so\n"
+"                -- that the completion after the check is not missed\n"
+"                pool:completed()\n"
+"                local res = pool:collect( n, 0 )\n"
+"                if #res > 0 or pool:pending() == 0 then\n"
+"                    return res\n"
+"                end\n"
+"                yield( fd )\n"
+"            end\n"
+"        end\n"
+"        return pool:collect( n )\n"
+"    end,\n"
+"}\n";
+
+
+static int yieldable_lua( lua_State *L )
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushboolean( L, lua_isyieldable( L ) );
+#else
+    // the main thread cannot yield
+    lua_pushboolean( L, !lua_pushthread( L ) );
+#endif
+
+    return 1;
+}
+
+
+static int yield_lua( lua_State *L )
+{
+    return lua_yield( L, lua_gettop( L ) );
+}
+
+
+void lpt_await_register( lua_State *L, const char *tname, const char *name )
+{
+    lua_getfield( L, LUA_REGISTRYINDEX, AWAIT_CACHE );
+    if( lua_isnil( L, -1 ) )
+    {
+        lua_pop( L, 1 );
+        if( luaL_loadbuffer( L, AWAIT_SRC, sizeof( AWAIT_SRC ) - 1,
+                             "=pthread.await" ) ){
+            lua_error( L );
+        }
+        lua_pushcfunction( L, yieldable_lua );
+        lua_pushcfunction( L, yield_lua );
+        lua_call( L, 2, 1 );
+        lua_pushvalue( L, -1 );
+        lua_setfield( L, LUA_REGISTRYINDEX, AWAIT_CACHE );
+    }
+
+    // metatable.__index.await = cache[name]
+    luaL_getmetatable( L, tname );
+    lua_getfield( L, -1, "__index" );
+    lua_getfield( L, -3, name );
+    lua_setfield( L, -2, "await" );
+    lua_pop( L, 3 );
+}
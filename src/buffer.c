@@ -0,0 +1,232 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  buffer.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  byte buffers that are passed to other threads by reference. a buffer is
+ *  a view of the reference counted memory, so that the slices of a buffer
+ *  share the same memory.
+ */
+
+#include "lpthread.h"
+
+
+typedef struct {
+    atomic_int refcnt;
+    size_t len;
+    char data[];
+} mem_t;
+
+
+typedef struct {
+    lpt_shared_t shared;
+    mem_t *mem;
+    char *data;
+    size_t len;
+} lpt_buffer_t;
+
+
+static void mem_release( mem_t *mem )
+{
+    if( atomic_fetch_sub_explicit( &mem->refcnt, 1,
+                                   memory_order_acq_rel ) == 1 ){
+        free( mem );
+    }
+}
+
+
+static void buffer_free( lpt_shared_t *obj )
+{
+    lpt_buffer_t *b = (lpt_buffer_t*)obj;
+
+    mem_release( b->mem );
+    free( b );
+}
+
+
+static const lpt_shared_type_t BUFFER_TYPE = {
+    .tname = BUFFER_MT,
+    .init = lpt_buffer_init,
+    .free = buffer_free
+};
+
+
+// push a new view of the memory
+static int pushview( lua_State *L, mem_t *mem, char *data, size_t len )
+{
+    lpt_buffer_t *b = malloc( sizeof( lpt_buffer_t ) );
+
+    if( !b ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    atomic_init( &b->shared.refcnt, 0 );
+    b->shared.type = &BUFFER_TYPE;
+    atomic_fetch_add_explicit( &mem->refcnt, 1, memory_order_relaxed );
+    b->mem = mem;
+    b->data = data;
+    b->len = len;
+    lpt_shared_push( L, (lpt_shared_t*)b );
+
+    return 1;
+}
+
+
+static inline lpt_buffer_t *checkbuffer( lua_State *L )
+{
+    return (lpt_buffer_t*)lpt_shared_check( L, 1, BUFFER_MT );
+}
+
+
+// check the range of pos and len arguments. pos starts from 1
+static size_t checkrange( lua_State *L, lpt_buffer_t *b, int idx, size_t *len )
+{
+    lua_Integer pos = luaL_optinteger( L, idx, 1 );
+    lua_Integer n = 0;
+
+    luaL_argcheck( L, pos > 0 && (size_t)pos <= b->len + 1, idx,
+                   "position out of range" );
+    n = luaL_optinteger( L, idx + 1, (lua_Integer)( b->len - pos + 1 ) );
+    luaL_argcheck( L, n >= 0 && (size_t)n <= b->len - pos + 1, idx + 1,
+                   "length out of range" );
+    *len = (size_t)n;
+
+    return (size_t)pos - 1;
+}
+
+
+static int read_lua( lua_State *L )
+{
+    lpt_buffer_t *b = checkbuffer( L );
+    size_t len = 0;
+    size_t off = checkrange( L, b, 2, &len );
+
+    lua_pushlstring( L, b->data + off, len );
+
+    return 1;
+}
+
+
+static int write_lua( lua_State *L )
+{
+    lpt_buffer_t *b = checkbuffer( L );
+    lua_Integer pos = lauxh_checkinteger( L, 2 );
+    size_t len = 0;
+    const char *str = luaL_checklstring( L, 3, &len );
+
+    luaL_argcheck( L, pos > 0 && (size_t)pos <= b->len + 1, 2,
+                   "position out of range" );
+    luaL_argcheck( L, len <= b->len - pos + 1, 3,
+                   "string length exceeds the buffer length" );
+    memcpy( b->data + pos - 1, str, len );
+    lua_pushinteger( L, (lua_Integer)len );
+
+    return 1;
+}
+
+
+static int slice_lua( lua_State *L )
+{
+    lpt_buffer_t *b = checkbuffer( L );
+    size_t len = 0;
+    size_t off = checkrange( L, b, 2, &len );
+
+    return pushview( L, b->mem, b->data + off, len );
+}
+
+
+static int len_lua( lua_State *L )
+{
+    lpt_buffer_t *b = checkbuffer( L );
+
+    lua_pushinteger( L, (lua_Integer)b->len );
+
+    return 1;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, BUFFER_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_buffer_new( lua_State *L )
+{
+    const char *str = NULL;
+    size_t len = 0;
+    mem_t *mem = NULL;
+    int rc = 0;
+
+    if( lua_type( L, 1 ) == LUA_TSTRING ){
+        str = lua_tolstring( L, 1, &len );
+    }
+    else {
+        lua_Integer n = lauxh_checkinteger( L, 1 );
+
+        luaL_argcheck( L, n >= 0, 1, "size must be greater than or equal to 0" );
+        len = (size_t)n;
+    }
+
+    if( !( mem = malloc( sizeof( mem_t ) + len ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    else if( str ){
+        memcpy( mem->data, str, len );
+    }
+    else {
+        memset( mem->data, 0, len );
+    }
+    atomic_init( &mem->refcnt, 1 );
+    mem->len = len;
+
+    rc = pushview( L, mem, mem->data, len );
+    // view holds the memory reference
+    mem_release( mem );
+
+    return rc;
+}
+
+
+void lpt_buffer_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__len", len_lua },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "read", read_lua },
+        { "write", write_lua },
+        { "slice", slice_lua },
+        { "len", len_lua },
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &BUFFER_TYPE, mmethod, method );
+}
@@ -0,0 +1,305 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  cancel.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  cooperative cancellation of the running functions. the count hook of the
+ *  state checks the token of the thread and the limits of the function, and
+ *  raises an error, so that the function is unwound safely and the state can
+ *  be used again.
+ */
+
+#include <time.h>
+#include <sched.h>
+#include "lpthread.h"
+
+// token of the running state on this thread
+static _Thread_local lpt_cancel_t *CURRENT = NULL;
+
+
+void lpt_cancel_init( lpt_cancel_t *c )
+{
+    atomic_init( &c->current, 0 );
+    atomic_init( &c->target, 0 );
+    atomic_flag_clear( &c->lock );
+    c->wcond = NULL;
+    c->wmutex = NULL;
+    c->wfutex = NULL;
+    memset( &c->limit, 0, sizeof( lpt_limit_t ) );
+    c->count = 0;
+    c->cpu_start = 0;
+    c->clock = CLOCK_THREAD_CPUTIME_ID;
+    c->reason = NULL;
+}
+
+
+static inline void lock( lpt_cancel_t *c )
+{
+    while( atomic_flag_test_and_set_explicit( &c->lock,
+                                              memory_order_acquire ) ){
+        sched_yield();
+    }
+}
+
+
+static inline void unlock( lpt_cancel_t *c )
+{
+    atomic_flag_clear_explicit( &c->lock, memory_order_release );
+}
+
+
+// set the condition to wait for. the mutex is held by the caller
+static inline void setwait( lpt_cancel_t *c, pthread_cond_t *cond,
+                            pthread_mutex_t *mutex )
+{
+    lock( c );
+    c->wcond = cond;
+    c->wmutex = mutex;
+    unlock( c );
+}
+
+
+static inline void setwaitfutex( lpt_cancel_t *c, atomic_int *addr )
+{
+    lock( c );
+    c->wfutex = addr;
+    unlock( c );
+}
+
+
+int lpt_cancel_request( lpt_cancel_t *c, uint64_t id )
+{
+    if( !id || atomic_load( &c->current ) != id ){
+        return 0;
+    }
+    atomic_store( &c->target, id );
+
+    // the waiter holds the mutex from the check of the token until it
+    // sleeps, so that the signal is sent with the mutex to not be lost. the
+    // lock keeps the condition valid but it is not held while waiting for
+    // the mutex because the waiter holds the mutex while taking the lock
+    while( 1 )
+    {
+        lock( c );
+        // the wake up is lost if the waiter has not slept yet, so that it is
+        // repeated until the waiter leaves the futex
+        if( c->wfutex ){
+            lpt_futex_wake( c->wfutex, INT_MAX );
+        }
+        else if( !c->wcond ){
+            unlock( c );
+            break;
+        }
+        else if( pthread_mutex_trylock( c->wmutex ) == 0 ){
+            pthread_cond_broadcast( c->wcond );
+            pthread_mutex_unlock( c->wmutex );
+            unlock( c );
+            break;
+        }
+        unlock( c );
+        sched_yield();
+    }
+
+    return 1;
+}
+
+
+int lpt_cancel_requested( void )
+{
+    lpt_cancel_t *c = CURRENT;
+    uint64_t id = 0;
+
+    if( c && ( id = atomic_load_explicit( &c->current,
+                                          memory_order_relaxed ) ) ){
+        return atomic_load_explicit( &c->target, memory_order_relaxed ) == id;
+    }
+
+    return 0;
+}
+
+
+static int stop( lua_State *L, const char *reason )
+{
+    if( CURRENT ){
+        CURRENT->reason = reason;
+    }
+
+    return luaL_error( L, "%s", reason );
+}
+
+
+int lpt_cancel_error( lua_State *L )
+{
+    return stop( L, LPT_CANCELED_MSG );
+}
+
+
+static inline uint64_t cputime( lpt_cancel_t *c )
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime( c->clock, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+static void hook( lua_State *L, lua_Debug *ar )
+{
+    lpt_cancel_t *c = CURRENT;
+
+    (void)ar;
+    // the conditions stay true, so that the error is raised again even if it
+    // is caught by pcall
+    if( lpt_cancel_requested() ){
+        stop( L, LPT_CANCELED_MSG );
+    }
+    else if( !c ){
+        return;
+    }
+    else if( c->limit.instructions &&
+             ( c->count += LPT_CANCEL_COUNT ) > c->limit.instructions ){
+        stop( L, LPT_EINSN_MSG );
+    }
+    else if( c->limit.cpu_ns && cputime( c ) - c->cpu_start >
+                                c->limit.cpu_ns ){
+        stop( L, LPT_ECPUTIME_MSG );
+    }
+}
+
+
+void lpt_cancel_attach( lua_State *L, lpt_cancel_t *c )
+{
+    CURRENT = c;
+#if !defined(__APPLE__)
+    // clock of the cpu time consumed by this thread
+    if( pthread_getcpuclockid( pthread_self(), &c->clock ) ){
+        c->clock = CLOCK_THREAD_CPUTIME_ID;
+    }
+#endif
+    lua_sethook( L, hook, LUA_MASKCOUNT, LPT_CANCEL_COUNT );
+}
+
+
+void lpt_cancel_start( lpt_cancel_t *c, const lpt_limit_t *limit )
+{
+    c->limit = *limit;
+    c->count = 0;
+    c->cpu_start = limit->cpu_ns ? cputime( c ) : 0;
+    c->reason = NULL;
+}
+
+
+int lpt_cancel_wait( pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     const struct timespec *abstime )
+{
+    lpt_cancel_t *c = CURRENT;
+    int rc = 0;
+
+    if( c ){
+        setwait( c, cond, mutex );
+        if( lpt_cancel_requested() ){
+            setwait( c, NULL, NULL );
+            return ECANCELED;
+        }
+    }
+
+    if( !abstime ){
+        rc = pthread_cond_wait( cond, mutex );
+    }
+    else {
+        rc = pthread_cond_timedwait( cond, mutex, abstime );
+    }
+
+    if( c ){
+        setwait( c, NULL, NULL );
+        if( lpt_cancel_requested() ){
+            return ECANCELED;
+        }
+    }
+
+    return rc;
+}
+
+
+int lpt_cancel_futex_wait( atomic_int *addr, int val )
+{
+    lpt_cancel_t *c = CURRENT;
+
+    if( c ){
+        setwaitfutex( c, addr );
+        if( lpt_cancel_requested() ){
+            setwaitfutex( c, NULL );
+            return ECANCELED;
+        }
+    }
+
+    lpt_futex_wait( addr, val );
+
+    if( c ){
+        setwaitfutex( c, NULL );
+        if( lpt_cancel_requested() ){
+            return ECANCELED;
+        }
+    }
+
+    return 0;
+}
+
+
+void lpt_limit_parse( lua_State *L, int idx, lpt_limit_t *limit )
+{
+    memset( limit, 0, sizeof( lpt_limit_t ) );
+    if( !idx ){
+        return;
+    }
+
+    lua_getfield( L, idx, "cpu_ms" );
+    if( !lua_isnil( L, -1 ) ){
+        lua_Number ms = luaL_checknumber( L, -1 );
+
+        // also rejects nan
+        if( !( ms > 0 ) ){
+            luaL_error( L, "cpu_ms must be greater than 0" );
+        }
+        // out of range conversion is undefined, and 0 means unlimited
+        else if( ms >= (lua_Number)UINT64_MAX / 1000000 ){
+            limit->cpu_ns = UINT64_MAX;
+        }
+        else if( !( limit->cpu_ns = (uint64_t)( ms * 1000000 ) ) ){
+            limit->cpu_ns = 1;
+        }
+    }
+    lua_pop( L, 1 );
+
+    lua_getfield( L, idx, "instructions" );
+    if( !lua_isnil( L, -1 ) ){
+        lua_Integer n = lauxh_checkinteger( L, -1 );
+
+        if( n <= 0 ){
+            luaL_error( L, "instructions must be greater than 0" );
+        }
+        limit->instructions = (uint64_t)n;
+    }
+    lua_pop( L, 1 );
+}
@@ -0,0 +1,694 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  channel.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  bounded multi-producer/multi-consumer queue based on the ring buffer of
+ *  sequenced cells. the mutex is used only for sleeping when the queue is
+ *  full or empty.
+ */
+
+#include "lpthread.h"
+
+#define CACHELINE   64
+// maximum number of the messages dequeued at once by ch:recv_many
+#define RECV_BATCH  64
+
+
+typedef struct {
+    size_t len;
+    size_t nref;
+    char data[];
+} lpt_msg_t;
+
+
+typedef struct {
+    atomic_size_t seq;
+    lpt_msg_t *msg;
+} cell_t;
+
+
+typedef struct {
+    lpt_shared_t shared;
+    size_t mask;
+    cell_t *cells;
+    atomic_int closed;
+    atomic_int nrecvwait;
+    atomic_int nsendwait;
+    pthread_mutex_t mutex;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+    // readable while the queue has values or the channel is closed
+    lpt_notify_t notify;
+    // producer and consumer positions are placed on separate cache lines
+    char pad1[CACHELINE];
+    atomic_size_t head;
+    char pad2[CACHELINE - sizeof( atomic_size_t )];
+    atomic_size_t tail;
+    char pad3[CACHELINE - sizeof( atomic_size_t )];
+} lpt_channel_t;
+
+
+static int enqueue( lpt_channel_t *ch, lpt_msg_t *msg )
+{
+    size_t pos = atomic_load_explicit( &ch->head, memory_order_relaxed );
+    cell_t *cell = NULL;
+    intptr_t dif = 0;
+
+    for(;;)
+    {
+        cell = &ch->cells[pos & ch->mask];
+        dif = (intptr_t)atomic_load_explicit( &cell->seq,
+                                              memory_order_acquire ) -
+              (intptr_t)pos;
+        if( dif == 0 ){
+            if( atomic_compare_exchange_weak_explicit( &ch->head, &pos,
+                                                       pos + 1,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed ) ){
+                break;
+            }
+        }
+        // full
+        else if( dif < 0 ){
+            return -1;
+        }
+        else {
+            pos = atomic_load_explicit( &ch->head, memory_order_relaxed );
+        }
+    }
+
+    cell->msg = msg;
+    atomic_store_explicit( &cell->seq, pos + 1, memory_order_release );
+
+    return 0;
+}
+
+
+static lpt_msg_t *dequeue( lpt_channel_t *ch )
+{
+    size_t pos = atomic_load_explicit( &ch->tail, memory_order_relaxed );
+    cell_t *cell = NULL;
+    lpt_msg_t *msg = NULL;
+    intptr_t dif = 0;
+
+    for(;;)
+    {
+        cell = &ch->cells[pos & ch->mask];
+        dif = (intptr_t)atomic_load_explicit( &cell->seq,
+                                              memory_order_acquire ) -
+              (intptr_t)( pos + 1 );
+        if( dif == 0 ){
+            if( atomic_compare_exchange_weak_explicit( &ch->tail, &pos,
+                                                       pos + 1,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed ) ){
+                break;
+            }
+        }
+        // empty
+        else if( dif < 0 ){
+            return NULL;
+        }
+        else {
+            pos = atomic_load_explicit( &ch->tail, memory_order_relaxed );
+        }
+    }
+
+    msg = cell->msg;
+    atomic_store_explicit( &cell->seq, pos + ch->mask + 1,
+                           memory_order_release );
+
+    return msg;
+}
+
+
+// dequeue up to n messages by claiming the ready cells at once. returns the
+// number of the messages
+static size_t dequeue_many( lpt_channel_t *ch, lpt_msg_t **msgs, size_t n )
+{
+    size_t pos = atomic_load_explicit( &ch->tail, memory_order_relaxed );
+    size_t i = 0;
+    intptr_t dif = 0;
+
+    for(;;)
+    {
+        // count the ready cells from the tail
+        for( i = 0; i < n; i++ ){
+            cell_t *cell = &ch->cells[( pos + i ) & ch->mask];
+
+            dif = (intptr_t)atomic_load_explicit( &cell->seq,
+                                                  memory_order_acquire ) -
+                  (intptr_t)( pos + i + 1 );
+            if( dif ){
+                break;
+            }
+        }
+        if( i ){
+            if( atomic_compare_exchange_weak_explicit( &ch->tail, &pos,
+                                                       pos + i,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed ) ){
+                break;
+            }
+        }
+        // empty
+        else if( dif < 0 ){
+            return 0;
+        }
+        else {
+            pos = atomic_load_explicit( &ch->tail, memory_order_relaxed );
+        }
+    }
+
+    for( n = 0; n < i; n++ ){
+        cell_t *cell = &ch->cells[( pos + n ) & ch->mask];
+
+        msgs[n] = cell->msg;
+        atomic_store_explicit( &cell->seq, pos + n + ch->mask + 1,
+                               memory_order_release );
+    }
+
+    return i;
+}
+
+
+// wake up the sleeping threads if exists
+static inline void wakeup( lpt_channel_t *ch, atomic_int *nwait,
+                           pthread_cond_t *cond )
+{
+    atomic_thread_fence( memory_order_seq_cst );
+    if( atomic_load_explicit( nwait, memory_order_relaxed ) ){
+        pthread_mutex_lock( &ch->mutex );
+        pthread_cond_broadcast( cond );
+        pthread_mutex_unlock( &ch->mutex );
+    }
+}
+
+
+// wait until abstime if block is set, or forever if abstime is NULL. returns
+// 0 on success, or errno
+static int send_msg( lpt_channel_t *ch, lpt_msg_t *msg, int block,
+                     const struct timespec *abstime )
+{
+    int rc = 0;
+
+    if( atomic_load( &ch->closed ) ){
+        return EPIPE;
+    }
+    else if( enqueue( ch, msg ) == 0 ){
+        wakeup( ch, &ch->nrecvwait, &ch->notempty );
+        lpt_notify_signal( &ch->notify );
+        return 0;
+    }
+    else if( !block ){
+        return EAGAIN;
+    }
+
+    // slow path: sleep until the queue has a space
+    pthread_mutex_lock( &ch->mutex );
+    atomic_fetch_add( &ch->nsendwait, 1 );
+    atomic_thread_fence( memory_order_seq_cst );
+    while( ( rc = enqueue( ch, msg ) ) ){
+        if( atomic_load( &ch->closed ) ){
+            rc = EPIPE;
+            break;
+        }
+        else if( ( rc = lpt_cancel_wait( &ch->notfull, &ch->mutex,
+                                         abstime ) ) ){
+            break;
+        }
+    }
+    atomic_fetch_sub( &ch->nsendwait, 1 );
+    pthread_mutex_unlock( &ch->mutex );
+
+    if( rc == 0 ){
+        wakeup( ch, &ch->nrecvwait, &ch->notempty );
+        lpt_notify_signal( &ch->notify );
+    }
+
+    return rc;
+}
+
+
+static inline int isempty( lpt_channel_t *ch )
+{
+    return atomic_load( &ch->head ) == atomic_load( &ch->tail );
+}
+
+
+// receive up to n messages. wait until abstime if block is set, or forever
+// if abstime is NULL. returns 0 and set ECANCELED or ETIMEDOUT to rc if
+// failed to wait
+static size_t recv_msgs( lpt_channel_t *ch, lpt_msg_t **msgs, size_t n,
+                         int block, const struct timespec *abstime, int *rc )
+{
+    int notify = atomic_load_explicit( &ch->notify.ready,
+                                       memory_order_acquire );
+    size_t nmsg = 0;
+
+    // clear the descriptor before dequeue. the sender enqueues before
+    // signaling, so the values sent after the check below are signaled again
+    if( notify ){
+        lpt_notify_clear( &ch->notify );
+    }
+    *rc = 0;
+    nmsg = dequeue_many( ch, msgs, n );
+
+    if( !nmsg && block )
+    {
+        // slow path: sleep until the queue has a value
+        pthread_mutex_lock( &ch->mutex );
+        atomic_fetch_add( &ch->nrecvwait, 1 );
+        atomic_thread_fence( memory_order_seq_cst );
+        while( !( nmsg = dequeue_many( ch, msgs, n ) ) &&
+               !atomic_load( &ch->closed ) &&
+               !( *rc = lpt_cancel_wait( &ch->notempty, &ch->mutex,
+                                         abstime ) ) );
+        atomic_fetch_sub( &ch->nrecvwait, 1 );
+        pthread_mutex_unlock( &ch->mutex );
+    }
+
+    if( nmsg ){
+        wakeup( ch, &ch->nsendwait, &ch->notfull );
+    }
+    if( notify && ( !isempty( ch ) || atomic_load( &ch->closed ) ) ){
+        lpt_notify_signal( &ch->notify );
+    }
+
+    return nmsg;
+}
+
+
+static lpt_msg_t *recv_msg( lpt_channel_t *ch, int block,
+                            const struct timespec *abstime, int *rc )
+{
+    lpt_msg_t *msg = NULL;
+
+    recv_msgs( ch, &msg, 1, block, abstime, rc );
+
+    return msg;
+}
+
+
+static void msg_free( lpt_msg_t *msg )
+{
+    if( msg->nref ){
+        lpt_discard( msg->data, msg->len );
+    }
+    free( msg );
+}
+
+
+static void channel_free( lpt_shared_t *obj )
+{
+    lpt_channel_t *ch = (lpt_channel_t*)obj;
+    lpt_msg_t *msg = NULL;
+
+    while( ( msg = dequeue( ch ) ) ){
+        msg_free( msg );
+    }
+    lpt_notify_close( &ch->notify );
+    pthread_cond_destroy( &ch->notfull );
+    pthread_cond_destroy( &ch->notempty );
+    pthread_mutex_destroy( &ch->mutex );
+    free( ch->cells );
+    free( ch );
+}
+
+
+static const lpt_shared_type_t CHANNEL_TYPE = {
+    .tname = CHANNEL_MT,
+    .init = lpt_channel_init,
+    .free = channel_free
+};
+
+
+static inline lpt_channel_t *checkchannel( lua_State *L )
+{
+    return (lpt_channel_t*)lpt_shared_check( L, 1, CHANNEL_MT );
+}
+
+
+// send the value at the top of the stack. returns 0 on success, or errno
+static int sendtop( lua_State *L, lpt_channel_t *ch, int block,
+                    const struct timespec *abstime )
+{
+    lpt_buf_t buf = { 0 };
+    lpt_msg_t *msg = NULL;
+    const char *err = NULL;
+    int rc = 0;
+
+    if( lpt_buf_reserve( &buf, sizeof( lpt_msg_t ) ) ){
+        return errno;
+    }
+    buf.len = sizeof( lpt_msg_t );
+    if( ( err = lpt_encode( L, lua_gettop( L ), &buf ) ) ){
+        lpt_buf_free( &buf );
+        return luaL_error( L, "%s", err );
+    }
+    msg = (lpt_msg_t*)buf.data;
+    msg->len = buf.len - sizeof( lpt_msg_t );
+    msg->nref = buf.nref;
+
+    if( ( rc = send_msg( ch, msg, block, abstime ) ) ){
+        msg_free( msg );
+    }
+
+    return rc;
+}
+
+
+int lpt_channel_send( lua_State *L, lpt_shared_t *obj, int block )
+{
+    return sendtop( L, (lpt_channel_t*)obj, block, NULL );
+}
+
+
+static int dosend( lua_State *L, lpt_channel_t *ch, int block,
+                   const struct timespec *abstime )
+{
+    int rc = 0;
+
+    luaL_argcheck( L, !lua_isnoneornil( L, 2 ), 2, "value must not be nil" );
+    lua_settop( L, 2 );
+
+    if( ( rc = sendtop( L, ch, block, abstime ) ) ){
+        if( rc == ECANCELED ){
+            return lpt_cancel_error( L );
+        }
+        lua_pushboolean( L, 0 );
+        // full
+        if( rc == ETIMEDOUT || rc == EAGAIN ){
+            return 1;
+        }
+        lua_pushstring( L, strerror( rc ) );
+        return 2;
+    }
+    lua_pushboolean( L, 1 );
+
+    return 1;
+}
+
+
+static int send_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+    struct timespec ts = { 0 };
+    struct timespec *abstime = NULL;
+
+    abstime = lpt_timeout_abstime( L, 3, &ts );
+
+    return dosend( L, ch, 1, abstime );
+}
+
+
+static int try_send_lua( lua_State *L )
+{
+    return dosend( L, checkchannel( L ), 0, NULL );
+}
+
+
+static int push_msg( lua_State *L, lpt_msg_t *msg )
+{
+    int rc = lpt_decode( L, msg->data, msg->len );
+
+    msg_free( msg );
+    if( rc < 0 ){
+        return luaL_error( L, "failed to decode a value" );
+    }
+
+    return rc;
+}
+
+
+static int recv_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+    struct timespec ts = { 0 };
+    struct timespec *abstime = NULL;
+    lpt_msg_t *msg = NULL;
+    int rc = 0;
+
+    abstime = lpt_timeout_abstime( L, 2, &ts );
+
+    if( ( msg = recv_msg( ch, 1, abstime, &rc ) ) ){
+        return push_msg( L, msg );
+    }
+    else if( rc == ECANCELED ){
+        return lpt_cancel_error( L );
+    }
+    // empty
+    else if( rc == ETIMEDOUT ){
+        lua_pushnil( L );
+        return 1;
+    }
+
+    // closed
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( EPIPE ) );
+
+    return 2;
+}
+
+
+static int try_recv_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+    int rc = 0;
+    lpt_msg_t *msg = recv_msg( ch, 0, NULL, &rc );
+
+    if( msg ){
+        return push_msg( L, msg );
+    }
+    else if( atomic_load( &ch->closed ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( EPIPE ) );
+        return 2;
+    }
+
+    // empty
+    lua_pushnil( L );
+
+    return 1;
+}
+
+
+static int recv_many_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+    lua_Integer n = lauxh_checkinteger( L, 2 );
+    struct timespec ts = { 0 };
+    struct timespec *abstime = NULL;
+    lpt_msg_t *msgs[RECV_BATCH];
+    size_t nmsg = 0;
+    size_t i = 0;
+    int count = 0;
+    int rc = 0;
+
+    luaL_argcheck( L, n > 0 && n <= INT_MAX, 2, "n must be greater than 0" );
+    abstime = lpt_timeout_abstime( L, 3, &ts );
+    lua_settop( L, 3 );
+    lua_createtable( L, n < RECV_BATCH ? (int)n : RECV_BATCH, 0 );
+
+    // wait for the first values, then take the rest without blocking
+    nmsg = recv_msgs( ch, msgs, n < RECV_BATCH ? (size_t)n : RECV_BATCH, 1,
+                      abstime, &rc );
+    while( nmsg )
+    {
+        for( i = 0; i < nmsg; i++ ){
+            if( lpt_decode( L, msgs[i]->data, msgs[i]->len ) < 0 ){
+                for(; i < nmsg; i++ ){
+                    msg_free( msgs[i] );
+                }
+                return luaL_error( L, "failed to decode a value" );
+            }
+            msg_free( msgs[i] );
+            lua_rawseti( L, 4, ++count );
+        }
+        if( count == n ){
+            break;
+        }
+        nmsg = recv_msgs( ch, msgs, n - count < RECV_BATCH ?
+                                   (size_t)( n - count ) : RECV_BATCH, 0,
+                          NULL, &rc );
+    }
+
+    if( count || rc == ETIMEDOUT ){
+        return 1;
+    }
+    else if( rc == ECANCELED ){
+        return lpt_cancel_error( L );
+    }
+
+    // closed
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( EPIPE ) );
+
+    return 2;
+}
+
+
+static int len_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+    size_t head = atomic_load_explicit( &ch->head, memory_order_relaxed );
+    size_t tail = atomic_load_explicit( &ch->tail, memory_order_relaxed );
+
+    // approximate value while other threads are running
+    lua_pushinteger( L, head > tail ? (lua_Integer)( head - tail ) : 0 );
+
+    return 1;
+}
+
+
+static int cap_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+
+    lua_pushinteger( L, (lua_Integer)( ch->mask + 1 ) );
+
+    return 1;
+}
+
+
+static int close_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+
+    atomic_store( &ch->closed, 1 );
+    pthread_mutex_lock( &ch->mutex );
+    pthread_cond_broadcast( &ch->notempty );
+    pthread_cond_broadcast( &ch->notfull );
+    pthread_mutex_unlock( &ch->mutex );
+    lpt_notify_signal( &ch->notify );
+
+    return 0;
+}
+
+
+static int fd_lua( lua_State *L )
+{
+    lpt_channel_t *ch = checkchannel( L );
+    int rc = 0;
+
+    pthread_mutex_lock( &ch->mutex );
+    if( !( rc = lpt_notify_open( &ch->notify ) ) &&
+        ( !isempty( ch ) || atomic_load( &ch->closed ) ) ){
+        lpt_notify_signal( &ch->notify );
+    }
+    pthread_mutex_unlock( &ch->mutex );
+
+    if( rc ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( rc ) );
+        return 2;
+    }
+    lua_pushinteger( L, ch->notify.rfd );
+
+    return 1;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, CHANNEL_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_channel_new( lua_State *L )
+{
+    lua_Integer n = luaL_optinteger( L, 1, 1024 );
+    lpt_channel_t *ch = NULL;
+    size_t cap = 2;
+    size_t i = 0;
+
+    luaL_argcheck( L, n > 0, 1, "capacity must be greater than 0" );
+    // the rounded capacity must not overflow the size of the cells
+    luaL_argcheck( L, (uintmax_t)n <= SIZE_MAX / ( 2 * sizeof( cell_t ) ), 1,
+                   "capacity is too large" );
+    // capacity is rounded up to the power of 2 and at least 2, since the
+    // sequence of a cell cannot tell a full queue from an empty one if the
+    // queue has only one cell
+    while( cap < (size_t)n ){
+        cap <<= 1;
+    }
+
+    if( !( ch = calloc( 1, sizeof( lpt_channel_t ) ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    else if( !( ch->cells = malloc( sizeof( cell_t ) * cap ) ) ){
+        free( ch );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    for(; i < cap; i++ ){
+        atomic_init( &ch->cells[i].seq, i );
+        ch->cells[i].msg = NULL;
+    }
+    ch->mask = cap - 1;
+    atomic_init( &ch->head, 0 );
+    atomic_init( &ch->tail, 0 );
+    atomic_init( &ch->closed, 0 );
+    atomic_init( &ch->nrecvwait, 0 );
+    atomic_init( &ch->nsendwait, 0 );
+    pthread_mutex_init( &ch->mutex, NULL );
+    lpt_cond_init( &ch->notempty );
+    lpt_cond_init( &ch->notfull );
+    lpt_notify_init( &ch->notify );
+    ch->shared.type = &CHANNEL_TYPE;
+    atomic_init( &ch->shared.refcnt, 0 );
+
+    lpt_shared_push( L, (lpt_shared_t*)ch );
+
+    return 1;
+}
+
+
+void lpt_channel_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "send", send_lua },
+        { "try_send", try_send_lua },
+        { "recv", recv_lua },
+        { "recv_many", recv_many_lua },
+        { "try_recv", try_recv_lua },
+        { "len", len_lua },
+        { "cap", cap_lua },
+        { "close", close_lua },
+        { "fd", fd_lua },
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &CHANNEL_TYPE, mmethod, method );
+    lpt_await_register( L, CHANNEL_MT, "channel" );
+}
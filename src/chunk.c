@@ -0,0 +1,189 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  chunk.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  dumped functions are cached in the weak table of the registry so that
+ *  spawning the same function again does not dump it again.
+ */
+
+#include "lpthread.h"
+
+#define CHUNK_CACHE "pthread.chunk.cache"
+
+
+static void chunk_free( lpt_shared_t *obj )
+{
+    free( obj );
+}
+
+
+static const lpt_shared_type_t CHUNK_TYPE = {
+    .tname = CHUNK_MT,
+    .init = lpt_chunk_init,
+    .free = chunk_free
+};
+
+
+static lpt_chunk_t *chunk_new( lpt_buf_t *b )
+{
+    lpt_chunk_t *chunk = (lpt_chunk_t*)b->data;
+
+    atomic_init( &chunk->shared.refcnt, 1 );
+    chunk->shared.type = &CHUNK_TYPE;
+    chunk->len = b->len - sizeof( lpt_chunk_t );
+
+    return chunk;
+}
+
+
+static int dumpcb( lua_State *L, const void* chunk, size_t bytes, void* buf )
+{
+    lpt_buf_t *b = (lpt_buf_t*)buf;
+
+    (void)L;
+    if( lpt_buf_reserve( b, bytes ) ){
+        return -1;
+    }
+    memcpy( b->data + b->len, chunk, bytes );
+    b->len += bytes;
+
+    return 0;
+}
+
+
+static lpt_chunk_t *dumpfn( lua_State *L, int idx )
+{
+    lpt_buf_t buf = { 0 };
+
+    if( lpt_buf_reserve( &buf, sizeof( lpt_chunk_t ) ) ){
+        luaL_error( L, "%s", strerror( errno ) );
+    }
+    buf.len = sizeof( lpt_chunk_t );
+
+    lua_pushvalue( L, idx );
+    if( lpt_dump( L, dumpcb, &buf ) != 0 ){
+        lpt_buf_free( &buf );
+        luaL_error( L, "unable to dump given function" );
+    }
+    lua_pop( L, 1 );
+
+    return chunk_new( &buf );
+}
+
+
+static lpt_chunk_t *loadstr( lua_State *L, int idx )
+{
+    lpt_buf_t buf = { 0 };
+    size_t len = 0;
+    const char *str = lua_tolstring( L, idx, &len );
+
+    if( lpt_buf_reserve( &buf, sizeof( lpt_chunk_t ) + len ) ){
+        luaL_error( L, "%s", strerror( errno ) );
+    }
+    memcpy( buf.data + sizeof( lpt_chunk_t ), str, len );
+    buf.len = sizeof( lpt_chunk_t ) + len;
+
+    return chunk_new( &buf );
+}
+
+
+static void getcache( lua_State *L )
+{
+    lua_getfield( L, LUA_REGISTRYINDEX, CHUNK_CACHE );
+    // pthread module has not been loaded into this state
+    if( lua_isnil( L, -1 ) ){
+        lua_pop( L, 1 );
+        lpt_chunk_init( L );
+        lua_getfield( L, LUA_REGISTRYINDEX, CHUNK_CACHE );
+    }
+}
+
+
+lpt_chunk_t *lpt_checkfn( lua_State *L, int idx )
+{
+    lpt_chunk_t *chunk = NULL;
+
+    // check function argument
+    switch( lua_type( L, idx ) )
+    {
+        case LUA_TFUNCTION:
+            // lookup cache
+            getcache( L );
+            lua_pushvalue( L, idx );
+            lua_rawget( L, -2 );
+            if( ( chunk = (lpt_chunk_t*)lpt_shared_test( L, -1 ) ) ){
+                lpt_shared_retain( (lpt_shared_t*)chunk );
+                lua_pop( L, 2 );
+                return chunk;
+            }
+            lua_pop( L, 1 );
+
+            chunk = dumpfn( L, idx );
+            // cache[fn] = chunk
+            lua_pushvalue( L, idx );
+            lpt_shared_push( L, (lpt_shared_t*)chunk );
+            lua_rawset( L, -3 );
+            lua_pop( L, 1 );
+            return chunk;
+
+        case LUA_TSTRING:
+            // function strings are not cached because strings are never
+            // removed from the weak table
+            return loadstr( L, idx );
+
+        default:
+            luaL_error( L, "fn must be function or function string");
+    }
+
+    return NULL;
+}
+
+
+void lpt_chunk_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &CHUNK_TYPE, mmethod, method );
+
+    // create the cache table with weak keys
+    lua_getfield( L, LUA_REGISTRYINDEX, CHUNK_CACHE );
+    if( lua_isnil( L, -1 ) ){
+        lua_pop( L, 1 );
+        lua_newtable( L );
+        lua_newtable( L );
+        lua_pushliteral( L, "k" );
+        lua_setfield( L, -2, "__mode" );
+        lua_setmetatable( L, -2 );
+        lua_setfield( L, LUA_REGISTRYINDEX, CHUNK_CACHE );
+    }
+    else {
+        lua_pop( L, 1 );
+    }
+}
@@ -0,0 +1,781 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  codec.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  values are encoded into a flat byte sequence so that they can be passed
+ *  to another state running on another thread. the tables and the long
+ *  strings that appear more than once are encoded as references to the first
+ *  occurrence, so that the cycles of the tables are preserved. the userdata
+ *  of the registered transfer hooks are encoded as their payloads and
+ *  referenced in the same way.
+ */
+
+#include <math.h>
+#include "lpthread.h"
+
+#define CODEC_MAXDEPTH  128
+// strings shorter than this are not interned
+#define CODEC_INTERN    16
+
+enum {
+    TAG_NIL = 0,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUMBER,
+    TAG_STRING,
+    TAG_TABLE,
+    TAG_END,
+    TAG_SHARED,
+    // zigzag encoded variable length integer
+    TAG_INTEGER,
+    // number of the table or the string that has already been encoded
+    TAG_REF,
+    // dumped lua function
+    TAG_FUNCTION,
+    // payload of the userdata packed by the transfer hook
+    TAG_USERDATA
+};
+
+
+int lpt_buf_reserve( lpt_buf_t *b, size_t len )
+{
+    if( b->cap - b->len < len )
+    {
+        size_t cap = b->cap ? b->cap : 64;
+        char *data = NULL;
+
+        while( cap - b->len < len ){
+            cap <<= 1;
+        }
+        if( !( data = realloc( b->data, cap ) ) ){
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+
+    return 0;
+}
+
+
+void lpt_buf_free( lpt_buf_t *b )
+{
+    if( b->data ){
+        free( b->data );
+    }
+    b->data = NULL;
+    b->len = b->cap = b->nref = b->nobj = 0;
+}
+
+
+static inline int buf_add( lpt_buf_t *b, const void *data, size_t len )
+{
+    if( lpt_buf_reserve( b, len ) == 0 ){
+        memcpy( b->data + b->len, data, len );
+        b->len += len;
+        return 0;
+    }
+    return -1;
+}
+
+
+static inline int buf_addtag( lpt_buf_t *b, uint8_t tag )
+{
+    return buf_add( b, &tag, 1 );
+}
+
+
+static inline int buf_addvarint( lpt_buf_t *b, uint64_t v )
+{
+    uint8_t bytes[10];
+    size_t len = 0;
+
+    while( v >= 0x80 ){
+        bytes[len++] = (uint8_t)( v | 0x80 );
+        v >>= 7;
+    }
+    bytes[len++] = (uint8_t)v;
+
+    return buf_add( b, bytes, len );
+}
+
+
+// map of the addresses of the encoded tables and strings to their numbers
+typedef struct {
+    size_t size;
+    size_t used;
+    const void **keys;
+    size_t *vals;
+} refmap_t;
+
+
+static inline size_t hashptr( const void *ptr, size_t size )
+{
+    uintptr_t h = (uintptr_t)ptr;
+
+    h ^= h >> 17;
+    h *= (uintptr_t)0x9E3779B97F4A7C15ULL;
+    return (size_t)( h >> 7 ) & ( size - 1 );
+}
+
+
+static size_t refmap_get( refmap_t *m, const void *key )
+{
+    size_t i = 0;
+
+    if( m->size ){
+        for( i = hashptr( key, m->size ); m->keys[i];
+             i = ( i + 1 ) & ( m->size - 1 ) ){
+            if( m->keys[i] == key ){
+                return m->vals[i];
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static int refmap_set( refmap_t *m, const void *key, size_t val )
+{
+    size_t i = 0;
+
+    // keep the load factor under 1/2
+    if( ( m->used + 1 ) * 2 > m->size )
+    {
+        refmap_t nm = {
+            .size = m->size ? m->size * 2 : 64,
+            .used = 0
+        };
+
+        if( !( nm.keys = calloc( nm.size, sizeof( void* ) ) ) ){
+            return -1;
+        }
+        else if( !( nm.vals = malloc( nm.size * sizeof( size_t ) ) ) ){
+            free( nm.keys );
+            return -1;
+        }
+        for(; i < m->size; i++ ){
+            if( m->keys[i] ){
+                refmap_set( &nm, m->keys[i], m->vals[i] );
+            }
+        }
+        free( m->keys );
+        free( m->vals );
+        *m = nm;
+    }
+
+    for( i = hashptr( key, m->size ); m->keys[i];
+         i = ( i + 1 ) & ( m->size - 1 ) );
+    m->keys[i] = key;
+    m->vals[i] = val;
+    m->used++;
+
+    return 0;
+}
+
+
+static void refmap_free( refmap_t *m )
+{
+    if( m->size ){
+        free( m->keys );
+        free( m->vals );
+    }
+}
+
+
+typedef struct {
+    lpt_buf_t *b;
+    refmap_t refs;
+} encoder_t;
+
+
+#define ENOMEM_MSG  "not enough memory"
+
+// encode the reference if the value has already been encoded. otherwise,
+// number the value. returns 1 if encoded
+static inline int encode_ref( encoder_t *e, const void *ptr, const char **err )
+{
+    size_t id = refmap_get( &e->refs, ptr );
+
+    if( id ){
+        if( buf_addtag( e->b, TAG_REF ) || buf_addvarint( e->b, id ) ){
+            *err = ENOMEM_MSG;
+        }
+        return 1;
+    }
+    else if( refmap_set( &e->refs, ptr, ++e->b->nobj ) ){
+        *err = ENOMEM_MSG;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int dumpcb( lua_State *L, const void* chunk, size_t bytes, void* buf )
+{
+    (void)L;
+    return buf_add( (lpt_buf_t*)buf, chunk, bytes );
+}
+
+
+static const char *encode_function( lua_State *L, int idx, lpt_buf_t *b )
+{
+    size_t pos = 0;
+    size_t len = 0;
+
+    if( lua_iscfunction( L, idx ) ){
+        return "cannot encode C function value";
+    }
+    else if( !lua_checkstack( L, 1 ) ){
+        return "stack overflow";
+    }
+    // reserve the length field
+    else if( buf_addtag( b, TAG_FUNCTION ) || buf_add( b, &len, sizeof( len ) ) ){
+        return ENOMEM_MSG;
+    }
+    pos = b->len;
+    lua_pushvalue( L, idx );
+    if( lpt_dump( L, dumpcb, b ) != 0 ){
+        lua_pop( L, 1 );
+        return "unable to dump function value";
+    }
+    lua_pop( L, 1 );
+    len = b->len - pos;
+    memcpy( b->data + pos - sizeof( len ), &len, sizeof( len ) );
+
+    return NULL;
+}
+
+
+static const char *encode_userdata( lua_State *L, int idx, encoder_t *e )
+{
+    lpt_buf_t *b = e->b;
+    const lpt_transfer_t *hook = lpt_transfer_test( L, idx );
+    const char *err = NULL;
+    void *payload = NULL;
+
+    if( !hook ){
+        return "cannot encode userdata value";
+    }
+    // make index absolute
+    else if( idx < 0 ){
+        idx = lua_gettop( L ) + idx + 1;
+    }
+    // the same userdata is packed only once
+    if( encode_ref( e, lua_touserdata( L, idx ), &err ) ){
+        return err;
+    }
+    else if( lpt_buf_reserve( b, 1 + sizeof( void* ) * 2 ) ){
+        return ENOMEM_MSG;
+    }
+    else if( !( payload = hook->pack( L, idx, &err ) ) ){
+        return err ? err : "unable to pack userdata value";
+    }
+    buf_addtag( b, TAG_USERDATA );
+    buf_add( b, &hook, sizeof( lpt_transfer_t* ) );
+    buf_add( b, &payload, sizeof( void* ) );
+    // encoded data holds the payload
+    b->nref++;
+
+    return NULL;
+}
+
+
+static const char *encode_number( lua_State *L, int idx, lpt_buf_t *b )
+{
+    lua_Number num = lua_tonumber( L, idx );
+    int64_t ival = 0;
+
+#if LUA_VERSION_NUM >= 503
+    if( lua_isinteger( L, idx ) ){
+        ival = (int64_t)lua_tointeger( L, idx );
+    }
+    else
+#else
+    // integral numbers are encoded as integers since they are more compact
+    if( num >= -9007199254740992.0 && num <= 9007199254740992.0 &&
+        num == (lua_Number)(int64_t)num && !( num == 0 && signbit( num ) ) ){
+        ival = (int64_t)num;
+    }
+    else
+#endif
+    {
+        if( buf_addtag( b, TAG_NUMBER ) ||
+            buf_add( b, &num, sizeof( lua_Number ) ) ){
+            return ENOMEM_MSG;
+        }
+        return NULL;
+    }
+
+    if( buf_addtag( b, TAG_INTEGER ) ||
+        buf_addvarint( b, ( (uint64_t)ival << 1 ) ^ (uint64_t)( ival >> 63 ) ) ){
+        return ENOMEM_MSG;
+    }
+
+    return NULL;
+}
+
+
+static const char *encode_value( lua_State *L, int idx, encoder_t *e,
+                                 int depth )
+{
+    lpt_buf_t *b = e->b;
+    const char *err = NULL;
+    const char *str = NULL;
+    size_t len = 0;
+    lpt_shared_t *obj = NULL;
+
+    switch( lua_type( L, idx ) )
+    {
+        case LUA_TNONE:
+        case LUA_TNIL:
+            return buf_addtag( b, TAG_NIL ) ? ENOMEM_MSG : NULL;
+
+        case LUA_TBOOLEAN:
+            return buf_addtag( b, lua_toboolean( L, idx ) ? TAG_TRUE :
+                                  TAG_FALSE ) ? ENOMEM_MSG : NULL;
+
+        case LUA_TNUMBER:
+            return encode_number( L, idx, b );
+
+        case LUA_TSTRING:
+            str = lua_tolstring( L, idx, &len );
+            if( len >= CODEC_INTERN && encode_ref( e, str, &err ) ){
+                return err;
+            }
+            else if( buf_addtag( b, TAG_STRING ) ||
+                     buf_add( b, &len, sizeof( size_t ) ) ||
+                     buf_add( b, str, len ) ){
+                return ENOMEM_MSG;
+            }
+            return NULL;
+
+        case LUA_TTABLE:
+            if( encode_ref( e, lua_topointer( L, idx ), &err ) ){
+                return err;
+            }
+            else if( depth >= CODEC_MAXDEPTH ){
+                return "table nesting too deep";
+            }
+            else if( !lua_checkstack( L, 3 ) ){
+                return "stack overflow";
+            }
+            else if( buf_addtag( b, TAG_TABLE ) ){
+                return ENOMEM_MSG;
+            }
+            // make index absolute
+            if( idx < 0 ){
+                idx = lua_gettop( L ) + idx + 1;
+            }
+            lua_pushnil( L );
+            while( lua_next( L, idx ) )
+            {
+                if( ( err = encode_value( L, -2, e, depth + 1 ) ) ||
+                    ( err = encode_value( L, -1, e, depth + 1 ) ) ){
+                    lua_pop( L, 2 );
+                    return err;
+                }
+                lua_pop( L, 1 );
+            }
+            return buf_addtag( b, TAG_END ) ? ENOMEM_MSG : NULL;
+
+        case LUA_TFUNCTION:
+            return encode_function( L, idx, b );
+
+        case LUA_TUSERDATA:
+            if( ( obj = lpt_shared_test( L, idx ) ) ){
+                if( buf_addtag( b, TAG_SHARED ) ||
+                    buf_add( b, &obj, sizeof( lpt_shared_t* ) ) ){
+                    return ENOMEM_MSG;
+                }
+                // encoded data holds a reference
+                lpt_shared_retain( obj );
+                b->nref++;
+                return NULL;
+            }
+            return encode_userdata( L, idx, e );
+        case LUA_TTHREAD:
+            return "cannot encode thread value";
+        default:
+            return "cannot encode lightuserdata value";
+    }
+}
+
+
+// restore the buffer to the position before encoding
+static void rollback( lpt_buf_t *b, size_t len, size_t nref, size_t nobj )
+{
+    if( b->nref != nref ){
+        lpt_discard( b->data + len, b->len - len );
+    }
+    b->len = len;
+    b->nref = nref;
+    b->nobj = nobj;
+}
+
+
+const char *lpt_encode( lua_State *L, int idx, lpt_buf_t *b )
+{
+    int top = lua_gettop( L );
+    size_t len = b->len;
+    size_t nref = b->nref;
+    size_t nobj = b->nobj;
+    encoder_t e = {
+        .b = b
+    };
+    const char *err = NULL;
+
+    for(; idx <= top; idx++ )
+    {
+        if( ( err = encode_value( L, idx, &e, 0 ) ) ){
+            // release the references taken so far
+            rollback( b, len, nref, nobj );
+            break;
+        }
+    }
+    refmap_free( &e.refs );
+
+    return err;
+}
+
+
+const char *lpt_encode_slice( lua_State *L, int idx, int from, int to,
+                              lpt_buf_t *b )
+{
+    size_t len = b->len;
+    size_t nref = b->nref;
+    size_t nobj = b->nobj;
+    encoder_t e = {
+        .b = b
+    };
+    const char *err = NULL;
+    int i = from;
+
+    if( !lua_checkstack( L, 2 ) ){
+        return "stack overflow";
+    }
+    // the slice is a new table that is numbered as well
+    else if( buf_addtag( b, TAG_TABLE ) ){
+        return ENOMEM_MSG;
+    }
+    b->nobj++;
+    for(; i <= to && !err; i++ )
+    {
+        lua_rawgeti( L, idx, i );
+        // holes are skipped as the table encoder does
+        if( !lua_isnil( L, -1 ) )
+        {
+            lua_pushinteger( L, i - from + 1 );
+            if( !( err = encode_value( L, -1, &e, 1 ) ) ){
+                err = encode_value( L, -2, &e, 1 );
+            }
+            lua_pop( L, 1 );
+        }
+        lua_pop( L, 1 );
+    }
+    if( !err && buf_addtag( b, TAG_END ) ){
+        err = ENOMEM_MSG;
+    }
+    refmap_free( &e.refs );
+
+    if( err ){
+        rollback( b, len, nref, nobj );
+    }
+
+    return err;
+}
+
+
+typedef struct {
+    const char *cur;
+    const char *end;
+    // stack index of the table of the numbered values
+    int refs;
+    int nobj;
+} decoder_t;
+
+
+static int decode_varint( decoder_t *d, uint64_t *v )
+{
+    int shift = 0;
+
+    *v = 0;
+    while( d->cur < d->end && shift < 64 )
+    {
+        uint8_t byte = *(uint8_t*)d->cur++;
+
+        *v |= (uint64_t)( byte & 0x7f ) << shift;
+        if( !( byte & 0x80 ) ){
+            return 0;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+
+// number the value at the top
+static inline void decode_numbering( lua_State *L, decoder_t *d )
+{
+    lua_pushvalue( L, -1 );
+    lua_rawseti( L, d->refs, ++d->nobj );
+}
+
+
+static int decode_userdata( lua_State *L, decoder_t *d )
+{
+    const lpt_transfer_t *hook = NULL;
+    void *payload = NULL;
+    int top = lua_gettop( L );
+
+    if( (size_t)( d->end - d->cur ) < sizeof( void* ) * 2 ){
+        return -1;
+    }
+    memcpy( &hook, d->cur, sizeof( lpt_transfer_t* ) );
+    memcpy( &payload, d->cur + sizeof( lpt_transfer_t* ), sizeof( void* ) );
+    d->cur += sizeof( void* ) * 2;
+    if( hook->unpack( L, payload ) || lua_gettop( L ) != top + 1 ){
+        lua_settop( L, top );
+        return -1;
+    }
+    decode_numbering( L, d );
+
+    return 0;
+}
+
+
+static int decode_value( lua_State *L, decoder_t *d, int depth )
+{
+    lua_Number num = 0;
+    uint64_t uval = 0;
+    size_t len = 0;
+    lpt_shared_t *obj = NULL;
+
+    if( d->cur >= d->end || !lua_checkstack( L, 3 ) ){
+        return -1;
+    }
+
+    switch( *(uint8_t*)d->cur++ )
+    {
+        case TAG_NIL:
+            lua_pushnil( L );
+            return 0;
+
+        case TAG_FALSE:
+            lua_pushboolean( L, 0 );
+            return 0;
+
+        case TAG_TRUE:
+            lua_pushboolean( L, 1 );
+            return 0;
+
+        case TAG_NUMBER:
+            if( (size_t)( d->end - d->cur ) < sizeof( lua_Number ) ){
+                return -1;
+            }
+            memcpy( &num, d->cur, sizeof( lua_Number ) );
+            d->cur += sizeof( lua_Number );
+            lua_pushnumber( L, num );
+            return 0;
+
+        case TAG_INTEGER:
+            if( decode_varint( d, &uval ) ){
+                return -1;
+            }
+            uval = ( uval >> 1 ) ^ -( uval & 1 );
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger( L, (lua_Integer)(int64_t)uval );
+#else
+            lua_pushnumber( L, (lua_Number)(int64_t)uval );
+#endif
+            return 0;
+
+        case TAG_STRING:
+            if( (size_t)( d->end - d->cur ) < sizeof( size_t ) ){
+                return -1;
+            }
+            memcpy( &len, d->cur, sizeof( size_t ) );
+            d->cur += sizeof( size_t );
+            if( (size_t)( d->end - d->cur ) < len ){
+                return -1;
+            }
+            lua_pushlstring( L, d->cur, len );
+            d->cur += len;
+            if( len >= CODEC_INTERN ){
+                decode_numbering( L, d );
+            }
+            return 0;
+
+        case TAG_REF:
+            if( decode_varint( d, &uval ) || !uval ||
+                uval > (uint64_t)d->nobj ){
+                return -1;
+            }
+            lua_rawgeti( L, d->refs, (int)uval );
+            return 0;
+
+        case TAG_TABLE:
+            if( depth >= CODEC_MAXDEPTH ){
+                return -1;
+            }
+            lua_newtable( L );
+            // numbered before the fields for the cycles
+            decode_numbering( L, d );
+            while( d->cur < d->end && *(uint8_t*)d->cur != TAG_END )
+            {
+                if( decode_value( L, d, depth + 1 ) ||
+                    decode_value( L, d, depth + 1 ) ){
+                    return -1;
+                }
+                // nil key is invalid
+                else if( lua_isnil( L, -2 ) ){
+                    return -1;
+                }
+                lua_rawset( L, -3 );
+            }
+            if( d->cur >= d->end ){
+                return -1;
+            }
+            d->cur++;
+            return 0;
+
+        case TAG_FUNCTION:
+            if( (size_t)( d->end - d->cur ) < sizeof( size_t ) ){
+                return -1;
+            }
+            memcpy( &len, d->cur, sizeof( size_t ) );
+            d->cur += sizeof( size_t );
+            if( (size_t)( d->end - d->cur ) < len ||
+                luaL_loadbuffer( L, d->cur, len, "=encoded" ) ){
+                return -1;
+            }
+            d->cur += len;
+            return 0;
+
+        case TAG_SHARED:
+            if( (size_t)( d->end - d->cur ) < sizeof( lpt_shared_t* ) ){
+                return -1;
+            }
+            memcpy( &obj, d->cur, sizeof( lpt_shared_t* ) );
+            d->cur += sizeof( lpt_shared_t* );
+            lpt_shared_push( L, obj );
+            return 0;
+
+        case TAG_USERDATA:
+            return decode_userdata( L, d );
+
+        default:
+            return -1;
+    }
+}
+
+
+int lpt_decode( lua_State *L, const char *data, size_t len )
+{
+    int top = lua_gettop( L );
+    decoder_t d = {
+        .cur = data,
+        .end = data + len,
+        .refs = top + 1,
+        .nobj = 0
+    };
+
+    if( !lua_checkstack( L, 1 ) ){
+        return -1;
+    }
+    lua_newtable( L );
+    while( d.cur < d.end )
+    {
+        if( decode_value( L, &d, 0 ) ){
+            lua_settop( L, top );
+            return -1;
+        }
+    }
+    lua_remove( L, d.refs );
+
+    return lua_gettop( L ) - top;
+}
+
+
+void lpt_discard( const char *data, size_t len )
+{
+    const char *cur = data;
+    const char *end = data + len;
+    lpt_shared_t *obj = NULL;
+    const lpt_transfer_t *hook = NULL;
+    void *payload = NULL;
+    size_t slen = 0;
+
+    // values are not nested by length so that scan the tags linearly
+    while( cur < end )
+    {
+        switch( *(uint8_t*)cur++ )
+        {
+            case TAG_NUMBER:
+                cur += sizeof( lua_Number );
+                break;
+
+            case TAG_INTEGER:
+            case TAG_REF:
+                while( cur < end && ( *(uint8_t*)cur++ & 0x80 ) );
+                break;
+
+            case TAG_STRING:
+            case TAG_FUNCTION:
+                if( (size_t)( end - cur ) < sizeof( size_t ) ){
+                    return;
+                }
+                memcpy( &slen, cur, sizeof( size_t ) );
+                cur += sizeof( size_t );
+                if( (size_t)( end - cur ) < slen ){
+                    return;
+                }
+                cur += slen;
+                break;
+
+            case TAG_SHARED:
+                if( (size_t)( end - cur ) < sizeof( lpt_shared_t* ) ){
+                    return;
+                }
+                memcpy( &obj, cur, sizeof( lpt_shared_t* ) );
+                cur += sizeof( lpt_shared_t* );
+                lpt_shared_release( obj );
+                break;
+
+            case TAG_USERDATA:
+                if( (size_t)( end - cur ) < sizeof( void* ) * 2 ){
+                    return;
+                }
+                memcpy( &hook, cur, sizeof( lpt_transfer_t* ) );
+                memcpy( &payload, cur + sizeof( lpt_transfer_t* ),
+                        sizeof( void* ) );
+                cur += sizeof( void* ) * 2;
+                hook->free( payload );
+                break;
+        }
+    }
+}
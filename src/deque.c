@@ -0,0 +1,204 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  deque.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  work stealing deque of chase and lev. the owner thread pushes and takes
+ *  items at the bottom, and the other threads steal items from the top.
+ *  based on "correct and efficient work-stealing for weak memory models"
+ *  by le, pop, cohen and zappa nardelli.
+ */
+
+#include "lpthread.h"
+
+#define DEQUE_INITSIZE  64
+
+
+struct lpt_deque_array_s {
+    struct lpt_deque_array_s *prev;
+    intptr_t size;
+    _Atomic(void*) items[];
+};
+
+
+static lpt_deque_array_t *array_new( intptr_t size )
+{
+    lpt_deque_array_t *a = malloc( sizeof( lpt_deque_array_t ) +
+                                   sizeof( void* ) * (size_t)size );
+
+    if( a ){
+        a->prev = NULL;
+        a->size = size;
+    }
+
+    return a;
+}
+
+
+int lpt_deque_init( lpt_deque_t *d )
+{
+    lpt_deque_array_t *a = array_new( DEQUE_INITSIZE );
+
+    if( !a ){
+        return -1;
+    }
+    atomic_init( &d->array, a );
+    atomic_init( &d->top, 0 );
+    atomic_init( &d->bottom, 0 );
+
+    return 0;
+}
+
+
+void lpt_deque_free( lpt_deque_t *d )
+{
+    lpt_deque_array_t *a = atomic_load( &d->array );
+
+    while( a ){
+        lpt_deque_array_t *prev = a->prev;
+        free( a );
+        a = prev;
+    }
+    atomic_init( &d->array, NULL );
+}
+
+
+// the old arrays are kept until the deque is freed since the thieves may
+// still read them
+static lpt_deque_array_t *grow( lpt_deque_t *d, lpt_deque_array_t *a,
+                                intptr_t top, intptr_t bottom )
+{
+    lpt_deque_array_t *na = array_new( a->size * 2 );
+    intptr_t i = top;
+
+    if( !na ){
+        return NULL;
+    }
+    for(; i < bottom; i++ ){
+        atomic_store_explicit( &na->items[i & ( na->size - 1 )],
+                               atomic_load_explicit(
+                                   &a->items[i & ( a->size - 1 )],
+                                   memory_order_relaxed ),
+                               memory_order_relaxed );
+    }
+    na->prev = a;
+    atomic_store_explicit( &d->array, na, memory_order_release );
+
+    return na;
+}
+
+
+int lpt_deque_push( lpt_deque_t *d, void *item )
+{
+    intptr_t b = atomic_load_explicit( &d->bottom, memory_order_relaxed );
+    intptr_t t = atomic_load_explicit( &d->top, memory_order_acquire );
+    lpt_deque_array_t *a = atomic_load_explicit( &d->array,
+                                                 memory_order_relaxed );
+
+    if( b - t > a->size - 1 && !( a = grow( d, a, t, b ) ) ){
+        return -1;
+    }
+    atomic_store_explicit( &a->items[b & ( a->size - 1 )], item,
+                           memory_order_relaxed );
+    atomic_thread_fence( memory_order_release );
+    atomic_store_explicit( &d->bottom, b + 1, memory_order_relaxed );
+
+    return 0;
+}
+
+
+void *lpt_deque_take( lpt_deque_t *d )
+{
+    intptr_t b = atomic_load_explicit( &d->bottom, memory_order_relaxed ) - 1;
+    lpt_deque_array_t *a = atomic_load_explicit( &d->array,
+                                                 memory_order_relaxed );
+    intptr_t t = 0;
+    void *item = NULL;
+
+    atomic_store_explicit( &d->bottom, b, memory_order_relaxed );
+    atomic_thread_fence( memory_order_seq_cst );
+    t = atomic_load_explicit( &d->top, memory_order_relaxed );
+
+    if( t <= b )
+    {
+        item = atomic_load_explicit( &a->items[b & ( a->size - 1 )],
+                                     memory_order_relaxed );
+        // last item: race against the thieves
+        if( t == b ){
+            if( !atomic_compare_exchange_strong_explicit(
+                    &d->top, &t, t + 1, memory_order_seq_cst,
+                    memory_order_relaxed ) ){
+                item = NULL;
+            }
+            atomic_store_explicit( &d->bottom, b + 1, memory_order_relaxed );
+        }
+    }
+    // empty
+    else {
+        atomic_store_explicit( &d->bottom, b + 1, memory_order_relaxed );
+    }
+
+    return item;
+}
+
+
+void *lpt_deque_steal( lpt_deque_t *d, int *retry )
+{
+    intptr_t t = atomic_load_explicit( &d->top, memory_order_acquire );
+    intptr_t b = 0;
+
+    atomic_thread_fence( memory_order_seq_cst );
+    b = atomic_load_explicit( &d->bottom, memory_order_acquire );
+    if( t < b )
+    {
+        lpt_deque_array_t *a = atomic_load_explicit( &d->array,
+                                                     memory_order_acquire );
+        void *item = atomic_load_explicit( &a->items[t & ( a->size - 1 )],
+                                           memory_order_relaxed );
+
+        if( atomic_compare_exchange_strong_explicit( &d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed ) ){
+            return item;
+        }
+        // lost the race against the other thread
+        *retry = 1;
+    }
+
+    return NULL;
+}
+
+
+int lpt_deque_isempty( lpt_deque_t *d )
+{
+    return atomic_load( &d->bottom ) <= atomic_load( &d->top );
+}
+
+
+size_t lpt_deque_size( lpt_deque_t *d )
+{
+    intptr_t b = atomic_load_explicit( &d->bottom, memory_order_relaxed );
+    intptr_t t = atomic_load_explicit( &d->top, memory_order_relaxed );
+
+    return b > t ? (size_t)( b - t ) : 0;
+}
@@ -0,0 +1,142 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  error.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  errors of the functions that run on the threads. the errors are captured
+ *  with the traceback and passed to the caller or the error sink instead of
+ *  being printed by each thread.
+ */
+
+#include "lpthread.h"
+
+
+int lpt_traceback_lua( lua_State *L )
+{
+    const char *msg = lua_tostring( L, 1 );
+
+    // keep the error objects except strings as is
+    if( !msg || LUA_TSTRING != lua_type( L, 1 ) ){
+        lua_settop( L, 1 );
+        return 1;
+    }
+#if LUA_VERSION_NUM >= 502
+    luaL_traceback( L, L, msg, 1 );
+#else
+    // use debug.traceback if the debug library is opened
+    lua_getglobal( L, "debug" );
+    if( lua_istable( L, -1 ) ){
+        lua_getfield( L, -1, "traceback" );
+        if( lua_isfunction( L, -1 ) ){
+            lua_pushvalue( L, 1 );
+            lua_pushinteger( L, 2 );
+            lua_call( L, 2, 1 );
+            return 1;
+        }
+    }
+    lua_settop( L, 1 );
+#endif
+
+    return 1;
+}
+
+
+lpt_shared_t *lpt_error_sink( lua_State *L, int idx )
+{
+    lpt_shared_t *sink = NULL;
+
+    if( !idx ){
+        return NULL;
+    }
+    lua_getfield( L, idx, "errors" );
+    if( !lua_isnil( L, -1 ) ){
+        sink = lpt_shared_check( L, -1, CHANNEL_MT );
+    }
+    lua_pop( L, 1 );
+
+    return sink;
+}
+
+
+// stack: sink, error, id
+static int send_lua( lua_State *L )
+{
+    lpt_shared_t *sink = (lpt_shared_t*)lua_touserdata( L, 1 );
+    lua_Integer id = lua_tointeger( L, 3 );
+
+    lua_createtable( L, 0, 2 );
+    lua_pushvalue( L, 2 );
+    lua_setfield( L, -2, "error" );
+    if( id ){
+        lua_pushinteger( L, id );
+        lua_setfield( L, -2, "id" );
+    }
+    lua_pushinteger( L, lpt_channel_send( L, sink, 0 ) );
+
+    return 1;
+}
+
+
+int lpt_error_send( lua_State *L, lpt_shared_t *sink, uint64_t id )
+{
+    int rc = 0;
+
+    lua_pushcfunction( L, send_lua );
+    lua_pushlightuserdata( L, sink );
+    lua_pushvalue( L, -3 );
+    lua_pushinteger( L, (lua_Integer)id );
+    // the error object cannot be encoded
+    if( lua_pcall( L, 3, 1, 0 ) ){
+        lua_pop( L, 1 );
+        return -1;
+    }
+    rc = (int)lua_tointeger( L, -1 );
+    lua_pop( L, 1 );
+
+    return rc;
+}
+
+
+void lpt_error_log( lua_State *L )
+{
+    char line[1024];
+    const char *msg = lua_tostring( L, -1 );
+    int len = 0;
+
+    if( msg ){
+        len = snprintf( line, sizeof( line ), "lua-pthread: %s\n", msg );
+    }
+    else {
+        len = snprintf( line, sizeof( line ),
+                        "lua-pthread: (error object is a %s value)\n",
+                        luaL_typename( L, -1 ) );
+    }
+    if( len >= (int)sizeof( line ) ){
+        len = sizeof( line ) - 1;
+        line[len - 1] = '\n';
+    }
+    // a single write does not interleave with the other threads
+    if( write( STDERR_FILENO, line, (size_t)len ) < 0 ){
+        return;
+    }
+}
@@ -0,0 +1,779 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  frozen.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  immutable snapshots of the tables. a table is frozen into a flat block of
+ *  the nodes that consist of the array part and the hash part, and shared by
+ *  the threads through the proxy objects without copying. the nested tables
+ *  are accessed through the proxies of their nodes.
+ */
+
+#include "lpthread.h"
+
+#define FROZEN_MAXDEPTH 128
+#define FROZEN_CACHE    "pthread.frozen.cache"
+
+#define align8( n )     ( ( (n) + 7 ) & ~(size_t)7 )
+
+enum {
+    FV_NIL = 0,
+    FV_FALSE,
+    FV_TRUE,
+    FV_NUMBER,
+    FV_INTEGER,
+    FV_STRING,
+    FV_TABLE
+};
+
+
+typedef struct {
+    int type;
+    // length of the string
+    size_t len;
+    union {
+        lua_Number num;
+        int64_t ival;
+        // offset of the string or the node
+        size_t off;
+    } v;
+} fval_t;
+
+
+typedef struct {
+    uint32_t hash;
+    // FV_NIL if empty
+    fval_t key;
+    fval_t val;
+} fslot_t;
+
+
+// followed by fval_t arr[narr] and fslot_t slots[nslot]
+typedef struct {
+    size_t narr;
+    size_t nslot;
+} fnode_t;
+
+
+typedef struct {
+    atomic_int refcnt;
+    size_t len;
+    char data[];
+} froot_t;
+
+
+// proxy of a node
+typedef struct {
+    lpt_shared_t shared;
+    froot_t *root;
+    const fnode_t *node;
+} lpt_frozen_t;
+
+
+static inline fval_t *node_arr( const fnode_t *node )
+{
+    return (fval_t*)( (char*)node + sizeof( fnode_t ) );
+}
+
+
+static inline fslot_t *node_slots( const fnode_t *node )
+{
+    return (fslot_t*)( node_arr( node ) + node->narr );
+}
+
+
+static void root_release( froot_t *root )
+{
+    if( atomic_fetch_sub_explicit( &root->refcnt, 1,
+                                   memory_order_acq_rel ) == 1 ){
+        free( root );
+    }
+}
+
+
+static void frozen_free( lpt_shared_t *obj )
+{
+    lpt_frozen_t *f = (lpt_frozen_t*)obj;
+
+    root_release( f->root );
+    free( f );
+}
+
+
+static const lpt_shared_type_t FROZEN_TYPE = {
+    .tname = FROZEN_MT,
+    .init = lpt_frozen_init,
+    .free = frozen_free
+};
+
+
+/* hashing */
+
+static inline uint32_t hashbytes( const char *str, size_t len )
+{
+    uint32_t h = 2166136261U;
+    size_t i = 0;
+
+    for(; i < len; i++ ){
+        h = ( h ^ (uint8_t)str[i] ) * 16777619U;
+    }
+
+    return h;
+}
+
+
+static inline uint32_t hashval( const fval_t *key, const char *str )
+{
+    uint64_t bits = 0;
+
+    switch( key->type ){
+        case FV_STRING:
+            return hashbytes( str, key->len );
+        case FV_NUMBER:
+            memcpy( &bits, &key->v.num, sizeof( bits ) < sizeof( lua_Number ) ?
+                                        sizeof( bits ) : sizeof( lua_Number ) );
+            break;
+        case FV_INTEGER:
+            bits = (uint64_t)key->v.ival;
+            break;
+        default:
+            bits = (uint64_t)key->type;
+    }
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+
+    return (uint32_t)bits;
+}
+
+
+// convert the key at idx. integral numbers are converted to integers so that
+// 1 and 1.0 are the same key. returns -1 if the key is not supported
+static int tokey( lua_State *L, int idx, fval_t *key, const char **str )
+{
+    lua_Number num = 0;
+
+    memset( key, 0, sizeof( fval_t ) );
+    *str = NULL;
+    switch( lua_type( L, idx ) )
+    {
+        case LUA_TBOOLEAN:
+            key->type = lua_toboolean( L, idx ) ? FV_TRUE : FV_FALSE;
+            return 0;
+
+        case LUA_TNUMBER:
+            num = lua_tonumber( L, idx );
+#if LUA_VERSION_NUM >= 503
+            if( lua_isinteger( L, idx ) ){
+                key->type = FV_INTEGER;
+                key->v.ival = (int64_t)lua_tointeger( L, idx );
+                return 0;
+            }
+#endif
+            if( num >= -9007199254740992.0 && num <= 9007199254740992.0 &&
+                num == (lua_Number)(int64_t)num ){
+                key->type = FV_INTEGER;
+                key->v.ival = (int64_t)num;
+            }
+            else {
+                key->type = FV_NUMBER;
+                key->v.num = num;
+            }
+            return 0;
+
+        case LUA_TSTRING:
+            key->type = FV_STRING;
+            *str = lua_tolstring( L, idx, &key->len );
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+
+/* build */
+
+typedef struct {
+    lpt_buf_t *b;
+    // offset of the data of the root in the buffer
+    size_t base;
+    // stack index of the table that maps the tables to the offsets of their
+    // nodes, or false while building them
+    int seen;
+} builder_t;
+
+
+// append zeroed bytes and returns their offset from the base
+static int reserve( builder_t *bld, size_t len, size_t *off )
+{
+    lpt_buf_t *b = bld->b;
+    size_t pos = align8( b->len );
+
+    if( lpt_buf_reserve( b, pos - b->len + len ) ){
+        return -1;
+    }
+    memset( b->data + b->len, 0, pos - b->len + len );
+    b->len = pos + len;
+    *off = pos - bld->base;
+
+    return 0;
+}
+
+
+#define ENOMEM_MSG  "not enough memory"
+
+static const char *addstr( builder_t *bld, const char *str, size_t len,
+                           fval_t *fv )
+{
+    size_t off = 0;
+
+    if( reserve( bld, len, &off ) ){
+        return ENOMEM_MSG;
+    }
+    memcpy( bld->b->data + bld->base + off, str, len );
+    fv->type = FV_STRING;
+    fv->len = len;
+    fv->v.off = off;
+
+    return NULL;
+}
+
+
+static const char *build( lua_State *L, int idx, builder_t *bld, size_t *off,
+                          int depth );
+
+static const char *toval( lua_State *L, int idx, builder_t *bld, fval_t *fv,
+                          int depth )
+{
+    const char *str = NULL;
+    size_t len = 0;
+
+    memset( fv, 0, sizeof( fval_t ) );
+    switch( lua_type( L, idx ) )
+    {
+        case LUA_TNIL:
+            return NULL;
+
+        case LUA_TBOOLEAN:
+            fv->type = lua_toboolean( L, idx ) ? FV_TRUE : FV_FALSE;
+            return NULL;
+
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+            if( lua_isinteger( L, idx ) ){
+                fv->type = FV_INTEGER;
+                fv->v.ival = (int64_t)lua_tointeger( L, idx );
+                return NULL;
+            }
+#endif
+            fv->type = FV_NUMBER;
+            fv->v.num = lua_tonumber( L, idx );
+            return NULL;
+
+        case LUA_TSTRING:
+            str = lua_tolstring( L, idx, &len );
+            return addstr( bld, str, len, fv );
+
+        case LUA_TTABLE:
+            fv->type = FV_TABLE;
+            return build( L, idx, bld, &fv->v.off, depth + 1 );
+
+        default:
+            return "cannot freeze the value except nil, boolean, number, "
+                   "string and table";
+    }
+}
+
+
+static inline int inarray( const fval_t *key, size_t narr )
+{
+    return key->type == FV_INTEGER && key->v.ival >= 1 &&
+           (uint64_t)key->v.ival <= narr;
+}
+
+
+static const char *build( lua_State *L, int idx, builder_t *bld, size_t *off,
+                          int depth )
+{
+    size_t narr = lpt_rawlen( L, idx );
+    size_t count = 0;
+    size_t nslot = 0;
+    size_t i = 0;
+    fval_t key;
+    fval_t val;
+    const char *str = NULL;
+    const char *err = NULL;
+
+    if( depth >= FROZEN_MAXDEPTH ){
+        return "table nesting too deep";
+    }
+    else if( !lua_checkstack( L, 4 ) ){
+        return "stack overflow";
+    }
+
+    // the table referenced more than once shares the node
+    lua_pushvalue( L, idx );
+    lua_rawget( L, bld->seen );
+    if( lua_isnumber( L, -1 ) ){
+        *off = (size_t)lua_tointeger( L, -1 );
+        lua_pop( L, 1 );
+        return NULL;
+    }
+    else if( lua_isboolean( L, -1 ) ){
+        lua_pop( L, 1 );
+        return "cannot freeze the table that has a cycle";
+    }
+    lua_pop( L, 1 );
+    lua_pushvalue( L, idx );
+    lua_pushboolean( L, 0 );
+    lua_rawset( L, bld->seen );
+
+    // count the fields of the hash part
+    lua_pushnil( L );
+    while( lua_next( L, idx ) )
+    {
+        lua_pop( L, 1 );
+        if( tokey( L, -1, &key, &str ) ){
+            lua_pop( L, 1 );
+            return "cannot freeze the key except boolean, number and string";
+        }
+        else if( !inarray( &key, narr ) ){
+            count++;
+        }
+    }
+    if( count ){
+        for( nslot = 2; nslot < count * 2; nslot <<= 1 );
+    }
+
+    if( reserve( bld, sizeof( fnode_t ) + sizeof( fval_t ) * narr +
+                      sizeof( fslot_t ) * nslot, off ) ){
+        return ENOMEM_MSG;
+    }
+    else
+    {
+        fnode_t *node = (fnode_t*)( bld->b->data + bld->base + *off );
+
+        node->narr = narr;
+        node->nslot = nslot;
+    }
+
+    // array part. the node is looked up again since the buffer may be moved
+    for( i = 1; i <= narr; i++ )
+    {
+        lua_rawgeti( L, idx, (int)i );
+        err = toval( L, lua_gettop( L ), bld, &val, depth );
+        lua_pop( L, 1 );
+        if( err ){
+            return err;
+        }
+        node_arr( (fnode_t*)( bld->b->data + bld->base + *off ) )[i - 1] = val;
+    }
+
+    // hash part
+    lua_pushnil( L );
+    while( lua_next( L, idx ) )
+    {
+        fslot_t *slot = NULL;
+        uint32_t hash = 0;
+        size_t pos = 0;
+
+        tokey( L, -2, &key, &str );
+        if( inarray( &key, narr ) ){
+            lua_pop( L, 1 );
+            continue;
+        }
+        hash = hashval( &key, str );
+        if( key.type == FV_STRING && ( err = addstr( bld, str, key.len,
+                                                     &key ) ) ){
+            lua_pop( L, 2 );
+            return err;
+        }
+        else if( ( err = toval( L, lua_gettop( L ), bld, &val, depth ) ) ){
+            lua_pop( L, 2 );
+            return err;
+        }
+        lua_pop( L, 1 );
+
+        slot = node_slots( (fnode_t*)( bld->b->data + bld->base + *off ) );
+        for( pos = hash & ( nslot - 1 ); slot[pos].key.type != FV_NIL;
+             pos = ( pos + 1 ) & ( nslot - 1 ) );
+        slot[pos].hash = hash;
+        slot[pos].key = key;
+        slot[pos].val = val;
+    }
+
+    lua_pushvalue( L, idx );
+    lua_pushinteger( L, (lua_Integer)*off );
+    lua_rawset( L, bld->seen );
+
+    return NULL;
+}
+
+
+/* lookup */
+
+static inline const char *strof( const froot_t *root, const fval_t *fv )
+{
+    return root->data + fv->v.off;
+}
+
+
+static const fval_t *lookup( const froot_t *root, const fnode_t *node,
+                             const fval_t *key, const char *str,
+                             size_t *at )
+{
+    const fslot_t *slot = node_slots( node );
+    uint32_t hash = 0;
+    size_t pos = 0;
+
+    if( inarray( key, node->narr ) ){
+        *at = (size_t)key->v.ival - 1;
+        return &node_arr( node )[*at];
+    }
+    else if( !node->nslot ){
+        return NULL;
+    }
+
+    hash = hashval( key, str );
+    for( pos = hash & ( node->nslot - 1 ); slot[pos].key.type != FV_NIL;
+         pos = ( pos + 1 ) & ( node->nslot - 1 ) )
+    {
+        const fval_t *k = &slot[pos].key;
+
+        if( slot[pos].hash != hash || k->type != key->type ){
+            continue;
+        }
+        else if( ( k->type == FV_STRING && k->len == key->len &&
+                   memcmp( strof( root, k ), str, k->len ) == 0 ) ||
+                 ( k->type == FV_INTEGER && k->v.ival == key->v.ival ) ||
+                 ( k->type == FV_NUMBER && k->v.num == key->v.num ) ||
+                 k->type == FV_TRUE || k->type == FV_FALSE ){
+            *at = node->narr + pos;
+            return &slot[pos].val;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void getcache( lua_State *L )
+{
+    lua_getfield( L, LUA_REGISTRYINDEX, FROZEN_CACHE );
+    // pthread module has not been loaded into this state
+    if( lua_isnil( L, -1 ) ){
+        lua_pop( L, 1 );
+        lpt_frozen_init( L );
+        lua_getfield( L, LUA_REGISTRYINDEX, FROZEN_CACHE );
+    }
+}
+
+
+// push the proxy of the node. the proxies are cached in the weak table.
+// returns -1 with errno if failed to allocate the proxy
+static int pushnode( lua_State *L, froot_t *root, const fnode_t *node )
+{
+    lpt_frozen_t *f = NULL;
+
+    getcache( L );
+    lua_pushlightuserdata( L, (void*)node );
+    lua_rawget( L, -2 );
+    if( !lua_isnil( L, -1 ) ){
+        lua_replace( L, -2 );
+        return 0;
+    }
+    lua_pop( L, 1 );
+
+    if( !( f = malloc( sizeof( lpt_frozen_t ) ) ) ){
+        lua_pop( L, 1 );
+        return -1;
+    }
+    atomic_init( &f->shared.refcnt, 0 );
+    f->shared.type = &FROZEN_TYPE;
+    atomic_fetch_add_explicit( &root->refcnt, 1, memory_order_relaxed );
+    f->root = root;
+    f->node = node;
+    lpt_shared_push( L, (lpt_shared_t*)f );
+    // cache[node] = proxy
+    lua_pushlightuserdata( L, (void*)node );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+    lua_replace( L, -2 );
+
+    return 0;
+}
+
+
+static void pushval( lua_State *L, froot_t *root, const fval_t *fv )
+{
+    switch( fv->type )
+    {
+        case FV_FALSE:
+        case FV_TRUE:
+            lua_pushboolean( L, fv->type == FV_TRUE );
+            break;
+        case FV_NUMBER:
+            lua_pushnumber( L, fv->v.num );
+            break;
+        case FV_INTEGER:
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger( L, (lua_Integer)fv->v.ival );
+#else
+            lua_pushnumber( L, (lua_Number)fv->v.ival );
+#endif
+            break;
+        case FV_STRING:
+            lua_pushlstring( L, strof( root, fv ), fv->len );
+            break;
+        case FV_TABLE:
+            if( pushnode( L, root,
+                          (const fnode_t*)( root->data + fv->v.off ) ) ){
+                luaL_error( L, "%s", strerror( errno ) );
+            }
+            break;
+        default:
+            lua_pushnil( L );
+    }
+}
+
+
+static inline lpt_frozen_t *checkfrozen( lua_State *L )
+{
+    return (lpt_frozen_t*)lpt_shared_check( L, 1, FROZEN_MT );
+}
+
+
+static int index_lua( lua_State *L )
+{
+    lpt_frozen_t *f = checkfrozen( L );
+    const fval_t *fv = NULL;
+    const char *str = NULL;
+    fval_t key;
+    size_t at = 0;
+
+    if( tokey( L, 2, &key, &str ) == 0 &&
+        ( fv = lookup( f->root, f->node, &key, str, &at ) ) ){
+        pushval( L, f->root, fv );
+    }
+    else {
+        lua_pushnil( L );
+    }
+
+    return 1;
+}
+
+
+static int newindex_lua( lua_State *L )
+{
+    return luaL_error( L, "attempt to modify a frozen table" );
+}
+
+
+static int len_lua( lua_State *L )
+{
+    lpt_frozen_t *f = checkfrozen( L );
+
+    lua_pushinteger( L, (lua_Integer)f->node->narr );
+
+    return 1;
+}
+
+
+// push the key and the value at the position from the start of the array
+// part. returns 0 if no more fields
+static int pushnext( lua_State *L, lpt_frozen_t *f, size_t at )
+{
+    const fnode_t *node = f->node;
+
+    for(; at < node->narr; at++ ){
+        if( node_arr( node )[at].type != FV_NIL ){
+            lua_pushinteger( L, (lua_Integer)( at + 1 ) );
+            pushval( L, f->root, &node_arr( node )[at] );
+            return 2;
+        }
+    }
+    for( at -= node->narr; at < node->nslot; at++ )
+    {
+        const fslot_t *slot = &node_slots( node )[at];
+
+        if( slot->key.type != FV_NIL && slot->val.type != FV_NIL ){
+            pushval( L, f->root, &slot->key );
+            pushval( L, f->root, &slot->val );
+            return 2;
+        }
+    }
+    lua_pushnil( L );
+
+    return 1;
+}
+
+
+static int next_lua( lua_State *L )
+{
+    lpt_frozen_t *f = checkfrozen( L );
+    const char *str = NULL;
+    fval_t key;
+    size_t at = 0;
+
+    lua_settop( L, 2 );
+    if( lua_isnil( L, 2 ) ){
+        return pushnext( L, f, 0 );
+    }
+    else if( tokey( L, 2, &key, &str ) ||
+             !lookup( f->root, f->node, &key, str, &at ) ){
+        return luaL_error( L, "invalid key to 'next'" );
+    }
+
+    return pushnext( L, f, at + 1 );
+}
+
+
+static int pairs_lua( lua_State *L )
+{
+    checkfrozen( L );
+    lua_pushcfunction( L, next_lua );
+    lua_pushvalue( L, 1 );
+    lua_pushnil( L );
+
+    return 3;
+}
+
+
+// next of the plain tables that does not depend on the global next
+static int tblnext_lua( lua_State *L )
+{
+    luaL_checktype( L, 1, LUA_TTABLE );
+    lua_settop( L, 2 );
+    if( lua_next( L, 1 ) ){
+        return 2;
+    }
+    lua_pushnil( L );
+
+    return 1;
+}
+
+
+// pairs for both the frozen tables and the plain tables
+int lpt_frozen_pairs_lua( lua_State *L )
+{
+    lpt_shared_t *obj = lpt_shared_test( L, 1 );
+
+    if( obj && obj->type == &FROZEN_TYPE ){
+        return pairs_lua( L );
+    }
+    luaL_checktype( L, 1, LUA_TTABLE );
+    lua_pushcfunction( L, tblnext_lua );
+    lua_pushvalue( L, 1 );
+    lua_pushnil( L );
+
+    return 3;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, FROZEN_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_frozen_new( lua_State *L )
+{
+    lpt_buf_t buf = { 0 };
+    builder_t bld = {
+        .b = &buf,
+        .base = offsetof( froot_t, data ),
+        .seen = 2
+    };
+    froot_t *root = NULL;
+    const char *err = NULL;
+    size_t off = 0;
+
+    luaL_checktype( L, 1, LUA_TTABLE );
+    lua_settop( L, 1 );
+    lua_newtable( L );
+
+    if( lpt_buf_reserve( &buf, sizeof( froot_t ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    buf.len = sizeof( froot_t );
+    if( ( err = build( L, 1, &bld, &off, 0 ) ) ){
+        lpt_buf_free( &buf );
+        return luaL_error( L, "%s", err );
+    }
+
+    root = (froot_t*)buf.data;
+    atomic_init( &root->refcnt, 1 );
+    root->len = buf.len - sizeof( froot_t );
+    if( pushnode( L, root, (const fnode_t*)( root->data + off ) ) ){
+        free( root );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    // the proxy holds the reference
+    root_release( root );
+
+    return 1;
+}
+
+
+void lpt_frozen_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__newindex", newindex_lua },
+        { "__len", len_lua },
+        { "__pairs", pairs_lua },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &FROZEN_TYPE, mmethod, method );
+    // fields are looked up by the function instead of the method table
+    luaL_getmetatable( L, FROZEN_MT );
+    lua_pushcfunction( L, index_lua );
+    lua_setfield( L, -2, "__index" );
+    lua_pop( L, 1 );
+
+    // create the cache table with weak values
+    lua_getfield( L, LUA_REGISTRYINDEX, FROZEN_CACHE );
+    if( lua_isnil( L, -1 ) ){
+        lua_pop( L, 1 );
+        lua_newtable( L );
+        lua_newtable( L );
+        lua_pushliteral( L, "v" );
+        lua_setfield( L, -2, "__mode" );
+        lua_setmetatable( L, -2 );
+        lua_setfield( L, LUA_REGISTRYINDEX, FROZEN_CACHE );
+    }
+    else {
+        lua_pop( L, 1 );
+    }
+}
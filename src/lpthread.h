@@ -0,0 +1,460 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  lpthread.h
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ */
+
+#ifndef LPTHREAD_H
+#define LPTHREAD_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "lauxhlib.h"
+#include "lua_pthread.h"
+
+#define MODULE_MT   "pthread"
+#define POOL_MT     "pthread.pool"
+#define CHANNEL_MT  "pthread.channel"
+#define CHUNK_MT    "pthread.chunk"
+#define BUFFER_MT   "pthread.buffer"
+#define FROZEN_MT   "pthread.frozen"
+#define ATOMIC_MT   "pthread.atomic"
+#define MUTEX_MT    "pthread.mutex"
+#define BARRIER_MT  "pthread.barrier"
+#define FUTURE_MT   "pthread.future"
+
+#if LUA_VERSION_NUM >= 502
+#define lpt_rawlen( L, idx )    lua_rawlen( L, idx )
+#else
+#define lpt_rawlen( L, idx )    lua_objlen( L, idx )
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#define lpt_pushglobaltable( L )    lua_pushglobaltable( L )
+#else
+#define lpt_pushglobaltable( L )    lua_pushvalue( L, LUA_GLOBALSINDEX )
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define lpt_dump( L, writer, data )    lua_dump( L, writer, data, 0 )
+#else
+#define lpt_dump( L, writer, data )    lua_dump( L, writer, data )
+#endif
+
+
+/* pthread.c */
+
+// register metatable with metamethods and methods
+void lpt_register_mt( lua_State *L, const char *tname, struct luaL_Reg *mmethod,
+                      struct luaL_Reg *method );
+// clock of the timed waits. the condition variables must be initialized by
+// lpt_cond_init to wait with this clock
+#if defined(__APPLE__)
+#define LPT_CLOCK   CLOCK_REALTIME
+#else
+#define LPT_CLOCK   CLOCK_MONOTONIC
+#endif
+int lpt_cond_init( pthread_cond_t *cond );
+// current time of CLOCK_MONOTONIC in nanoseconds
+uint64_t lpt_now_ns( void );
+// cpu time of the thread in nanoseconds, or 0 if not available
+uint64_t lpt_cputime_ns( pthread_t id );
+// counters that are updated only by one thread. the other threads can read
+// them while updating
+static inline void lpt_stat_add( _Atomic(uint64_t) *stat, uint64_t n )
+{
+    uint64_t v = atomic_load_explicit( stat, memory_order_relaxed );
+
+    atomic_store_explicit( stat, v + n, memory_order_relaxed );
+}
+
+static inline uint64_t lpt_stat_get( _Atomic(uint64_t) *stat )
+{
+    return atomic_load_explicit( stat, memory_order_relaxed );
+}
+// maximum seconds of the timeout arguments
+#define LPT_TIMEOUT_MAX ( 60.0 * 60 * 24 * 365 * 10 )
+
+// add the current time of LPT_CLOCK to the relative time
+struct timespec *lpt_addabstime( struct timespec *ts );
+// set the absolute time of the timeout argument in seconds at idx to ts.
+// returns NULL if the argument is nil. the timeout is clamped to
+// LPT_TIMEOUT_MAX
+struct timespec *lpt_timeout_abstime( lua_State *L, int idx,
+                                      struct timespec *ts );
+
+
+/* attr.c */
+
+#define LPT_MAXCPU  1024
+
+typedef struct {
+    size_t stacksize;
+    // -1 to inherit the scheduling policy of the creating thread
+    int policy;
+    int priority;
+    // set of the cpus
+    int ncpu;
+    unsigned char cpus[LPT_MAXCPU / 8];
+    // pin each worker of the pool to one cpu
+    int pin;
+} lpt_attr_t;
+
+void lpt_attr_parse( lua_State *L, int idx, lpt_attr_t *attr );
+// initialize the attributes for the nth thread, or -1 for a single thread
+int lpt_attr_init( pthread_attr_t *pattr, const lpt_attr_t *attr, int nth );
+
+
+/* notify.c */
+
+typedef struct {
+    int rfd;
+    int wfd;
+    // descriptors are opened
+    atomic_int ready;
+} lpt_notify_t;
+
+void lpt_notify_init( lpt_notify_t *n );
+// open the descriptors if not opened. the caller must serialize this call
+int lpt_notify_open( lpt_notify_t *n );
+void lpt_notify_close( lpt_notify_t *n );
+// make the descriptor readable. does nothing if not opened
+void lpt_notify_signal( lpt_notify_t *n );
+// make the descriptor unreadable. returns the number of signals
+uint64_t lpt_notify_clear( lpt_notify_t *n );
+
+
+/* cancel.c */
+
+// number of instructions between the checks of the token
+#define LPT_CANCEL_COUNT    1000
+#define LPT_CANCELED_MSG    "cancelled"
+#define LPT_EINSN_MSG       "instruction limit exceeded"
+#define LPT_ECPUTIME_MSG    "cpu time limit exceeded"
+
+// limits of a function. 0 means unlimited
+typedef struct {
+    uint64_t instructions;
+    uint64_t cpu_ns;
+} lpt_limit_t;
+
+typedef struct {
+    // id of the running function, or 0 if idle
+    _Atomic(uint64_t) current;
+    // the running function is cancelled if equal to current
+    _Atomic(uint64_t) target;
+    // condition that the running function is waiting for, that is signaled
+    // by the request. protected by the lock
+    atomic_flag lock;
+    pthread_cond_t *wcond;
+    pthread_mutex_t *wmutex;
+    // futex word that the running function is waiting for
+    atomic_int *wfutex;
+    // following fields are used only by the running thread
+    lpt_limit_t limit;
+    uint64_t count;
+    uint64_t cpu_start;
+    clockid_t clock;
+    // error message if the running function is stopped
+    const char *reason;
+} lpt_cancel_t;
+
+void lpt_cancel_init( lpt_cancel_t *c );
+// cancel the function of the id if it is running and wake it up if waiting
+// in lpt_cancel_wait. it must not be called while holding the mutex that the
+// function may wait with. returns 0 if not running
+int lpt_cancel_request( lpt_cancel_t *c, uint64_t id );
+// set the token of the state running on this thread and install the hook
+void lpt_cancel_attach( lua_State *L, lpt_cancel_t *c );
+// reset the token for the function that is going to run
+void lpt_cancel_start( lpt_cancel_t *c, const lpt_limit_t *limit );
+int lpt_cancel_requested( void );
+int lpt_cancel_error( lua_State *L );
+// wait for the condition until abstime of LPT_CLOCK, or forever if NULL.
+// returns ECANCELED if the running function on this thread is cancelled, or
+// ETIMEDOUT. it may return 0 before signaled. the condition is signaled by
+// lpt_cancel_request instead of polling the token
+int lpt_cancel_wait( pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     const struct timespec *abstime );
+// wait on the futex word while it is equal to val. returns ECANCELED if the
+// running function on this thread is cancelled. it may return 0 before woken
+int lpt_cancel_futex_wait( atomic_int *addr, int val );
+// parse the cpu_ms and instructions fields of the table at idx
+void lpt_limit_parse( lua_State *L, int idx, lpt_limit_t *limit );
+
+
+/* deque.c */
+
+#define LPT_CACHELINE   64
+
+typedef struct lpt_deque_array_s lpt_deque_array_t;
+
+typedef struct {
+    _Atomic(lpt_deque_array_t*) array;
+    atomic_intptr_t bottom;
+    // thieves and owner touch top and bottom on separate cache lines
+    char pad[LPT_CACHELINE - sizeof( atomic_intptr_t )];
+    atomic_intptr_t top;
+} lpt_deque_t;
+
+int lpt_deque_init( lpt_deque_t *d );
+void lpt_deque_free( lpt_deque_t *d );
+// push an item at the bottom. only the owner thread can call push and take
+int lpt_deque_push( lpt_deque_t *d, void *item );
+void *lpt_deque_take( lpt_deque_t *d );
+// steal an item from the top. retry is set if lost the race
+void *lpt_deque_steal( lpt_deque_t *d, int *retry );
+int lpt_deque_isempty( lpt_deque_t *d );
+// approximate number of the items while the other threads are running
+size_t lpt_deque_size( lpt_deque_t *d );
+
+
+/* alloc.c */
+
+typedef struct lpt_arena_s lpt_arena_t;
+
+lpt_arena_t *lpt_arena_new( int pooled, size_t limit );
+void lpt_arena_free( lpt_arena_t *a );
+size_t lpt_arena_used( lpt_arena_t *a );
+// lua_Alloc function of the arena
+void *lpt_arena_alloc( void *ud, void *ptr, size_t osize, size_t nsize );
+
+
+/* state.c */
+
+enum {
+    LPT_GC_DEFAULT = 0,
+    LPT_GC_INCREMENTAL,
+    LPT_GC_GENERATIONAL
+};
+
+typedef struct {
+    int mode;
+    // parameters of the incremental mode or 0 to keep the default
+    int pause;
+    int stepmul;
+    // stop the collector while running the functions
+    int stop;
+} lpt_gc_t;
+
+typedef struct {
+    // index of the option table or 0
+    int idx;
+    // bit flags of the libraries to open
+    unsigned int libs;
+    // use the size class allocator
+    int arena;
+    // maximum bytes of the memory used by the state or 0
+    size_t memlimit;
+    lpt_gc_t gc;
+} lpt_opts_t;
+
+void lpt_opts_parse( lua_State *L, int idx, lpt_opts_t *opts );
+// create a state for a thread. pushes an error message on failure
+lua_State *lpt_newstate( lua_State *L, const lpt_opts_t *opts );
+void lpt_closestate( lua_State *L );
+// bytes of the memory used by the state, same as LUA_GCCOUNT, or 0 if the
+// state is created without the arena. it can be called while the state is
+// running on the other thread
+size_t lpt_heapsize( lua_State *L );
+int lpt_setlibs_lua( lua_State *L );
+
+
+/* shared.c */
+
+typedef struct lpt_shared_s lpt_shared_t;
+
+typedef struct {
+    const char *tname;
+    // register metatable to the state
+    void (*init)( lua_State *L );
+    // called when the last reference is released
+    void (*free)( lpt_shared_t *obj );
+} lpt_shared_type_t;
+
+struct lpt_shared_s {
+    atomic_int refcnt;
+    const lpt_shared_type_t *type;
+};
+
+void lpt_shared_retain( lpt_shared_t *obj );
+void lpt_shared_release( lpt_shared_t *obj );
+void lpt_shared_register_mt( lua_State *L, const lpt_shared_type_t *type,
+                             struct luaL_Reg *mmethod, struct luaL_Reg *method );
+// push a new reference of the object as userdata
+void lpt_shared_push( lua_State *L, lpt_shared_t *obj );
+// returns the object at idx or NULL if it is not a shared object
+lpt_shared_t *lpt_shared_test( lua_State *L, int idx );
+lpt_shared_t *lpt_shared_check( lua_State *L, int idx, const char *tname );
+// __gc metamethod for shared objects
+int lpt_shared_gc( lua_State *L );
+
+
+/* chunk.c */
+
+typedef struct {
+    lpt_shared_t shared;
+    size_t len;
+    // dumped function or function string
+    char data[];
+} lpt_chunk_t;
+
+void lpt_chunk_init( lua_State *L );
+// returns a new reference of the chunk of the function at idx
+lpt_chunk_t *lpt_checkfn( lua_State *L, int idx );
+
+
+/* codec.c */
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    // number of shared object references and transferred userdata held by
+    // the encoded data
+    size_t nref;
+    // number of the tables and strings that can be referenced
+    size_t nobj;
+} lpt_buf_t;
+
+int lpt_buf_reserve( lpt_buf_t *b, size_t len );
+void lpt_buf_free( lpt_buf_t *b );
+
+// encode values from idx to top of stack. returns NULL on success
+const char *lpt_encode( lua_State *L, int idx, lpt_buf_t *b );
+// encode the elements from t[from] to t[to] of the table at idx as a table
+// that starts from 1
+const char *lpt_encode_slice( lua_State *L, int idx, int from, int to,
+                              lpt_buf_t *b );
+// push decoded values. returns number of values or -1 on malformed data
+int lpt_decode( lua_State *L, const char *data, size_t len );
+// release shared object references and transferred userdata held by data
+void lpt_discard( const char *data, size_t len );
+
+
+/* transfer.c */
+
+// returns the transfer hook of the userdata at idx or NULL
+const lpt_transfer_t *lpt_transfer_test( lua_State *L, int idx );
+// store the api to the registry
+void lpt_transfer_init( lua_State *L );
+
+
+/* pool.c */
+
+void lpt_pool_init( lua_State *L );
+int lpt_pool_new( lua_State *L );
+// submit a task to the pool of the current worker thread
+int lpt_pool_submit_lua( lua_State *L );
+// parallel map and reduce over the arrays by the pool
+int lpt_pool_map_lua( lua_State *L );
+int lpt_pool_reduce_lua( lua_State *L );
+// futures of the tasks submitted by pool:future
+void lpt_future_init( lua_State *L );
+int lpt_future_all_lua( lua_State *L );
+int lpt_future_any_lua( lua_State *L );
+
+
+/* error.c */
+
+// message handler that appends the traceback to the error message
+int lpt_traceback_lua( lua_State *L );
+// returns the channel of the errors field of the table at idx, or NULL if not
+// specified. the channel is not retained
+lpt_shared_t *lpt_error_sink( lua_State *L, int idx );
+// send the error at the top of the stack to the sink as { error = err,
+// id = id }. the id field is omitted if 0. returns 0 on success, -1 if the
+// error cannot be encoded, or errno of lpt_channel_send
+int lpt_error_send( lua_State *L, lpt_shared_t *sink, uint64_t id );
+// write the error at the top of the stack to stderr
+void lpt_error_log( lua_State *L );
+
+
+/* channel.c */
+
+void lpt_channel_init( lua_State *L );
+int lpt_channel_new( lua_State *L );
+// send the value at the top of the stack to the channel object. returns 0 on
+// success, or EAGAIN if full and not block, EPIPE if closed
+int lpt_channel_send( lua_State *L, lpt_shared_t *obj, int block );
+
+
+
+/* buffer.c */
+
+void lpt_buffer_init( lua_State *L );
+int lpt_buffer_new( lua_State *L );
+
+
+
+/* frozen.c */
+
+void lpt_frozen_init( lua_State *L );
+int lpt_frozen_new( lua_State *L );
+// pairs for the frozen tables and the plain tables
+int lpt_frozen_pairs_lua( lua_State *L );
+
+
+
+/* atomic.c */
+
+void lpt_atomic_init( lua_State *L );
+int lpt_atomic_new( lua_State *L );
+
+
+
+/* sync.c */
+
+// sleep while the word is equal to val, and wake up to n sleepers. these
+// yield the processor instead on the platforms without futex
+void lpt_futex_wait( atomic_int *addr, int val );
+void lpt_futex_wake( atomic_int *addr, int n );
+
+void lpt_mutex_init( lua_State *L );
+int lpt_mutex_new( lua_State *L );
+void lpt_barrier_init( lua_State *L );
+int lpt_barrier_new( lua_State *L );
+
+
+
+/* await.c */
+
+// add the await method of the name; thread, channel or pool to the metatable
+void lpt_await_register( lua_State *L, const char *tname, const char *name );
+
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  lua_pthread.h
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  C API for the other modules. the userdata of the registered metatable
+ *  names are passed through the arguments and the results of the threads,
+ *  the pools and the channels by the transfer hooks of the modules.
+ *
+ *  the api is stored in the registry of the states that loaded the pthread
+ *  module, so that the modules do not have to be linked with it. e.g.
+ *
+ *      const lpt_api_t *api = lpt_getapi( L );
+ *
+ *      if( api && api->version >= LPT_API_VERSION ){
+ *          api->register_transfer( &MYTYPE_TRANSFER );
+ *      }
+ */
+
+#ifndef LUA_PTHREAD_H
+#define LUA_PTHREAD_H
+
+#include <lua.h>
+
+#define LPT_API_VERSION 1
+// registry field of the api
+#define LPT_API_KEY     "pthread.api"
+// maximum number of the transfer hooks
+#define LPT_MAXTRANSFER 64
+
+
+// the hooks are shared by all threads of the process, so that the hook
+// object and the functions must be valid until the process exits.
+//
+// an encoded value may be decoded more than once, such as the result of a
+// future, so that the payload is owned by the encoded value and the hooks
+// must either share or clone the resource. the userdata cannot be moved;
+//  clone: pack copies the resource to the payload, and unpack copies the
+//         payload to a new userdata.
+//  share: pack takes a reference of the thread-safe resource, unpack takes
+//         another one for a new userdata, and free releases the reference
+//         taken by pack.
+typedef struct {
+    // metatable name of the userdata
+    const char *tname;
+    // called by the sending state with the userdata at the absolute index
+    // idx. returns the payload, or NULL with the error message
+    void *(*pack)( lua_State *L, int idx, const char **err );
+    // called by the receiving state each time the value is decoded. push a
+    // new userdata of the payload without taking its ownership and returns
+    // 0, or returns -1 on failure.
+    // the metatable must be created by this function if the module has not
+    // been loaded into the state
+    int (*unpack)( lua_State *L, void *payload );
+    // called once when the encoded value is released whether or not it was
+    // decoded
+    void (*free)( void *payload );
+} lpt_transfer_t;
+
+
+typedef struct {
+    int version;
+    // returns 0, or EINVAL, EEXIST if the tname is already registered, or
+    // ENOSPC if LPT_MAXTRANSFER hooks are registered
+    int (*register_transfer)( const lpt_transfer_t *hook );
+    // returns the hook of the tname or NULL
+    const lpt_transfer_t *(*find_transfer)( const char *tname );
+} lpt_api_t;
+
+
+// returns the api, or NULL if the pthread module has not been loaded into
+// the state
+static inline const lpt_api_t *lpt_getapi( lua_State *L )
+{
+    const lpt_api_t *api = NULL;
+
+    lua_getfield( L, LUA_REGISTRYINDEX, LPT_API_KEY );
+    api = (const lpt_api_t*)lua_touserdata( L, -1 );
+    lua_pop( L, 1 );
+
+    return api;
+}
+
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  notify.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  pollable file descriptors that become readable when the objects have
+ *  something to tell. eventfd is used on linux and pipe on other platforms.
+ */
+
+#include <fcntl.h>
+#include "lpthread.h"
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+
+#if !defined(__linux__)
+static int setflags( int fd )
+{
+    int flg = fcntl( fd, F_GETFL );
+
+    if( flg == -1 || fcntl( fd, F_SETFL, flg | O_NONBLOCK ) == -1 ||
+        fcntl( fd, F_SETFD, FD_CLOEXEC ) == -1 ){
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+
+void lpt_notify_init( lpt_notify_t *n )
+{
+    n->rfd = n->wfd = -1;
+    atomic_init( &n->ready, 0 );
+}
+
+
+int lpt_notify_open( lpt_notify_t *n )
+{
+    if( atomic_load_explicit( &n->ready, memory_order_relaxed ) ){
+        return 0;
+    }
+
+#if defined(__linux__)
+    if( ( n->rfd = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC ) ) == -1 ){
+        return errno;
+    }
+    n->wfd = n->rfd;
+#else
+    {
+        int fds[2];
+
+        if( pipe( fds ) == -1 ){
+            return errno;
+        }
+        else if( setflags( fds[0] ) || setflags( fds[1] ) ){
+            int rc = errno;
+
+            close( fds[0] );
+            close( fds[1] );
+            return rc;
+        }
+        n->rfd = fds[0];
+        n->wfd = fds[1];
+    }
+#endif
+    // publish the descriptors to the threads that signal
+    atomic_store_explicit( &n->ready, 1, memory_order_release );
+
+    return 0;
+}
+
+
+void lpt_notify_close( lpt_notify_t *n )
+{
+    if( atomic_load_explicit( &n->ready, memory_order_relaxed ) ){
+        if( n->wfd != n->rfd ){
+            close( n->wfd );
+        }
+        close( n->rfd );
+        lpt_notify_init( n );
+    }
+}
+
+
+void lpt_notify_signal( lpt_notify_t *n )
+{
+    if( atomic_load_explicit( &n->ready, memory_order_acquire ) )
+    {
+#if defined(__linux__)
+        uint64_t v = 1;
+        ssize_t rv = write( n->wfd, &v, sizeof( v ) );
+#else
+        char v = 0;
+        ssize_t rv = write( n->wfd, &v, 1 );
+#endif
+        // the descriptor is already readable if the counter or pipe is full
+        (void)rv;
+    }
+}
+
+
+uint64_t lpt_notify_clear( lpt_notify_t *n )
+{
+#if defined(__linux__)
+    uint64_t v = 0;
+
+    if( atomic_load_explicit( &n->ready, memory_order_acquire ) &&
+        read( n->rfd, &v, sizeof( v ) ) == sizeof( v ) ){
+        return v;
+    }
+
+    return 0;
+#else
+    uint64_t total = 0;
+    char buf[256];
+    ssize_t len = 0;
+
+    if( atomic_load_explicit( &n->ready, memory_order_acquire ) ){
+        while( ( len = read( n->rfd, buf, sizeof( buf ) ) ) > 0 ){
+            total += (uint64_t)len;
+        }
+    }
+
+    return total;
+#endif
+}
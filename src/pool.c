@@ -0,0 +1,2385 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  pool.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  a fixed number of worker threads that keep their state alive and run
+ *  submitted functions one after another.
+ */
+
+#include "lpthread.h"
+
+// maximum number of loaded functions that are kept by each worker
+#define POOL_CHUNK_CACHE    64
+
+
+enum {
+    TASK_CALL = 0,
+    // call the function for each element of the slice
+    TASK_MAP,
+    // fold the elements of the slice by the function
+    TASK_REDUCE
+};
+
+
+typedef struct lpt_result_s lpt_result_t;
+typedef struct lpt_future_s lpt_future_t;
+
+// results of the tasks of pthread.map and pthread.reduce are stored in the
+// slots of the sink that is owned by the caller instead of the result queue
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int remaining;
+    lpt_result_t **slots;
+} lpt_sink_t;
+
+
+typedef struct lpt_task_s {
+    struct lpt_task_s *next;
+    uint64_t id;
+    int kind;
+    lpt_sink_t *sink;
+    int slot;
+    // cancelled while queued
+    int cancelled;
+    lpt_limit_t limit;
+    // time of the submission
+    uint64_t submitted;
+    // future resolved by the result, and the future whose values are passed
+    // as the arguments instead of the encoded arguments
+    lpt_future_t *future;
+    lpt_future_t *input;
+    lpt_chunk_t *chunk;
+    size_t arglen;
+    size_t nref;
+    // encoded arguments
+    char data[];
+} lpt_task_t;
+
+
+struct lpt_result_s {
+    struct lpt_result_s *next;
+    uint64_t id;
+    int ok;
+    size_t len;
+    size_t nref;
+    // encoded return values or error message
+    char data[];
+};
+
+
+typedef struct lpt_pool_s lpt_pool_t;
+
+// updated only by the worker
+typedef struct {
+    _Atomic(uint64_t) ntask;
+    _Atomic(uint64_t) nfail;
+    _Atomic(uint64_t) nsteal;
+    // time from the submission to the start in nanoseconds
+    _Atomic(uint64_t) wait_ns;
+    _Atomic(uint64_t) run_ns;
+    // bytes of the encoded arguments and results
+    _Atomic(uint64_t) bytes_in;
+    _Atomic(uint64_t) bytes_out;
+} lpt_wstats_t;
+
+typedef struct {
+    pthread_t id;
+    lua_State *L;
+    lpt_pool_t *pool;
+    int idx;
+    // tasks submitted by this worker
+    lpt_deque_t deque;
+    // result of the current task
+    lpt_result_t *result;
+    // cancellation token of the current task
+    lpt_cancel_t cancel;
+    // chunks that have been loaded into the state
+    int ncache;
+    lpt_chunk_t *cache[POOL_CHUNK_CACHE];
+    lpt_wstats_t stats;
+} lpt_worker_t;
+
+
+struct lpt_pool_s {
+    // held by the pool object and the futures. the pool is shut down by
+    // pool:close, and freed when the last reference is released
+    atomic_int refcnt;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // tasks submitted from outside of the workers
+    lpt_task_t *head;
+    lpt_task_t *tail;
+    atomic_int nqueue;
+    // maximum number of the tasks in the shared queue or 0, and the number
+    // of the submitters waiting for a space
+    int maxqueue;
+    int nspacewait;
+    pthread_cond_t qcond;
+    // number of sleeping workers
+    atomic_int nidle;
+    _Atomic(uint64_t) nextid;
+    // results of the tasks if enabled
+    int results;
+    pthread_cond_t rcond;
+    lpt_result_t *rhead;
+    lpt_result_t *rtail;
+    // number of the tasks whose result has not been queued
+    atomic_size_t npending;
+    int closed;
+    // readable when tasks are completed
+    lpt_notify_t notify;
+    // channel to send the errors of the tasks without results
+    lpt_shared_t *errors;
+    // stop the collector while running the tasks and collect all garbage
+    // between them
+    int gcstop;
+    // functions that are run by each worker before the tasks and after each
+    // task
+    lpt_chunk_t *init;
+    lpt_chunk_t *reset;
+    // restore the globals after each task
+    int isolate;
+    // number of the workers that have run the init function, and its first
+    // error message
+    int ninit;
+    char *initerr;
+    int nworker;
+    int nstarted;
+    lpt_worker_t worker[];
+};
+
+
+enum {
+    FUTURE_TASK = 0,
+    // resolved when all inputs are resolved
+    FUTURE_ALL,
+    // resolved when one of the inputs is resolved
+    FUTURE_ANY
+};
+
+
+// dependent of the future that is notified on the resolution
+typedef struct lpt_waiter_s {
+    struct lpt_waiter_s *next;
+    lpt_future_t *future;
+    // task of fut:then_ that is queued on the resolution
+    lpt_task_t *task;
+} lpt_waiter_t;
+
+
+struct lpt_future_s {
+    lpt_shared_t shared;
+    lpt_pool_t *pool;
+    int kind;
+    // id of the task or 0
+    uint64_t id;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    int ok;
+    // the values are the result of the task, the values of src, the first
+    // values of the inputs, or the error message
+    lpt_result_t *result;
+    lpt_future_t *src;
+    const char *errmsg;
+    lpt_waiter_t *waiters;
+    int remaining;
+    int ninput;
+    lpt_future_t *inputs[];
+};
+
+
+// worker running on this thread
+static _Thread_local lpt_worker_t *CURRENT = NULL;
+
+
+// the task is marked as running before the lock is released, so that
+// pool:cancel finds the task either in the queue or on the worker
+static lpt_task_t *pop_global( lpt_worker_t *w )
+{
+    lpt_pool_t *p = w->pool;
+    lpt_task_t *task = NULL;
+
+    if( !atomic_load( &p->nqueue ) ){
+        return NULL;
+    }
+    pthread_mutex_lock( &p->mutex );
+    if( ( task = p->head ) ){
+        if( !( p->head = task->next ) ){
+            p->tail = NULL;
+        }
+        atomic_fetch_sub( &p->nqueue, 1 );
+        atomic_store( &w->cancel.current, task->id );
+        if( p->nspacewait ){
+            pthread_cond_signal( &p->qcond );
+        }
+    }
+    pthread_mutex_unlock( &p->mutex );
+
+    return task;
+}
+
+
+static lpt_task_t *steal_task( lpt_worker_t *w, int *retry )
+{
+    lpt_pool_t *p = w->pool;
+    lpt_task_t *task = NULL;
+    int i = 1;
+
+    // start from the next worker so that the victims are spread
+    for(; i < p->nworker; i++ ){
+        lpt_worker_t *victim = &p->worker[( w->idx + i ) % p->nworker];
+
+        if( ( task = lpt_deque_steal( &victim->deque, retry ) ) ){
+            lpt_stat_add( &w->stats.nsteal, 1 );
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+
+static int hastask( lpt_pool_t *p )
+{
+    int i = 0;
+
+    if( atomic_load( &p->nqueue ) ){
+        return 1;
+    }
+    for(; i < p->nworker; i++ ){
+        if( !lpt_deque_isempty( &p->worker[i].deque ) ){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static lpt_task_t *pop_task( lpt_worker_t *w )
+{
+    lpt_pool_t *p = w->pool;
+    lpt_task_t *task = NULL;
+    int retry = 0;
+
+    for(;;)
+    {
+        // own tasks first, then the tasks from outside, then steal
+        retry = 0;
+        if( ( task = lpt_deque_take( &w->deque ) ) ||
+            ( task = pop_global( w ) ) ||
+            ( task = steal_task( w, &retry ) ) ){
+            return task;
+        }
+        else if( retry ){
+            continue;
+        }
+
+        // sleep until a task is pushed
+        pthread_mutex_lock( &p->mutex );
+        atomic_fetch_add( &p->nidle, 1 );
+        atomic_thread_fence( memory_order_seq_cst );
+        if( !hastask( p ) )
+        {
+            // remaining tasks are consumed even if closed
+            if( p->closed ){
+                atomic_fetch_sub( &p->nidle, 1 );
+                pthread_mutex_unlock( &p->mutex );
+                return NULL;
+            }
+            pthread_cond_wait( &p->cond, &p->mutex );
+        }
+        atomic_fetch_sub( &p->nidle, 1 );
+        pthread_mutex_unlock( &p->mutex );
+    }
+}
+
+
+// wake up a sleeping worker if exists
+static inline void wakeup( lpt_pool_t *p )
+{
+    atomic_thread_fence( memory_order_seq_cst );
+    if( atomic_load_explicit( &p->nidle, memory_order_relaxed ) ){
+        pthread_mutex_lock( &p->mutex );
+        pthread_cond_signal( &p->cond );
+        pthread_mutex_unlock( &p->mutex );
+    }
+}
+
+
+static void task_free( lpt_task_t *task )
+{
+    if( task->nref ){
+        lpt_discard( task->data, task->arglen );
+    }
+    if( task->future ){
+        lpt_shared_release( (lpt_shared_t*)task->future );
+    }
+    if( task->input ){
+        lpt_shared_release( (lpt_shared_t*)task->input );
+    }
+    lpt_shared_release( (lpt_shared_t*)task->chunk );
+    free( task );
+}
+
+
+static void pool_release( lpt_pool_t *p )
+{
+    if( atomic_fetch_sub( &p->refcnt, 1 ) == 1 ){
+        pthread_cond_destroy( &p->qcond );
+        pthread_cond_destroy( &p->rcond );
+        pthread_cond_destroy( &p->cond );
+        pthread_mutex_destroy( &p->mutex );
+        free( p );
+    }
+}
+
+
+// the task is done without queueing its result
+static void done_pending( lpt_pool_t *p )
+{
+    pthread_mutex_lock( &p->mutex );
+    atomic_fetch_sub( &p->npending, 1 );
+    pthread_cond_broadcast( &p->rcond );
+    pthread_mutex_unlock( &p->mutex );
+}
+
+
+// create a result of the values from idx to top. returns NULL on failure
+static lpt_result_t *newresult( lua_State *L, int idx, int ok,
+                                const char **err )
+{
+    lpt_buf_t buf = { 0 };
+    lpt_result_t *res = NULL;
+
+    *err = NULL;
+    if( lpt_buf_reserve( &buf, sizeof( lpt_result_t ) ) ){
+        return NULL;
+    }
+    buf.len = sizeof( lpt_result_t );
+    if( ( *err = lpt_encode( L, idx, &buf ) ) ){
+        lpt_buf_free( &buf );
+        return NULL;
+    }
+    res = (lpt_result_t*)buf.data;
+    res->next = NULL;
+    res->ok = ok;
+    res->len = buf.len - sizeof( lpt_result_t );
+    res->nref = buf.nref;
+
+    return res;
+}
+
+
+static void result_free( lpt_result_t *res )
+{
+    if( res->nref ){
+        lpt_discard( res->data, res->len );
+    }
+    free( res );
+}
+
+
+static void future_free( lpt_shared_t *obj )
+{
+    lpt_future_t *f = (lpt_future_t*)obj;
+    int i = 0;
+
+    if( f->result ){
+        result_free( f->result );
+    }
+    if( f->src ){
+        lpt_shared_release( (lpt_shared_t*)f->src );
+    }
+    for(; i < f->ninput; i++ ){
+        if( f->inputs[i] ){
+            lpt_shared_release( (lpt_shared_t*)f->inputs[i] );
+        }
+    }
+    pool_release( f->pool );
+    pthread_cond_destroy( &f->cond );
+    pthread_mutex_destroy( &f->mutex );
+    free( f );
+}
+
+
+static const lpt_shared_type_t FUTURE_TYPE = {
+    .tname = FUTURE_MT,
+    .init = lpt_future_init,
+    .free = future_free
+};
+
+
+static lpt_future_t *newfuture( lpt_pool_t *p, int kind, int ninput )
+{
+    lpt_future_t *f = calloc( 1, sizeof( lpt_future_t ) +
+                                 sizeof( lpt_future_t* ) * (size_t)ninput );
+
+    if( f ){
+        atomic_init( &f->shared.refcnt, 0 );
+        f->shared.type = &FUTURE_TYPE;
+        f->kind = kind;
+        pthread_mutex_init( &f->mutex, NULL );
+        lpt_cond_init( &f->cond );
+        f->ninput = ninput;
+        f->remaining = ninput;
+        atomic_fetch_add( &p->refcnt, 1 );
+        f->pool = p;
+    }
+
+    return f;
+}
+
+
+static void notify_waiter( lpt_waiter_t *wt, lpt_future_t *in );
+
+// resolve the future by the result, or by the values of src. the result is
+// owned by the future
+static void resolve( lpt_future_t *f, int ok, lpt_result_t *res,
+                     lpt_future_t *src, const char *errmsg )
+{
+    lpt_waiter_t *wt = NULL;
+
+    pthread_mutex_lock( &f->mutex );
+    // the inputs of all and any may be resolved after the future
+    if( f->done ){
+        pthread_mutex_unlock( &f->mutex );
+        if( res ){
+            result_free( res );
+        }
+        return;
+    }
+    f->done = 1;
+    f->ok = ok;
+    f->result = res;
+    if( ( f->src = src ) ){
+        lpt_shared_retain( (lpt_shared_t*)src );
+    }
+    f->errmsg = errmsg;
+    wt = f->waiters;
+    f->waiters = NULL;
+    pthread_cond_broadcast( &f->cond );
+    pthread_mutex_unlock( &f->mutex );
+
+    while( wt ){
+        lpt_waiter_t *next = wt->next;
+
+        notify_waiter( wt, f );
+        wt = next;
+    }
+}
+
+
+// queue the dependent task. the task is pushed to the own deque if called by
+// the worker so that it runs on the worker that holds the input
+static void schedule( lpt_pool_t *p, lpt_task_t *task )
+{
+    lpt_worker_t *w = CURRENT;
+
+    task->submitted = lpt_now_ns();
+    if( w && w->pool == p && lpt_deque_push( &w->deque, task ) == 0 ){
+        wakeup( p );
+        return;
+    }
+
+    pthread_mutex_lock( &p->mutex );
+    // the workers consume the remaining tasks while closing
+    if( p->closed && !( w && w->pool == p ) ){
+        pthread_mutex_unlock( &p->mutex );
+        resolve( task->future, 0, NULL, NULL, "attempt to use a closed pool" );
+        task_free( task );
+        done_pending( p );
+        return;
+    }
+    if( p->tail ){
+        p->tail->next = task;
+    }
+    else {
+        p->head = task;
+    }
+    p->tail = task;
+    atomic_fetch_add( &p->nqueue, 1 );
+    pthread_cond_signal( &p->cond );
+    pthread_mutex_unlock( &p->mutex );
+}
+
+
+// the input of the waiter has been resolved
+static void notify_waiter( lpt_waiter_t *wt, lpt_future_t *in )
+{
+    lpt_future_t *f = wt->future;
+    int last = 0;
+
+    if( wt->task )
+    {
+        if( in->ok ){
+            schedule( f->pool, wt->task );
+        }
+        // the dependent task is not run if the input failed
+        else {
+            resolve( f, 0, NULL, in, NULL );
+            task_free( wt->task );
+            done_pending( f->pool );
+        }
+    }
+    else
+    {
+        pthread_mutex_lock( &f->mutex );
+        last = --f->remaining == 0;
+        pthread_mutex_unlock( &f->mutex );
+        if( f->kind == FUTURE_ALL ){
+            if( !in->ok ){
+                resolve( f, 0, NULL, in, NULL );
+            }
+            else if( last ){
+                resolve( f, 1, NULL, NULL, NULL );
+            }
+        }
+        // the error of the last input if all inputs failed
+        else if( in->ok || last ){
+            resolve( f, in->ok, NULL, in, NULL );
+        }
+    }
+    lpt_shared_release( (lpt_shared_t*)f );
+    free( wt );
+}
+
+
+// add the waiter to the input, or notify it if the input has been resolved
+static void add_waiter( lpt_future_t *in, lpt_waiter_t *wt )
+{
+    pthread_mutex_lock( &in->mutex );
+    if( !in->done ){
+        wt->next = in->waiters;
+        in->waiters = wt;
+        pthread_mutex_unlock( &in->mutex );
+        return;
+    }
+    pthread_mutex_unlock( &in->mutex );
+    notify_waiter( wt, in );
+}
+
+
+// push the values of the resolved future. returns the number of values or -1
+// on malformed data
+static int push_value( lua_State *L, lpt_future_t *f )
+{
+    int top = lua_gettop( L );
+    int i = 0;
+
+    if( f->src ){
+        return push_value( L, f->src );
+    }
+    else if( f->result ){
+        return lpt_decode( L, f->result->data, f->result->len );
+    }
+    else if( f->errmsg ){
+        lua_pushstring( L, f->errmsg );
+        return 1;
+    }
+    else if( f->kind != FUTURE_ALL ){
+        return 0;
+    }
+
+    luaL_checkstack( L, f->ninput, NULL );
+    for(; i < f->ninput; i++ )
+    {
+        int n = push_value( L, f->inputs[i] );
+
+        if( n < 0 ){
+            return -1;
+        }
+        else if( n == 0 ){
+            lua_pushnil( L );
+        }
+        lua_settop( L, top + i + 1 );
+    }
+
+    return f->ninput;
+}
+
+
+// push the function of the chunk that is loaded once per worker
+static void pushfn( lua_State *L, lpt_worker_t *w, lpt_chunk_t *chunk )
+{
+    lua_pushlightuserdata( L, chunk );
+    lua_rawget( L, LUA_REGISTRYINDEX );
+    if( lua_isfunction( L, -1 ) ){
+        return;
+    }
+    lua_pop( L, 1 );
+
+    if( luaL_loadbuffer( L, chunk->data, chunk->len, NULL ) ){
+        lua_error( L );
+    }
+    // evict all cached functions
+    if( w->ncache == POOL_CHUNK_CACHE )
+    {
+        while( w->ncache ){
+            lpt_chunk_t *old = w->cache[--w->ncache];
+
+            lua_pushlightuserdata( L, old );
+            lua_pushnil( L );
+            lua_rawset( L, LUA_REGISTRYINDEX );
+            lpt_shared_release( (lpt_shared_t*)old );
+        }
+    }
+    // the chunk is retained so that its address is never reused while cached
+    lpt_shared_retain( (lpt_shared_t*)chunk );
+    w->cache[w->ncache++] = chunk;
+    lua_pushlightuserdata( L, chunk );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, LUA_REGISTRYINDEX );
+}
+
+
+static inline int wantresult( lpt_worker_t *w, lpt_task_t *task )
+{
+    return task->sink || task->future || w->pool->results;
+}
+
+
+// stack: fn, slice, base, count
+static void run_slice( lua_State *L, int kind )
+{
+    lua_Integer base = lua_tointeger( L, 3 );
+    int count = (int)lua_tointeger( L, 4 );
+    int i = 1;
+
+    lua_settop( L, 2 );
+    if( kind == TASK_MAP )
+    {
+        lua_createtable( L, count, 0 );
+        for(; i <= count; i++ ){
+            lua_pushvalue( L, 1 );
+            lua_rawgeti( L, 2, i );
+            lua_pushinteger( L, base + i - 1 );
+            lua_call( L, 2, 1 );
+            lua_rawseti( L, 3, i );
+        }
+    }
+    // the first element is the initial value of the accumulator
+    else
+    {
+        lua_rawgeti( L, 2, 1 );
+        for( i = 2; i <= count; i++ ){
+            lua_pushvalue( L, 1 );
+            lua_insert( L, 3 );
+            lua_rawgeti( L, 2, i );
+            lua_call( L, 2, 1 );
+        }
+    }
+    lua_replace( L, 1 );
+    lua_settop( L, 1 );
+}
+
+
+static int run_task_lua( lua_State *L )
+{
+    lpt_worker_t *w = (lpt_worker_t*)lua_touserdata( L, 1 );
+    lpt_task_t *task = (lpt_task_t*)lua_touserdata( L, 2 );
+    int narg = 0;
+
+    lua_settop( L, 0 );
+    if( task->cancelled ){
+        return lpt_cancel_error( L );
+    }
+    pushfn( L, w, task->chunk );
+    if( ( narg = task->input ? push_value( L, task->input ) :
+                               lpt_decode( L, task->data, task->arglen ) ) < 0 ){
+        return luaL_error( L, "failed to decode arguments" );
+    }
+    else if( task->kind != TASK_CALL ){
+        run_slice( L, task->kind );
+    }
+    else {
+        lua_call( L, narg, wantresult( w, task ) ? LUA_MULTRET : 0 );
+    }
+
+    if( wantresult( w, task ) )
+    {
+        const char *err = NULL;
+
+        if( !( w->result = newresult( L, 1, 1, &err ) ) ){
+            return luaL_error( L, "failed to encode results: %s",
+                               err ? err : strerror( ENOMEM ) );
+        }
+    }
+
+    return 0;
+}
+
+
+// queue the result of the task
+static void put_result( lpt_worker_t *w, lpt_task_t *task )
+{
+    lpt_pool_t *p = w->pool;
+    lpt_result_t *res = w->result;
+
+    w->result = NULL;
+    if( task->sink ){
+        lpt_sink_t *sink = task->sink;
+
+        pthread_mutex_lock( &sink->mutex );
+        sink->slots[task->slot] = res;
+        if( --sink->remaining == 0 ){
+            pthread_cond_signal( &sink->cond );
+        }
+        pthread_mutex_unlock( &sink->mutex );
+        return;
+    }
+    else if( res ){
+        res->id = task->id;
+    }
+    pthread_mutex_lock( &p->mutex );
+    // result is dropped if out of memory
+    if( res )
+    {
+        if( p->rtail ){
+            p->rtail->next = res;
+        }
+        else {
+            p->rhead = res;
+        }
+        p->rtail = res;
+    }
+    atomic_fetch_sub( &p->npending, 1 );
+    pthread_cond_broadcast( &p->rcond );
+    pthread_mutex_unlock( &p->mutex );
+}
+
+
+// pass the error at the top of the stack as the result, or to the error sink
+static void fail_task( lpt_worker_t *w, lpt_task_t *task )
+{
+    lua_State *L = w->L;
+    const char *err = NULL;
+
+    lua_replace( L, 1 );
+    lua_settop( L, 1 );
+    if( wantresult( w, task ) ){
+        // error object as the result
+        if( !( w->result = newresult( L, 1, 0, &err ) ) && err ){
+            lua_pushfstring( L, "the error object of type %s cannot be "
+                             "transferred", luaL_typename( L, 1 ) );
+            lua_replace( L, 1 );
+            w->result = newresult( L, 1, 0, &err );
+        }
+    }
+    else if( !w->pool->errors || lpt_error_send( L, w->pool->errors,
+                                                 task->id ) ){
+        lpt_error_log( L );
+    }
+    lpt_stat_add( &w->stats.nfail, 1 );
+}
+
+
+// registry keys of the reset function and the snapshot of the globals
+static const char RESET_KEY = 0;
+static const char GLOBALS_KEY = 0;
+
+static int init_lua( lua_State *L )
+{
+    lpt_worker_t *w = (lpt_worker_t*)lua_touserdata( L, 1 );
+    lpt_pool_t *p = w->pool;
+
+    lua_settop( L, 0 );
+    if( p->init ){
+        if( luaL_loadbuffer( L, p->init->data, p->init->len, NULL ) ){
+            return lua_error( L );
+        }
+        lua_pushinteger( L, w->idx + 1 );
+        lua_pushinteger( L, p->nworker );
+        lua_call( L, 2, 0 );
+    }
+    if( p->reset ){
+        lua_pushlightuserdata( L, (void*)&RESET_KEY );
+        if( luaL_loadbuffer( L, p->reset->data, p->reset->len, NULL ) ){
+            return lua_error( L );
+        }
+        lua_rawset( L, LUA_REGISTRYINDEX );
+    }
+    // shallow copy of the globals
+    if( p->isolate )
+    {
+        lua_pushlightuserdata( L, (void*)&GLOBALS_KEY );
+        lua_newtable( L );
+        lpt_pushglobaltable( L );
+        lua_pushnil( L );
+        while( lua_next( L, -2 ) ){
+            lua_pushvalue( L, -2 );
+            lua_insert( L, -2 );
+            lua_rawset( L, -5 );
+        }
+        lua_pop( L, 1 );
+        lua_rawset( L, LUA_REGISTRYINDEX );
+    }
+
+    return 0;
+}
+
+
+// run the init function and report to lpt_pool_new. returns 0 on success
+static int init_worker( lpt_worker_t *w )
+{
+    lpt_pool_t *p = w->pool;
+    lua_State *L = w->L;
+    char *err = NULL;
+    int rc = 0;
+
+    lua_pushcfunction( L, lpt_traceback_lua );
+    lua_pushcfunction( L, init_lua );
+    lua_pushlightuserdata( L, w );
+    if( ( rc = lua_pcall( L, 1, 0, 1 ) ) ){
+        const char *msg = lua_tostring( L, -1 );
+
+        err = strdup( msg ? msg : "init function failed" );
+    }
+    lua_settop( L, 0 );
+
+    pthread_mutex_lock( &p->mutex );
+    p->ninit++;
+    if( err && !p->initerr ){
+        p->initerr = err;
+        err = NULL;
+    }
+    pthread_cond_broadcast( &p->rcond );
+    pthread_mutex_unlock( &p->mutex );
+    free( err );
+
+    return rc;
+}
+
+
+static int reset_lua( lua_State *L )
+{
+    lpt_worker_t *w = (lpt_worker_t*)lua_touserdata( L, 1 );
+
+    lua_settop( L, 0 );
+    if( w->pool->reset ){
+        lua_pushlightuserdata( L, (void*)&RESET_KEY );
+        lua_rawget( L, LUA_REGISTRYINDEX );
+        lua_call( L, 0, 0 );
+    }
+    if( w->pool->isolate )
+    {
+        lpt_pushglobaltable( L );
+        lua_pushlightuserdata( L, (void*)&GLOBALS_KEY );
+        lua_rawget( L, LUA_REGISTRYINDEX );
+        // restore the changed globals. assigning to the existing fields is
+        // allowed while traversing
+        lua_pushnil( L );
+        while( lua_next( L, 1 ) ){
+            lua_pushvalue( L, -2 );
+            lua_rawget( L, 2 );
+            if( !lua_rawequal( L, -1, -2 ) ){
+                lua_pushvalue( L, -3 );
+                lua_insert( L, -2 );
+                lua_rawset( L, 1 );
+                lua_pop( L, 1 );
+            }
+            else {
+                lua_pop( L, 2 );
+            }
+        }
+        // add the removed globals
+        lua_pushnil( L );
+        while( lua_next( L, 2 ) ){
+            lua_pushvalue( L, -2 );
+            lua_rawget( L, 1 );
+            if( lua_isnil( L, -1 ) ){
+                lua_pop( L, 1 );
+                lua_pushvalue( L, -2 );
+                lua_insert( L, -2 );
+                lua_rawset( L, 1 );
+            }
+            else {
+                lua_pop( L, 2 );
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+// reset the state after the task. the task limits are not applied
+static void reset_worker( lpt_worker_t *w, lpt_task_t *task )
+{
+    static const lpt_limit_t nolimit = { 0 };
+    lua_State *L = w->L;
+
+    lpt_cancel_start( &w->cancel, &nolimit );
+    lua_pushcfunction( L, lpt_traceback_lua );
+    lua_pushcfunction( L, reset_lua );
+    lua_pushlightuserdata( L, w );
+    if( lua_pcall( L, 1, 0, 1 ) && ( !w->pool->errors ||
+        lpt_error_send( L, w->pool->errors, task->id ) ) ){
+        lpt_error_log( L );
+    }
+    lua_settop( L, 0 );
+}
+
+
+static void *on_worker( void *arg )
+{
+    lpt_worker_t *w = (lpt_worker_t*)arg;
+    lua_State *L = w->L;
+    lpt_task_t *task = NULL;
+    uint64_t start = 0;
+
+    CURRENT = w;
+    lpt_cancel_attach( L, &w->cancel );
+    if( ( w->pool->init || w->pool->reset || w->pool->isolate ) &&
+        init_worker( w ) ){
+        return NULL;
+    }
+    if( w->pool->gcstop ){
+        lua_gc( L, LUA_GCSTOP, 0 );
+    }
+    while( ( task = pop_task( w ) ) )
+    {
+        atomic_store( &w->cancel.current, task->id );
+        lpt_cancel_start( &w->cancel, &task->limit );
+        start = lpt_now_ns();
+        lpt_stat_add( &w->stats.wait_ns, start - task->submitted );
+        lpt_stat_add( &w->stats.bytes_in, task->arglen );
+        lua_pushcfunction( L, lpt_traceback_lua );
+        lua_pushcfunction( L, run_task_lua );
+        lua_pushlightuserdata( L, w );
+        lua_pushlightuserdata( L, task );
+        if( lua_pcall( L, 2, 0, 1 ) ){
+            fail_task( w, task );
+        }
+        lua_settop( L, 0 );
+        atomic_store( &w->cancel.current, 0 );
+        if( w->pool->reset || w->pool->isolate ){
+            reset_worker( w, task );
+        }
+        if( w->pool->gcstop ){
+            // full collection may restart the collector
+            lua_gc( L, LUA_GCCOLLECT, 0 );
+            lua_gc( L, LUA_GCSTOP, 0 );
+        }
+        lpt_stat_add( &w->stats.run_ns, lpt_now_ns() - start );
+        lpt_stat_add( &w->stats.ntask, 1 );
+        if( w->result ){
+            lpt_stat_add( &w->stats.bytes_out, w->result->len );
+        }
+        if( task->future ){
+            lpt_result_t *res = w->result;
+
+            w->result = NULL;
+            resolve( task->future, res && res->ok, res, NULL,
+                     res ? NULL : "failed to transfer the results" );
+            done_pending( w->pool );
+        }
+        else if( wantresult( w, task ) ){
+            put_result( w, task );
+        }
+        else {
+            atomic_fetch_sub( &w->pool->npending, 1 );
+        }
+        task_free( task );
+        lpt_notify_signal( &w->pool->notify );
+    }
+
+    return NULL;
+}
+
+
+static void pool_close( lpt_pool_t *p )
+{
+    lpt_task_t *task = NULL;
+    lpt_result_t *res = NULL;
+    int i = 0;
+
+    pthread_mutex_lock( &p->mutex );
+    p->closed = 1;
+    pthread_cond_broadcast( &p->cond );
+    pthread_mutex_unlock( &p->mutex );
+
+    for(; i < p->nstarted; i++ ){
+        pthread_join( p->worker[i].id, NULL );
+    }
+    for( i = 0; i < p->nworker; i++ )
+    {
+        lpt_worker_t *w = &p->worker[i];
+
+        if( w->L ){
+            lpt_closestate( w->L );
+        }
+        while( w->ncache ){
+            lpt_shared_release( (lpt_shared_t*)w->cache[--w->ncache] );
+        }
+        while( !lpt_deque_isempty( &w->deque ) ){
+            task_free( lpt_deque_take( &w->deque ) );
+        }
+        lpt_deque_free( &w->deque );
+    }
+    // release tasks that have never been started
+    while( ( task = p->head ) ){
+        p->head = task->next;
+        task_free( task );
+    }
+    // release results that have never been collected
+    while( ( res = p->rhead ) ){
+        p->rhead = res->next;
+        result_free( res );
+    }
+    if( p->errors ){
+        lpt_shared_release( p->errors );
+    }
+    if( p->init ){
+        lpt_shared_release( (lpt_shared_t*)p->init );
+    }
+    if( p->reset ){
+        lpt_shared_release( (lpt_shared_t*)p->reset );
+    }
+    free( p->initerr );
+    lpt_notify_close( &p->notify );
+    pool_release( p );
+}
+
+
+static lpt_pool_t *checkpool( lua_State *L )
+{
+    lpt_pool_t **pp = (lpt_pool_t**)luaL_checkudata( L, 1, POOL_MT );
+
+    if( !*pp ){
+        luaL_error( L, "attempt to use a closed pool" );
+    }
+
+    return *pp;
+}
+
+
+// create a task of the chunk and the arguments from idx to top. returns NULL
+// on failure, and err is set to the error message of the encoder or NULL if
+// out of memory
+static lpt_task_t *newtask( lua_State *L, lpt_chunk_t *chunk, int idx,
+                            const char **err )
+{
+    lpt_buf_t buf = { 0 };
+    lpt_task_t *task = NULL;
+
+    *err = NULL;
+    // task header followed by encoded arguments
+    if( lpt_buf_reserve( &buf, sizeof( lpt_task_t ) ) ){
+        return NULL;
+    }
+    buf.len = sizeof( lpt_task_t );
+    if( ( *err = lpt_encode( L, idx, &buf ) ) ){
+        lpt_buf_free( &buf );
+        return NULL;
+    }
+    task = (lpt_task_t*)buf.data;
+    task->next = NULL;
+    task->id = 0;
+    task->kind = TASK_CALL;
+    task->sink = NULL;
+    task->slot = 0;
+    task->cancelled = 0;
+    memset( &task->limit, 0, sizeof( lpt_limit_t ) );
+    task->submitted = lpt_now_ns();
+    task->future = NULL;
+    task->input = NULL;
+    lpt_shared_retain( (lpt_shared_t*)chunk );
+    task->chunk = chunk;
+    task->arglen = buf.len - sizeof( lpt_task_t );
+    task->nref = buf.nref;
+
+    return task;
+}
+
+
+// push the list of the tasks to the shared queue at once
+static void push_global( lpt_pool_t *p, lpt_task_t *head, lpt_task_t *tail,
+                         int ntask )
+{
+    pthread_mutex_lock( &p->mutex );
+    if( p->tail ){
+        p->tail->next = head;
+    }
+    else {
+        p->head = head;
+    }
+    p->tail = tail;
+    atomic_fetch_add( &p->nqueue, ntask );
+    if( ntask > 1 ){
+        pthread_cond_broadcast( &p->cond );
+    }
+    else {
+        pthread_cond_signal( &p->cond );
+    }
+    pthread_mutex_unlock( &p->mutex );
+}
+
+
+// wait for a space of the shared queue if the maxqueue option is specified.
+// returns 0, EAGAIN if the queue is full and block is not set, or ECANCELED
+static int wait_space( lpt_pool_t *p, int block )
+{
+    int rc = 0;
+
+    if( !p->maxqueue || atomic_load( &p->nqueue ) < p->maxqueue ){
+        return 0;
+    }
+    else if( !block ){
+        return EAGAIN;
+    }
+
+    pthread_mutex_lock( &p->mutex );
+    p->nspacewait++;
+    while( atomic_load( &p->nqueue ) >= p->maxqueue &&
+           ( rc = lpt_cancel_wait( &p->qcond, &p->mutex, NULL ) ) != ECANCELED );
+    p->nspacewait--;
+    pthread_mutex_unlock( &p->mutex );
+
+    return rc == ECANCELED ? rc : 0;
+}
+
+
+// assign the ids to the tasks. returns the first id
+static uint64_t assign_ids( lpt_pool_t *p, lpt_task_t *task, int ntask )
+{
+    uint64_t id = atomic_fetch_add( &p->nextid, (uint64_t)ntask );
+    uint64_t first = id;
+
+    atomic_fetch_add( &p->npending, (size_t)ntask );
+    for(; task; task = task->next ){
+        task->id = id++;
+    }
+
+    return first;
+}
+
+
+// get the function of fn or the table of the fn field with the limits
+static lpt_chunk_t *checktask( lua_State *L, int idx, lpt_limit_t *limit )
+{
+    lpt_chunk_t *chunk = NULL;
+
+    if( lua_type( L, idx ) != LUA_TTABLE ){
+        lpt_limit_parse( L, 0, limit );
+        return lpt_checkfn( L, idx );
+    }
+    lpt_limit_parse( L, idx, limit );
+    lua_getfield( L, idx, "fn" );
+    chunk = lpt_checkfn( L, -1 );
+    lua_pop( L, 1 );
+
+    return chunk;
+}
+
+
+// the shared queue is bounded only for the tasks submitted from outside of
+// the workers
+static int submit_task( lua_State *L, lpt_pool_t *p, lpt_worker_t *w,
+                        int idx, int block )
+{
+    lpt_limit_t limit;
+    lpt_chunk_t *chunk = checktask( L, idx, &limit );
+    const char *err = NULL;
+    lpt_task_t *task = NULL;
+    uint64_t id = 0;
+    int rc = 0;
+
+    if( !w && ( rc = wait_space( p, block ) ) ){
+        lpt_shared_release( (lpt_shared_t*)chunk );
+        if( rc == ECANCELED ){
+            return lpt_cancel_error( L );
+        }
+        // full
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+    task = newtask( L, chunk, idx + 1, &err );
+    lpt_shared_release( (lpt_shared_t*)chunk );
+    if( task ){
+        task->limit = limit;
+        id = assign_ids( p, task, 1 );
+        // push to the own deque that the idle workers steal from
+        if( w && lpt_deque_push( &w->deque, task ) == 0 ){
+            wakeup( p );
+        }
+        else {
+            push_global( p, task, task, 1 );
+        }
+        lua_pushinteger( L, (lua_Integer)id );
+        return 1;
+    }
+    else if( err ){
+        return luaL_error( L, "%s", err );
+    }
+
+    lua_pushboolean( L, 0 );
+    lua_pushstring( L, strerror( ENOMEM ) );
+
+    return 2;
+}
+
+
+static int submit_lua( lua_State *L )
+{
+    return submit_task( L, checkpool( L ), NULL, 2, 1 );
+}
+
+
+static int try_submit_lua( lua_State *L )
+{
+    return submit_task( L, checkpool( L ), NULL, 2, 0 );
+}
+
+
+int lpt_pool_submit_lua( lua_State *L )
+{
+    lpt_worker_t *w = CURRENT;
+
+    if( !w ){
+        return luaL_error( L, "pthread.submit must be called in a pool worker" );
+    }
+
+    return submit_task( L, w->pool, w, 1, 1 );
+}
+
+
+static int submit_batch_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+    lpt_limit_t limit;
+    lpt_chunk_t *chunk = checktask( L, 2, &limit );
+    lpt_task_t *head = NULL;
+    lpt_task_t *tail = NULL;
+    lpt_task_t *task = NULL;
+    const char *err = NULL;
+    int ntask = 0;
+    int i = 1;
+
+    lua_settop( L, 3 );
+    if( lua_type( L, 3 ) != LUA_TTABLE ){
+        lpt_shared_release( (lpt_shared_t*)chunk );
+        return luaL_argerror( L, 3, "table expected" );
+    }
+    ntask = (int)lpt_rawlen( L, 3 );
+
+    // encode all tasks before queueing
+    for(; i <= ntask; i++ )
+    {
+        int narg = 0;
+        int j = 1;
+
+        lua_rawgeti( L, 3, i );
+        if( lua_type( L, 4 ) != LUA_TTABLE ){
+            err = "arguments must be table";
+            break;
+        }
+        narg = (int)lpt_rawlen( L, 4 );
+        if( !lua_checkstack( L, narg ) ){
+            err = "too many arguments";
+            break;
+        }
+        for(; j <= narg; j++ ){
+            lua_rawgeti( L, 4, j );
+        }
+        if( !( task = newtask( L, chunk, 5, &err ) ) ){
+            break;
+        }
+        task->limit = limit;
+        lua_settop( L, 3 );
+        if( tail ){
+            tail->next = task;
+        }
+        else {
+            head = task;
+        }
+        tail = task;
+    }
+    lpt_shared_release( (lpt_shared_t*)chunk );
+
+    if( i <= ntask )
+    {
+        while( ( task = head ) ){
+            head = task->next;
+            task_free( task );
+        }
+        if( err ){
+            return luaL_error( L, "%s", err );
+        }
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return 2;
+    }
+    else if( !ntask ){
+        lua_pushboolean( L, 0 );
+        lua_pushstring( L, "no tasks" );
+        return 2;
+    }
+
+    // the whole batch is queued once the queue has a space
+    else if( wait_space( p, 1 ) ){
+        while( ( task = head ) ){
+            head = task->next;
+            task_free( task );
+        }
+        return lpt_cancel_error( L );
+    }
+
+    lua_pushinteger( L, (lua_Integer)assign_ids( p, head, ntask ) );
+    push_global( p, head, tail, ntask );
+
+    return 1;
+}
+
+
+// push the result as { id, ok, ... }
+static void push_result( lua_State *L, lpt_result_t *res )
+{
+    int n = 0;
+
+    lua_createtable( L, 2, 0 );
+    lua_pushinteger( L, (lua_Integer)res->id );
+    lua_rawseti( L, -2, 1 );
+    if( ( n = lpt_decode( L, res->data, res->len ) ) < 0 ){
+        lua_pushboolean( L, 0 );
+        lua_rawseti( L, -2, 2 );
+        lua_pushliteral( L, "failed to decode results" );
+        lua_rawseti( L, -2, 3 );
+    }
+    else {
+        lua_pushboolean( L, res->ok );
+        lua_rawseti( L, -2 - n, 2 );
+        for(; n > 0; n-- ){
+            lua_rawseti( L, -1 - n, 2 + n );
+        }
+    }
+    result_free( res );
+}
+
+
+static int collect_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+    lua_Integer n = luaL_optinteger( L, 2, 0 );
+    struct timespec ts = { 0 };
+    struct timespec *abstime = NULL;
+    lpt_result_t *head = NULL;
+    lpt_result_t *res = NULL;
+    int nres = 0;
+    int rc = 0;
+
+    if( !p->results ){
+        return luaL_error( L, "results option is not enabled" );
+    }
+    luaL_argcheck( L, n >= 0, 2, "n must be greater than or equal to 0" );
+    abstime = lpt_timeout_abstime( L, 3, &ts );
+
+    pthread_mutex_lock( &p->mutex );
+    // wait for a result unless no task is running
+    if( !abstime ){
+        while( !p->rhead && atomic_load( &p->npending ) ){
+            pthread_cond_wait( &p->rcond, &p->mutex );
+        }
+    }
+    else {
+        while( !p->rhead && atomic_load( &p->npending ) && rc == 0 ){
+            rc = pthread_cond_timedwait( &p->rcond, &p->mutex, abstime );
+        }
+    }
+    // detach up to n results
+    if( ( head = res = p->rhead ) )
+    {
+        nres = 1;
+        while( res->next && nres != n ){
+            res = res->next;
+            nres++;
+        }
+        if( !( p->rhead = res->next ) ){
+            p->rtail = NULL;
+        }
+        res->next = NULL;
+    }
+    pthread_mutex_unlock( &p->mutex );
+
+    lua_settop( L, 1 );
+    lua_createtable( L, nres, 0 );
+    for( nres = 1; ( res = head ); nres++ ){
+        head = res->next;
+        push_result( L, res );
+        lua_rawseti( L, -2, nres );
+    }
+
+    return 1;
+}
+
+
+static int cancel_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+    lua_Number id = luaL_checknumber( L, 2 );
+    lpt_task_t *task = NULL;
+    int ok = 0;
+    int i = 0;
+
+    luaL_argcheck( L, id > 0, 2, "id must be greater than 0" );
+    pthread_mutex_lock( &p->mutex );
+    // queued tasks fail without running
+    for( task = p->head; task; task = task->next ){
+        if( task->id == (uint64_t)id ){
+            task->cancelled = ok = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &p->mutex );
+    // the running tasks may wait with the mutex of this pool. the tasks in
+    // the deques of the workers are not found until they are started
+    for(; !ok && i < p->nworker; i++ ){
+        ok = lpt_cancel_request( &p->worker[i].cancel, (uint64_t)id );
+    }
+    lua_pushboolean( L, ok );
+
+    return 1;
+}
+
+
+static int pending_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+
+    lua_pushinteger( L, (lua_Integer)atomic_load( &p->npending ) );
+
+    return 1;
+}
+
+
+#define DEFAULT_POOL    "pthread.pool.default"
+
+// push the pool of the pool option, or a temporary pool of the threads
+// option, or the default pool that is created on first use
+static lpt_pool_t *pushpool( lua_State *L, int idx, int *temporary )
+{
+    lua_Integer n = 0;
+    lpt_pool_t **pp = NULL;
+
+    *temporary = 0;
+    if( !lua_isnil( L, idx ) )
+    {
+        lua_getfield( L, idx, "pool" );
+        if( !lua_isnil( L, -1 ) ){
+            pp = (lpt_pool_t**)luaL_checkudata( L, -1, POOL_MT );
+            goto CHECK;
+        }
+        lua_pop( L, 1 );
+        lua_getfield( L, idx, "threads" );
+        if( !lua_isnil( L, -1 ) ){
+            n = lauxh_checkinteger( L, -1 );
+            luaL_argcheck( L, n > 0, idx, "threads must be greater than 0" );
+            *temporary = 1;
+        }
+        lua_pop( L, 1 );
+    }
+
+    if( !*temporary )
+    {
+        lua_getfield( L, LUA_REGISTRYINDEX, DEFAULT_POOL );
+        if( !lua_isnil( L, -1 ) ){
+            pp = (lpt_pool_t**)lua_touserdata( L, -1 );
+            goto CHECK;
+        }
+        lua_pop( L, 1 );
+        n = (lua_Integer)sysconf( _SC_NPROCESSORS_ONLN );
+        n = n > 0 ? n : 1;
+    }
+
+    lua_pushcfunction( L, lpt_pool_new );
+    lua_pushinteger( L, n );
+    lua_call( L, 1, 2 );
+    if( lua_isnil( L, -2 ) ){
+        luaL_error( L, "failed to create a pool: %s", lua_tostring( L, -1 ) );
+    }
+    lua_pop( L, 1 );
+    if( !*temporary ){
+        lua_pushvalue( L, -1 );
+        lua_setfield( L, LUA_REGISTRYINDEX, DEFAULT_POOL );
+    }
+    pp = (lpt_pool_t**)lua_touserdata( L, -1 );
+
+CHECK:
+    if( !*pp ){
+        luaL_error( L, "attempt to use a closed pool" );
+    }
+    else if( CURRENT && CURRENT->pool == *pp ){
+        luaL_error( L, "cannot wait for the pool in its own worker" );
+    }
+
+    return *pp;
+}
+
+
+// run the tasks of fn at 1 over the slices of the array at 2 with the
+// options at 3, and wait for their results. the pool is pushed on the stack.
+// returns the results of the slices in order, or NULL with an error message
+static lpt_result_t **run_slices( lua_State *L, int kind, int *nslot,
+                                  int *slice )
+{
+    int len = (int)lpt_rawlen( L, 2 );
+    int temporary = 0;
+    lpt_pool_t *p = pushpool( L, 3, &temporary );
+    lua_Integer size = 0;
+    lpt_chunk_t *chunk = NULL;
+    lpt_task_t *head = NULL;
+    lpt_task_t *tail = NULL;
+    lpt_task_t *task = NULL;
+    lpt_sink_t sink;
+    const char *err = NULL;
+    int ntask = 0;
+    int from = 1;
+
+    // slice size
+    if( !lua_isnil( L, 3 ) ){
+        lua_getfield( L, 3, "chunk" );
+        if( !lua_isnil( L, -1 ) ){
+            size = lauxh_checkinteger( L, -1 );
+            luaL_argcheck( L, size > 0, 3, "chunk must be greater than 0" );
+        }
+        lua_pop( L, 1 );
+    }
+    if( !size ){
+        // a few slices per worker to even out the load
+        size = ( len + p->nworker * 4 - 1 ) / ( p->nworker * 4 );
+        size = size > 0 ? size : 1;
+    }
+
+    *nslot = 0;
+    *slice = (int)size;
+    if( len == 0 ){
+        return NULL;
+    }
+    chunk = lpt_checkfn( L, 1 );
+
+    // encode all slices before queueing
+    for(; from <= len; from += (int)size )
+    {
+        int to = ( size > len - from ) ? len : from + (int)size - 1;
+        lpt_buf_t buf = { 0 };
+
+        lua_pushinteger( L, (lua_Integer)from );
+        lua_pushinteger( L, (lua_Integer)( to - from + 1 ) );
+        // arguments: slice, base index, number of elements
+        if( lpt_buf_reserve( &buf, sizeof( lpt_task_t ) ) ){
+            lua_pop( L, 2 );
+            err = strerror( ENOMEM );
+            break;
+        }
+        buf.len = sizeof( lpt_task_t );
+        if( ( err = lpt_encode_slice( L, 2, from, to, &buf ) ) ||
+            ( err = lpt_encode( L, lua_gettop( L ) - 1, &buf ) ) ){
+            // release the references of the slice
+            if( buf.nref ){
+                lpt_discard( buf.data + sizeof( lpt_task_t ),
+                             buf.len - sizeof( lpt_task_t ) );
+            }
+            lpt_buf_free( &buf );
+            lua_pop( L, 2 );
+            break;
+        }
+        lua_pop( L, 2 );
+        task = (lpt_task_t*)buf.data;
+        task->next = NULL;
+        task->id = 0;
+        task->kind = kind;
+        task->sink = &sink;
+        task->slot = ntask++;
+        task->cancelled = 0;
+        memset( &task->limit, 0, sizeof( lpt_limit_t ) );
+        task->submitted = lpt_now_ns();
+        lpt_shared_retain( (lpt_shared_t*)chunk );
+        task->chunk = chunk;
+        task->arglen = buf.len - sizeof( lpt_task_t );
+        task->nref = buf.nref;
+        if( tail ){
+            tail->next = task;
+        }
+        else {
+            head = task;
+        }
+        tail = task;
+    }
+    lpt_shared_release( (lpt_shared_t*)chunk );
+
+    if( !err && !( sink.slots = calloc( (size_t)ntask,
+                                        sizeof( lpt_result_t* ) ) ) ){
+        err = strerror( ENOMEM );
+    }
+    if( err ){
+        while( ( task = head ) ){
+            head = task->next;
+            task_free( task );
+        }
+        lua_pushstring( L, err );
+        return NULL;
+    }
+
+    pthread_mutex_init( &sink.mutex, NULL );
+    lpt_cond_init( &sink.cond );
+    sink.remaining = ntask;
+    push_global( p, head, tail, ntask );
+
+    pthread_mutex_lock( &sink.mutex );
+    while( sink.remaining ){
+        pthread_cond_wait( &sink.cond, &sink.mutex );
+    }
+    pthread_mutex_unlock( &sink.mutex );
+    pthread_cond_destroy( &sink.cond );
+    pthread_mutex_destroy( &sink.mutex );
+
+    if( temporary ){
+        lpt_pool_t **pp = (lpt_pool_t**)lua_touserdata( L, -1 );
+
+        pool_close( p );
+        *pp = NULL;
+    }
+    lua_pop( L, 1 );
+    *nslot = ntask;
+
+    return sink.slots;
+}
+
+
+// decode the result of the slot. returns the number of values, or -1 with an
+// error message
+static int push_slot( lua_State *L, lpt_result_t *res )
+{
+    int n = 0;
+
+    if( !res ){
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return -1;
+    }
+    else if( ( n = lpt_decode( L, res->data, res->len ) ) < 0 ){
+        lua_pushliteral( L, "failed to decode results" );
+        return -1;
+    }
+    else if( !res->ok ){
+        lua_settop( L, lua_gettop( L ) - n + 1 );
+        return -1;
+    }
+
+    return n;
+}
+
+
+static void free_slots( lpt_result_t **slots, int nslot )
+{
+    int i = 0;
+
+    for(; i < nslot; i++ ){
+        if( slots[i] ){
+            result_free( slots[i] );
+        }
+    }
+    free( slots );
+}
+
+
+int lpt_pool_map_lua( lua_State *L )
+{
+    lpt_result_t **slots = NULL;
+    int nslot = 0;
+    int slice = 0;
+    int i = 0;
+
+    luaL_checktype( L, 2, LUA_TTABLE );
+    if( !lua_isnoneornil( L, 3 ) ){
+        luaL_checktype( L, 3, LUA_TTABLE );
+    }
+    lua_settop( L, 3 );
+    if( !( slots = run_slices( L, TASK_MAP, &nslot, &slice ) ) )
+    {
+        // empty array
+        if( !nslot && lua_gettop( L ) == 4 ){
+            lua_newtable( L );
+            return 1;
+        }
+        lua_pushnil( L );
+        lua_insert( L, -2 );
+        return 2;
+    }
+
+    lua_settop( L, 3 );
+    lua_createtable( L, (int)lpt_rawlen( L, 2 ), 0 );
+    for(; i < nslot; i++ )
+    {
+        if( push_slot( L, slots[i] ) < 0 ){
+            free_slots( slots, nslot );
+            lua_pushnil( L );
+            lua_insert( L, -2 );
+            return 2;
+        }
+        // copy the mapped slice. fn may return nil
+        lua_settop( L, 5 );
+        lua_pushnil( L );
+        while( lua_next( L, 5 ) ){
+            lua_rawseti( L, 4, i * slice + (int)lua_tointeger( L, -2 ) );
+        }
+        lua_pop( L, 1 );
+    }
+    free_slots( slots, nslot );
+
+    return 1;
+}
+
+
+int lpt_pool_reduce_lua( lua_State *L )
+{
+    lpt_result_t **slots = NULL;
+    int nslot = 0;
+    int slice = 0;
+    int i = 0;
+
+    luaL_checktype( L, 2, LUA_TTABLE );
+    if( !lua_isnoneornil( L, 4 ) ){
+        luaL_checktype( L, 4, LUA_TTABLE );
+    }
+    lua_settop( L, 4 );
+    // move init to 4 and options to 3
+    lua_insert( L, 3 );
+    if( !( slots = run_slices( L, TASK_REDUCE, &nslot, &slice ) ) )
+    {
+        // empty array
+        if( !nslot && lua_gettop( L ) == 5 ){
+            lua_pushvalue( L, 4 );
+            return 1;
+        }
+        lua_pushnil( L );
+        lua_insert( L, -2 );
+        return 2;
+    }
+
+    // combine the partial results in order by fn
+    lua_settop( L, 4 );
+    for(; i < nslot; i++ )
+    {
+        if( push_slot( L, slots[i] ) < 0 ){
+            free_slots( slots, nslot );
+            lua_pushnil( L );
+            lua_insert( L, -2 );
+            return 2;
+        }
+        lua_settop( L, 5 );
+        // no initial value
+        if( i == 0 && lua_isnil( L, 4 ) ){
+            lua_replace( L, 4 );
+            continue;
+        }
+        lua_pushvalue( L, 1 );
+        lua_insert( L, 4 );
+        if( lua_pcall( L, 2, 1, 0 ) ){
+            free_slots( slots, nslot );
+            lua_pushnil( L );
+            lua_insert( L, -2 );
+            return 2;
+        }
+    }
+    free_slots( slots, nslot );
+
+    return 1;
+}
+
+
+static int size_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+
+    lua_pushinteger( L, p->nworker );
+
+    return 1;
+}
+
+
+// push the stats of the worker and add them to the totals
+static void push_wstats( lua_State *L, lpt_worker_t *w, int started,
+                         uint64_t *total )
+{
+    uint64_t v[7] = {
+        lpt_stat_get( &w->stats.ntask ),
+        lpt_stat_get( &w->stats.nfail ),
+        lpt_stat_get( &w->stats.nsteal ),
+        lpt_stat_get( &w->stats.wait_ns ),
+        lpt_stat_get( &w->stats.run_ns ),
+        lpt_stat_get( &w->stats.bytes_in ),
+        lpt_stat_get( &w->stats.bytes_out )
+    };
+    int i = 0;
+
+    for(; i < 7; i++ ){
+        total[i] += v[i];
+    }
+    lua_createtable( L, 0, 10 );
+    lauxh_pushint2tbl( L, "tasks", (lua_Integer)v[0] );
+    lauxh_pushint2tbl( L, "failed", (lua_Integer)v[1] );
+    lauxh_pushint2tbl( L, "steals", (lua_Integer)v[2] );
+    lauxh_pushint2tbl( L, "wait_ns", (lua_Integer)v[3] );
+    lauxh_pushint2tbl( L, "run_ns", (lua_Integer)v[4] );
+    lauxh_pushint2tbl( L, "bytes_in", (lua_Integer)v[5] );
+    lauxh_pushint2tbl( L, "bytes_out", (lua_Integer)v[6] );
+    lauxh_pushint2tbl( L, "cpu_ns",
+                       started ? (lua_Integer)lpt_cputime_ns( w->id ) : 0 );
+    lauxh_pushint2tbl( L, "heap", (lua_Integer)lpt_heapsize( w->L ) );
+    lauxh_pushint2tbl( L, "queued", (lua_Integer)lpt_deque_size( &w->deque ) );
+}
+
+
+static int stats_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+    uint64_t total[7] = { 0 };
+    uint64_t queued = (uint64_t)atomic_load( &p->nqueue );
+    int i = 0;
+
+    lua_settop( L, 1 );
+    lua_createtable( L, 0, 11 );
+    lua_createtable( L, p->nworker, 0 );
+    for(; i < p->nworker; i++ ){
+        push_wstats( L, &p->worker[i], i < p->nstarted, total );
+        queued += lpt_deque_size( &p->worker[i].deque );
+        lua_rawseti( L, -2, i + 1 );
+    }
+    lua_setfield( L, -2, "workers" );
+
+    lauxh_pushint2tbl( L, "size", p->nworker );
+    lauxh_pushint2tbl( L, "pending", (lua_Integer)atomic_load( &p->npending ) );
+    lauxh_pushint2tbl( L, "queued", (lua_Integer)queued );
+    lauxh_pushint2tbl( L, "tasks", (lua_Integer)total[0] );
+    lauxh_pushint2tbl( L, "failed", (lua_Integer)total[1] );
+    lauxh_pushint2tbl( L, "steals", (lua_Integer)total[2] );
+    lauxh_pushint2tbl( L, "wait_ns", (lua_Integer)total[3] );
+    lauxh_pushint2tbl( L, "run_ns", (lua_Integer)total[4] );
+    lauxh_pushint2tbl( L, "bytes_in", (lua_Integer)total[5] );
+    lauxh_pushint2tbl( L, "bytes_out", (lua_Integer)total[6] );
+
+    return 1;
+}
+
+
+static int fd_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+    int rc = 0;
+
+    pthread_mutex_lock( &p->mutex );
+    rc = lpt_notify_open( &p->notify );
+    pthread_mutex_unlock( &p->mutex );
+
+    if( rc ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( rc ) );
+        return 2;
+    }
+    lua_pushinteger( L, p->notify.rfd );
+
+    return 1;
+}
+
+
+static int completed_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+
+    lua_pushinteger( L, (lua_Integer)lpt_notify_clear( &p->notify ) );
+
+    return 1;
+}
+
+
+static int close_lua( lua_State *L )
+{
+    lpt_pool_t **pp = (lpt_pool_t**)luaL_checkudata( L, 1, POOL_MT );
+
+    if( *pp ){
+        pool_close( *pp );
+        *pp = NULL;
+    }
+
+    return 0;
+}
+
+
+static int tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, POOL_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_pool_new( lua_State *L )
+{
+    lua_Integer n = lauxh_checkinteger( L, 1 );
+    lpt_pool_t **pp = NULL;
+    lpt_pool_t *p = NULL;
+    lpt_shared_t *sink = NULL;
+    lpt_opts_t opts;
+    lpt_attr_t attr;
+    pthread_attr_t pattr;
+    int maxqueue = 0;
+    int rc = 0;
+    int i = 0;
+
+    luaL_argcheck( L, n > 0, 1, "number of threads must be greater than 0" );
+    lpt_opts_parse( L, lua_isnoneornil( L, 2 ) ? 0 : 2, &opts );
+    lpt_attr_parse( L, opts.idx, &attr );
+    if( opts.idx ){
+        lua_getfield( L, opts.idx, "maxqueue" );
+        if( !lua_isnil( L, -1 ) ){
+            lua_Integer max = lauxh_checkinteger( L, -1 );
+
+            if( max <= 0 || max > INT_MAX ){
+                return luaL_error( L, "maxqueue must be greater than 0" );
+            }
+            maxqueue = (int)max;
+        }
+        lua_pop( L, 1 );
+        sink = lpt_error_sink( L, opts.idx );
+    }
+    lua_settop( L, 2 );
+
+    pp = lua_newuserdata( L, sizeof( lpt_pool_t* ) );
+    *pp = NULL;
+    if( !( p = calloc( 1, sizeof( lpt_pool_t ) +
+                          sizeof( lpt_worker_t ) * (size_t)n ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    atomic_init( &p->refcnt, 1 );
+    pthread_mutex_init( &p->mutex, NULL );
+    lpt_cond_init( &p->cond );
+    lpt_notify_init( &p->notify );
+    atomic_init( &p->nqueue, 0 );
+    atomic_init( &p->nidle, 0 );
+    atomic_init( &p->nextid, 1 );
+    atomic_init( &p->npending, 0 );
+    lpt_cond_init( &p->rcond );
+    lpt_cond_init( &p->qcond );
+    if( opts.idx ){
+        lua_getfield( L, opts.idx, "results" );
+        p->results = lua_toboolean( L, -1 );
+        lua_pop( L, 1 );
+    }
+    p->maxqueue = maxqueue;
+    if( ( p->errors = sink ) ){
+        lpt_shared_retain( sink );
+    }
+    p->gcstop = opts.gc.stop;
+    p->nworker = (int)n;
+    *pp = p;
+    lauxh_setmetatable( L, POOL_MT );
+    if( opts.idx ){
+        lua_getfield( L, opts.idx, "init" );
+        if( !lua_isnil( L, -1 ) ){
+            p->init = lpt_checkfn( L, -1 );
+        }
+        lua_pop( L, 1 );
+        lua_getfield( L, opts.idx, "reset" );
+        if( !lua_isnil( L, -1 ) ){
+            p->reset = lpt_checkfn( L, -1 );
+        }
+        lua_pop( L, 1 );
+        lua_getfield( L, opts.idx, "isolate" );
+        p->isolate = lua_toboolean( L, -1 );
+        lua_pop( L, 1 );
+    }
+
+    // create states before starting threads
+    for(; i < p->nworker; i++ )
+    {
+        p->worker[i].pool = p;
+        p->worker[i].idx = i;
+        lpt_cancel_init( &p->worker[i].cancel );
+        if( lpt_deque_init( &p->worker[i].deque ) ){
+            rc = errno;
+            goto FAILED;
+        }
+        else if( !( p->worker[i].L = lpt_newstate( L, &opts ) ) ){
+            pool_close( p );
+            *pp = NULL;
+            lua_pushnil( L );
+            lua_insert( L, -2 );
+            return 2;
+        }
+    }
+    for( i = 0; i < p->nworker; i++ )
+    {
+        if( ( rc = lpt_attr_init( &pattr, &attr, i ) ) ){
+            goto FAILED;
+        }
+        rc = pthread_create( &p->worker[i].id, &pattr, on_worker,
+                             (void*)&p->worker[i] );
+        pthread_attr_destroy( &pattr );
+        if( rc ){
+            goto FAILED;
+        }
+        p->nstarted++;
+    }
+
+    // wait for the init functions to report their errors
+    if( p->init || p->reset || p->isolate )
+    {
+        pthread_mutex_lock( &p->mutex );
+        while( p->ninit < p->nstarted ){
+            pthread_cond_wait( &p->rcond, &p->mutex );
+        }
+        pthread_mutex_unlock( &p->mutex );
+        if( p->initerr ){
+            lua_pushnil( L );
+            lua_pushstring( L, p->initerr );
+            pool_close( p );
+            *pp = NULL;
+            return 2;
+        }
+    }
+
+    return 1;
+
+FAILED:
+    pool_close( p );
+    *pp = NULL;
+    lua_pushnil( L );
+    lua_pushstring( L, strerror( rc ) );
+
+    return 2;
+}
+
+
+static inline lpt_future_t *checkfuture( lua_State *L )
+{
+    return (lpt_future_t*)lpt_shared_check( L, 1, FUTURE_MT );
+}
+
+
+static int isclosed( lpt_pool_t *p )
+{
+    int closed = 0;
+
+    pthread_mutex_lock( &p->mutex );
+    closed = p->closed;
+    pthread_mutex_unlock( &p->mutex );
+
+    return closed;
+}
+
+
+static int future_lua( lua_State *L )
+{
+    lpt_pool_t *p = checkpool( L );
+    lpt_limit_t limit;
+    lpt_chunk_t *chunk = checktask( L, 2, &limit );
+    const char *err = NULL;
+    lpt_task_t *task = NULL;
+    lpt_future_t *f = NULL;
+
+    if( wait_space( p, 1 ) ){
+        lpt_shared_release( (lpt_shared_t*)chunk );
+        return lpt_cancel_error( L );
+    }
+    task = newtask( L, chunk, 3, &err );
+    lpt_shared_release( (lpt_shared_t*)chunk );
+    if( !task ){
+        if( err ){
+            return luaL_error( L, "%s", err );
+        }
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return 2;
+    }
+    else if( !( f = newfuture( p, FUTURE_TASK, 0 ) ) ){
+        task_free( task );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return 2;
+    }
+    lpt_shared_push( L, (lpt_shared_t*)f );
+    lpt_shared_retain( (lpt_shared_t*)f );
+    task->future = f;
+    task->limit = limit;
+    f->id = assign_ids( p, task, 1 );
+    push_global( p, task, task, 1 );
+
+    return 1;
+}
+
+
+static int then_lua( lua_State *L )
+{
+    lpt_future_t *in = checkfuture( L );
+    lpt_limit_t limit;
+    lpt_chunk_t *chunk = NULL;
+    const char *err = NULL;
+    lpt_task_t *task = NULL;
+    lpt_future_t *f = NULL;
+    lpt_waiter_t *wt = NULL;
+
+    if( isclosed( in->pool ) ){
+        return luaL_error( L, "attempt to use a closed pool" );
+    }
+    chunk = checktask( L, 2, &limit );
+    lua_settop( L, 2 );
+    task = newtask( L, chunk, 3, &err );
+    lpt_shared_release( (lpt_shared_t*)chunk );
+    if( !task ){
+        if( err ){
+            return luaL_error( L, "%s", err );
+        }
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return 2;
+    }
+    else if( !( f = newfuture( in->pool, FUTURE_TASK, 0 ) ) ){
+        task_free( task );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return 2;
+    }
+    lpt_shared_push( L, (lpt_shared_t*)f );
+    lpt_shared_retain( (lpt_shared_t*)f );
+    task->future = f;
+    task->limit = limit;
+    if( !( wt = malloc( sizeof( lpt_waiter_t ) ) ) ){
+        task_free( task );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    // arguments are the values of the input
+    lpt_shared_retain( (lpt_shared_t*)in );
+    task->input = in;
+    f->id = assign_ids( in->pool, task, 1 );
+    lpt_shared_retain( (lpt_shared_t*)f );
+    wt->future = f;
+    wt->task = task;
+    add_waiter( in, wt );
+
+    return 1;
+}
+
+
+// create the future of the kind that waits for the futures in the table
+static int combine( lua_State *L, int kind )
+{
+    lpt_pool_t *p = NULL;
+    lpt_future_t *f = NULL;
+    lpt_waiter_t *head = NULL;
+    lpt_waiter_t *wt = NULL;
+    int n = 0;
+    int i = 1;
+
+    luaL_checktype( L, 1, LUA_TTABLE );
+    lua_settop( L, 1 );
+    n = (int)lpt_rawlen( L, 1 );
+    luaL_argcheck( L, n > 0, 1, "futures must not be empty" );
+    for(; i <= n; i++ )
+    {
+        lpt_shared_t *obj = NULL;
+
+        lua_rawgeti( L, 1, i );
+        if( !( obj = lpt_shared_test( L, -1 ) ) || obj->type != &FUTURE_TYPE ){
+            return luaL_error( L, "futures[%d] must be " FUTURE_MT, i );
+        }
+        else if( p && ( (lpt_future_t*)obj )->pool != p ){
+            return luaL_error( L, "futures must belong to the same pool" );
+        }
+        p = ( (lpt_future_t*)obj )->pool;
+        lua_pop( L, 1 );
+    }
+
+    if( !( f = newfuture( p, kind, n ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return 2;
+    }
+    lpt_shared_push( L, (lpt_shared_t*)f );
+    for( i = 0; i < n; i++ )
+    {
+        if( !( wt = malloc( sizeof( lpt_waiter_t ) ) ) ){
+            while( ( wt = head ) ){
+                head = wt->next;
+                free( wt );
+            }
+            lua_pushnil( L );
+            lua_pushstring( L, strerror( errno ) );
+            return 2;
+        }
+        wt->next = head;
+        head = wt;
+        lua_rawgeti( L, 1, i + 1 );
+        f->inputs[i] = (lpt_future_t*)lpt_shared_test( L, -1 );
+        lpt_shared_retain( (lpt_shared_t*)f->inputs[i] );
+        lua_pop( L, 1 );
+    }
+
+    // the waiters may resolve the future immediately
+    for( i = 0; ( wt = head ); i++ ){
+        head = wt->next;
+        lpt_shared_retain( (lpt_shared_t*)f );
+        wt->future = f;
+        wt->task = NULL;
+        add_waiter( f->inputs[i], wt );
+    }
+
+    return 1;
+}
+
+
+int lpt_future_all_lua( lua_State *L )
+{
+    return combine( L, FUTURE_ALL );
+}
+
+
+int lpt_future_any_lua( lua_State *L )
+{
+    return combine( L, FUTURE_ANY );
+}
+
+
+static int get_lua( lua_State *L )
+{
+    lpt_future_t *f = checkfuture( L );
+    struct timespec ts = { 0 };
+    struct timespec *abstime = NULL;
+    int done = 0;
+    int rc = 0;
+    int n = 0;
+
+    abstime = lpt_timeout_abstime( L, 2, &ts );
+
+    pthread_mutex_lock( &f->mutex );
+    while( !f->done && rc != ETIMEDOUT ){
+        if( ( rc = lpt_cancel_wait( &f->cond, &f->mutex,
+                                    abstime ) ) == ECANCELED ){
+            pthread_mutex_unlock( &f->mutex );
+            return lpt_cancel_error( L );
+        }
+    }
+    done = f->done;
+    pthread_mutex_unlock( &f->mutex );
+
+    lua_settop( L, 1 );
+    if( !done ){
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+    lua_pushboolean( L, f->ok );
+    if( ( n = push_value( L, f ) ) < 0 ){
+        lua_settop( L, 1 );
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "failed to decode results" );
+        return 2;
+    }
+
+    return 1 + n;
+}
+
+
+static int is_done_lua( lua_State *L )
+{
+    lpt_future_t *f = checkfuture( L );
+
+    pthread_mutex_lock( &f->mutex );
+    lua_pushboolean( L, f->done );
+    pthread_mutex_unlock( &f->mutex );
+
+    return 1;
+}
+
+
+static int id_lua( lua_State *L )
+{
+    lpt_future_t *f = checkfuture( L );
+
+    if( f->id ){
+        lua_pushinteger( L, (lua_Integer)f->id );
+    }
+    else {
+        lua_pushnil( L );
+    }
+
+    return 1;
+}
+
+
+static int future_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, FUTURE_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+void lpt_future_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__tostring", future_tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "then_", then_lua },
+        { "get", get_lua },
+        { "is_done", is_done_lua },
+        { "id", id_lua },
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &FUTURE_TYPE, mmethod, method );
+}
+
+
+void lpt_pool_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", close_lua },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "submit", submit_lua },
+        { "try_submit", try_submit_lua },
+        { "submit_batch", submit_batch_lua },
+        { "future", future_lua },
+        { "collect", collect_lua },
+        { "cancel", cancel_lua },
+        { "pending", pending_lua },
+        { "size", size_lua },
+        { "stats", stats_lua },
+        { "fd", fd_lua },
+        { "completed", completed_lua },
+        { "close", close_lua },
+        { NULL, NULL }
+    };
+
+    lpt_register_mt( L, POOL_MT, mmethod, method );
+    lpt_await_register( L, POOL_MT, "pool" );
+}
@@ -25,19 +25,8 @@
  *
  */
 
-#include <stdlib.h>
-#include <unistd.h>
-#include <signal.h>
-#include <string.h>
-#include <errno.h>
-#include <stdint.h>
-#include <sys/time.h>
-#include <pthread.h>
-#include <lua.h>
-#include <lauxlib.h>
-#include "lauxhlib.h"
-
-#define MODULE_MT           "pthread"
+#include "lpthread.h"
+
 #define DEFAULT_TIMEWAIT    1
 
 
@@ -46,76 +35,326 @@ typedef struct {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     lua_State *L;
+    // encoded arguments of the function
+    lpt_buf_t args;
     int running;
+    // set by the thread on termination
+    int done;
+    // the thread frees this object on termination
+    int detached;
+    // readable on termination
+    lpt_notify_t notify;
+    lpt_cancel_t cancel;
+    lpt_limit_t limit;
+    // the error object is left on the stack instead of the results
+    int failed;
+    // channel to send the error
+    lpt_shared_t *errors;
+    // stats in nanoseconds and bytes
+    uint64_t created;
+    _Atomic(uint64_t) started_at;
+    _Atomic(uint64_t) finished_at;
+    _Atomic(uint64_t) cpu_ns;
+    _Atomic(uint64_t) heap;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // stop the collector while running the function
+    int gcstop;
+    // created by pthread.spawn_detached
+    int limited;
+    // wait for the start of the thread in pthread.new
+    int handshake;
+    int started;
+    int resumed;
 } lpt_t;
 
 
+// maximum number of the threads of pthread.spawn_detached that run at once
+static pthread_mutex_t DETACHED_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+// initialized by luaopen_pthread to wait with LPT_CLOCK
+static pthread_cond_t DETACHED_COND;
+static pthread_once_t DETACHED_ONCE = PTHREAD_ONCE_INIT;
+static int DETACHED_MAX = 0;
+static int DETACHED_RUNNING = 0;
+
+
+static void detached_init( void )
+{
+    lpt_cond_init( &DETACHED_COND );
+}
+
+
+// wait for a slot until abstime, or forever if NULL. returns 0, ECANCELED or
+// ETIMEDOUT
+static int detached_acquire( const struct timespec *abstime )
+{
+    int rc = 0;
+
+    pthread_mutex_lock( &DETACHED_MUTEX );
+    while( DETACHED_MAX && DETACHED_RUNNING >= DETACHED_MAX ){
+        if( ( rc = lpt_cancel_wait( &DETACHED_COND, &DETACHED_MUTEX,
+                                    abstime ) ) == ECANCELED ||
+            ( rc == ETIMEDOUT && DETACHED_RUNNING >= DETACHED_MAX ) ){
+            pthread_mutex_unlock( &DETACHED_MUTEX );
+            return rc;
+        }
+    }
+    DETACHED_RUNNING++;
+    pthread_mutex_unlock( &DETACHED_MUTEX );
+
+    return 0;
+}
+
+
+static void detached_release( void )
+{
+    pthread_mutex_lock( &DETACHED_MUTEX );
+    DETACHED_RUNNING--;
+    pthread_cond_signal( &DETACHED_COND );
+    pthread_mutex_unlock( &DETACHED_MUTEX );
+}
+
+
+static void freeargs( lpt_buf_t *args )
+{
+    if( args->nref ){
+        lpt_discard( args->data, args->len );
+    }
+    lpt_buf_free( args );
+}
+
+
 static void lpt_dealloc( lpt_t *th )
 {
+    freeargs( &th->args );
     if( th->L ){
-        lua_close( th->L );
+        lpt_closestate( th->L );
         th->L = NULL;
         th->running = 0;
     }
 }
 
 
-static lpt_t *lpt_alloc( lua_State *L )
+static void lpt_free( lpt_t *th )
+{
+    lpt_dealloc( th );
+    if( th->errors ){
+        lpt_shared_release( th->errors );
+    }
+    lpt_notify_close( &th->notify );
+    pthread_mutex_destroy( &th->mutex );
+    pthread_cond_destroy( &th->cond );
+    // the slot is held until the state is closed
+    if( th->limited ){
+        detached_release();
+    }
+    free( th );
+}
+
+
+// the thread object is allocated apart from the userdata so that it can
+// outlive the userdata when the thread is detached by the gc
+static lpt_t *lpt_alloc( lua_State *L, const lpt_opts_t *opts )
 {
-    lpt_t *th = lua_newuserdata( L, sizeof( lpt_t ) );
+    lpt_t **ptr = lua_newuserdata( L, sizeof( lpt_t* ) );
+    lpt_t *th = NULL;
 
+    *ptr = NULL;
+    if( !( th = calloc( 1, sizeof( lpt_t ) ) ) ){
+        lua_pushstring( L, strerror( errno ) );
+        return NULL;
+    }
     // alloc
-    if( ( th->L = luaL_newstate() ) ){
-        luaL_openlibs( th->L );
-        pthread_mutex_init( &th->mutex, NULL );
-        pthread_cond_init( &th->cond, NULL );
-        th->running = 0;
-        return th;
+    else if( !( th->L = lpt_newstate( L, opts ) ) ){
+        free( th );
+        return NULL;
     }
-    lpt_dealloc( th );
+    pthread_mutex_init( &th->mutex, NULL );
+    lpt_cond_init( &th->cond );
+    lpt_notify_init( &th->notify );
+    lpt_cancel_init( &th->cancel );
+    *ptr = th;
+
+    return th;
+}
+
+
+static inline lpt_t *checkthread( lua_State *L )
+{
+    return *(lpt_t**)luaL_checkudata( L, 1, MODULE_MT );
+}
+
+
+int lpt_cond_init( pthread_cond_t *cond )
+{
+#if defined(__APPLE__)
+    // pthread_condattr_setclock is not available
+    return pthread_cond_init( cond, NULL );
+#else
+    pthread_condattr_t attr;
+    int rc = pthread_condattr_init( &attr );
+
+    if( rc ){
+        return rc;
+    }
+    else if( !( rc = pthread_condattr_setclock( &attr, LPT_CLOCK ) ) ){
+        rc = pthread_cond_init( cond, &attr );
+    }
+    pthread_condattr_destroy( &attr );
 
-    return NULL;
+    return rc;
+#endif
 }
 
 
-static inline struct timespec *addabstime( struct timespec *ts )
+uint64_t lpt_now_ns( void )
 {
-    struct timeval tv = { 0 };
+    struct timespec ts = { 0 };
 
-    gettimeofday( &tv, NULL );
-    ts->tv_sec += tv.tv_sec;
-    ts->tv_nsec += tv.tv_usec * 1000;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+uint64_t lpt_cputime_ns( pthread_t id )
+{
+#if defined(__APPLE__)
+    (void)id;
+    return 0;
+#else
+    struct timespec ts = { 0 };
+    clockid_t clock;
+
+    if( pthread_getcpuclockid( id, &clock ) ||
+        clock_gettime( clock, &ts ) ){
+        return 0;
+    }
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+struct timespec *lpt_addabstime( struct timespec *ts )
+{
+    struct timespec now = { 0 };
+
+    clock_gettime( LPT_CLOCK, &now );
+    ts->tv_sec += now.tv_sec;
+    ts->tv_nsec += now.tv_nsec;
+    if( ts->tv_nsec >= 1000000000 ){
+        ts->tv_sec += ts->tv_nsec / 1000000000;
+        ts->tv_nsec %= 1000000000;
+    }
 
     return ts;
 }
 
 
-static void on_exit( void *arg )
+struct timespec *lpt_timeout_abstime( lua_State *L, int idx,
+                                      struct timespec *ts )
 {
-    lpt_t *th = (lpt_t*)arg;
+    lua_Number timeout = 0;
 
-    pthread_mutex_unlock( &th->mutex );
+    if( lua_isnoneornil( L, idx ) ){
+        return NULL;
+    }
+    timeout = luaL_checknumber( L, idx );
+    luaL_argcheck( L, timeout >= 0, idx,
+                   "timeout must be greater than or equal to 0" );
+    // time_t may overflow
+    if( timeout > LPT_TIMEOUT_MAX ){
+        timeout = LPT_TIMEOUT_MAX;
+    }
+    ts->tv_sec = (time_t)timeout;
+    ts->tv_nsec = (long)( ( timeout - (time_t)timeout ) * 1000000000 );
+
+    return lpt_addabstime( ts );
+}
+
+
+// decode the arguments in the thread and call the function
+static int start_lua( lua_State *L )
+{
+    lpt_t *th = (lpt_t*)lua_touserdata( L, 2 );
+    int narg = 0;
+
+    lua_settop( L, 1 );
+    // cancelled before the start
+    if( lpt_cancel_requested() ){
+        return lpt_cancel_error( L );
+    }
+    else if( ( narg = lpt_decode( L, th->args.data, th->args.len ) ) < 0 ){
+        return luaL_error( L, "failed to decode arguments" );
+    }
+    lua_call( L, narg, LUA_MULTRET );
+
+    return lua_gettop( L );
 }
 
 
 static void *on_start( void *arg )
 {
     lpt_t *th = (lpt_t*)arg;
-    pthread_mutex_lock( &th->mutex );
-    th->running = 1;
-    pthread_cleanup_push( on_exit, th );
-    pthread_cond_signal( &th->cond );
-    pthread_cond_wait( &th->cond, &th->mutex );
+    int detached = 0;
+
+    if( th->handshake ){
+        pthread_mutex_lock( &th->mutex );
+        th->started = 1;
+        pthread_cond_signal( &th->cond );
+        while( !th->resumed ){
+            pthread_cond_wait( &th->cond, &th->mutex );
+        }
+        pthread_mutex_unlock( &th->mutex );
+    }
 
-    // run state in thread
-    switch( lua_pcall( th->L, lua_gettop( th->L ) - 1, 0, 0 ) ){
-        case LUA_ERRRUN:
-        case LUA_ERRMEM:
-        case LUA_ERRERR:
-            printf("got error: %s\n", lua_tostring( th->L, -1 ) );
-            break;
+    atomic_store_explicit( &th->started_at, lpt_now_ns(),
+                           memory_order_relaxed );
+    lpt_cancel_attach( th->L, &th->cancel );
+    lpt_cancel_start( &th->cancel, &th->limit );
+    // run state in thread and keep the results or the error on the stack
+    // until joined
+    lua_pushcfunction( th->L, lpt_traceback_lua );
+    lua_pushcfunction( th->L, start_lua );
+    lua_pushvalue( th->L, 1 );
+    lua_pushlightuserdata( th->L, th );
+    lua_remove( th->L, 1 );
+    if( th->gcstop ){
+        lua_gc( th->L, LUA_GCSTOP, 0 );
+    }
+    if( lua_pcall( th->L, 2, LUA_MULTRET, 1 ) ){
+        th->failed = 1;
+        if( th->errors ){
+            lpt_error_send( th->L, th->errors, 0 );
+        }
+    }
+    if( th->gcstop ){
+        lua_gc( th->L, LUA_GCRESTART, 0 );
+    }
+    // remove the message handler
+    lua_remove( th->L, 1 );
+    freeargs( &th->args );
+    atomic_store_explicit( &th->cpu_ns, lpt_cputime_ns( pthread_self() ),
+                           memory_order_relaxed );
+    atomic_store_explicit( &th->heap, lpt_heapsize( th->L ),
+                           memory_order_relaxed );
+    atomic_store_explicit( &th->finished_at, lpt_now_ns(),
+                           memory_order_relaxed );
+
+    pthread_mutex_lock( &th->mutex );
+    th->done = 1;
+    detached = th->detached;
+    pthread_cond_broadcast( &th->cond );
+    lpt_notify_signal( &th->notify );
+    pthread_mutex_unlock( &th->mutex );
+    // no one will join this thread
+    if( detached ){
+        if( th->failed && !th->errors ){
+            lpt_error_log( th->L );
+        }
+        lpt_free( th );
     }
-    pthread_cleanup_pop( 1 );
 
     pthread_exit( NULL );
 }
@@ -123,7 +362,7 @@ static void *on_start( void *arg )
 
 static int kill_lua( lua_State *L )
 {
-    lpt_t *th = (lpt_t*)luaL_checkudata( L, 1, MODULE_MT );
+    lpt_t *th = checkthread( L );
     lua_Integer signo = lauxh_checkinteger( L, 2 );
 
     if( pthread_kill( th->id, signo ) == 0 ){
@@ -139,26 +378,86 @@ static int kill_lua( lua_State *L )
 }
 
 
-static int join_lua( lua_State *L )
+// wait for the termination of the thread until abstime. returns ETIMEDOUT
+// if the thread is still running
+static int waitdone( lpt_t *th, const struct timespec *abstime )
+{
+    int rc = 0;
+
+    pthread_mutex_lock( &th->mutex );
+    while( !th->done && rc == 0 ){
+        rc = pthread_cond_timedwait( &th->cond, &th->mutex, abstime );
+    }
+    rc = th->done ? 0 : rc;
+    pthread_mutex_unlock( &th->mutex );
+
+    return rc;
+}
+
+
+static int isdone( lpt_t *th )
 {
-    lpt_t *th = (lpt_t*)luaL_checkudata( L, 1, MODULE_MT );
+    int done = 0;
 
     pthread_mutex_lock( &th->mutex );
+    done = th->done;
+    pthread_mutex_unlock( &th->mutex );
+
+    return done;
+}
+
+
+static int dojoin( lua_State *L, lpt_t *th )
+{
+    lua_settop( L, 1 );
     if( th->running )
     {
+        lpt_buf_t buf = { 0 };
+        const char *err = NULL;
+        const char *tname = NULL;
         int rc = 0;
 
-        pthread_cond_signal( &th->cond );
-        pthread_mutex_unlock( &th->mutex );
         if( ( rc = pthread_join( th->id, NULL ) ) ){
             lua_pushboolean( L, 0 );
             lua_pushstring( L, strerror( rc ) );
             return 2;
         }
+        th->running = 0;
+        // cancelled or exceeded the limits
+        if( th->cancel.reason ){
+            lpt_dealloc( th );
+            lua_pushboolean( L, 0 );
+            lua_pushstring( L, th->cancel.reason );
+            return 2;
+        }
+        // results of the function are encoded at once, then the state is
+        // closed before decoding them
+        err = lpt_encode( th->L, 1, &buf );
+        th->bytes_out = buf.len;
+        tname = luaL_typename( th->L, 1 );
         lpt_dealloc( th );
-    }
-    else {
-        pthread_mutex_unlock( &th->mutex );
+        if( err ){
+            lpt_buf_free( &buf );
+            lua_pushboolean( L, 0 );
+            if( th->failed ){
+                lua_pushfstring( L, "the error object of type %s cannot be "
+                                 "transferred", tname );
+            }
+            else {
+                lua_pushstring( L, err );
+            }
+            return 2;
+        }
+        lua_pushboolean( L, !th->failed );
+        rc = lpt_decode( L, buf.data, buf.len );
+        freeargs( &buf );
+        if( rc < 0 ){
+            lua_settop( L, 1 );
+            lua_pushboolean( L, 0 );
+            lua_pushstring( L, "failed to decode results" );
+            return 2;
+        }
+        return 1 + rc;
     }
 
     lua_pushboolean( L, 1 );
@@ -167,142 +466,363 @@ static int join_lua( lua_State *L )
 }
 
 
-static int gc_lua( lua_State *L )
+static int join_lua( lua_State *L )
 {
-    lpt_t *th = (lpt_t*)luaL_checkudata( L, 1, MODULE_MT );
+    lpt_t *th = checkthread( L );
+    struct timespec ts = { 0 };
+    struct timespec *abstime = lpt_timeout_abstime( L, 2, &ts );
+
+    if( abstime )
+    {
+        int rc = 0;
+
+        if( th->running && ( rc = waitdone( th, abstime ) ) ){
+            lua_pushboolean( L, 0 );
+            // still running
+            if( rc == ETIMEDOUT ){
+                return 1;
+            }
+            lua_pushstring( L, strerror( rc ) );
+            return 2;
+        }
+    }
+
+    return dojoin( L, th );
+}
+
+
+static int tryjoin_lua( lua_State *L )
+{
+    lpt_t *th = checkthread( L );
+
+    if( th->running && !isdone( th ) ){
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+
+    return dojoin( L, th );
+}
+
+
+static int is_running_lua( lua_State *L )
+{
+    lpt_t *th = checkthread( L );
+
+    lua_pushboolean( L, th->running && !isdone( th ) );
+
+    return 1;
+}
+
+
+static int cancel_lua( lua_State *L )
+{
+    lpt_t *th = checkthread( L );
+
+    lua_pushboolean( L, th->running && !isdone( th ) &&
+                        lpt_cancel_request( &th->cancel, 1 ) );
+
+    return 1;
+}
+
+
+static int stats_lua( lua_State *L )
+{
+    lpt_t *th = checkthread( L );
+    uint64_t started = lpt_stat_get( &th->started_at );
+    uint64_t finished = lpt_stat_get( &th->finished_at );
+    uint64_t cpu = lpt_stat_get( &th->cpu_ns );
+    uint64_t heap = lpt_stat_get( &th->heap );
+
+    // running
+    if( !finished && th->running ){
+        cpu = lpt_cputime_ns( th->id );
+        heap = lpt_heapsize( th->L );
+    }
+    lua_createtable( L, 0, 7 );
+    lauxh_pushbool2tbl( L, "running", th->running && !finished );
+    lauxh_pushint2tbl( L, "start_latency_ns",
+                       started ? (lua_Integer)( started - th->created ) : 0 );
+    lauxh_pushint2tbl( L, "run_ns",
+                       !started ? 0 :
+                       (lua_Integer)( ( finished ? finished : lpt_now_ns() ) -
+                                      started ) );
+    lauxh_pushint2tbl( L, "cpu_ns", (lua_Integer)cpu );
+    lauxh_pushint2tbl( L, "heap", (lua_Integer)heap );
+    lauxh_pushint2tbl( L, "bytes_in", (lua_Integer)th->bytes_in );
+    lauxh_pushint2tbl( L, "bytes_out", (lua_Integer)th->bytes_out );
+
+    return 1;
+}
+
+
+static int fd_lua( lua_State *L )
+{
+    lpt_t *th = checkthread( L );
+    int rc = 0;
 
     pthread_mutex_lock( &th->mutex );
-    if( th->running ){
-        pthread_cond_signal( &th->cond );
-        pthread_mutex_unlock( &th->mutex );
-        pthread_join( th->id, NULL );
+    if( !( rc = lpt_notify_open( &th->notify ) ) &&
+        ( th->done || !th->running ) ){
+        lpt_notify_signal( &th->notify );
     }
-    // already joined
-    else {
-        pthread_mutex_unlock( &th->mutex );
+    pthread_mutex_unlock( &th->mutex );
+
+    if( rc ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( rc ) );
+        return 2;
     }
+    lua_pushinteger( L, th->notify.rfd );
 
-    lpt_dealloc( th );
+    return 1;
+}
+
+
+static int gc_lua( lua_State *L )
+{
+    lpt_t *th = *(lpt_t**)luaL_checkudata( L, 1, MODULE_MT );
+
+    // failed to allocate
+    if( !th ){
+        return 0;
+    }
+    else if( th->running )
+    {
+        pthread_t id = th->id;
+
+        pthread_mutex_lock( &th->mutex );
+        // detach the thread instead of blocking the gc. the thread frees
+        // the object on termination
+        if( !th->done ){
+            th->detached = 1;
+            pthread_mutex_unlock( &th->mutex );
+            pthread_detach( id );
+            return 0;
+        }
+        pthread_mutex_unlock( &th->mutex );
+        pthread_join( id, NULL );
+    }
+    lpt_free( th );
 
     return 0;
 }
 
 
-static int tostring_lua( lua_State *L )
+static int now_ns_lua( lua_State *L )
 {
-    lua_pushfstring( L, MODULE_MT ": %p", lua_touserdata( L, 1 ) );
+    lua_pushinteger( L, (lua_Integer)lpt_now_ns() );
+
     return 1;
 }
 
 
-static int dumpcb( lua_State *L, const void* chunk, size_t bytes, void* buf )
+static int tostring_lua( lua_State *L )
 {
-    (void)L;
-    luaL_addlstring( (luaL_Buffer*)buf, (const char*)chunk, bytes );
-    return 0;
+    lua_pushfstring( L, MODULE_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
 }
 
 
-static int new_lua( lua_State *L )
+static int spawn( lua_State *L, int detached )
 {
-    int narg = lua_gettop( L );
-    size_t len = 0;
-    const char *fn = NULL;
+    lpt_buf_t args = { 0 };
+    const char *err = NULL;
+    lpt_chunk_t *chunk = NULL;
+    lpt_shared_t *sink = NULL;
     lpt_t *th = NULL;
-    luaL_Buffer buf;
+    lpt_opts_t opts;
+    lpt_attr_t attr;
+    lpt_limit_t limit;
+    pthread_attr_t pattr;
     struct timespec ts = {
         .tv_sec = DEFAULT_TIMEWAIT,
         .tv_nsec = 0
     };
+    struct timespec slotts;
+    struct timespec *slotabs = NULL;
     int rc = 0;
 
-    // check function argument
-    switch( lua_type( L, 1 ) )
-    {
-        case LUA_TFUNCTION:
-            lua_pushvalue( L, 1 );
-            luaL_buffinit( L,&buf );
-            if( lua_dump( L, dumpcb, &buf ) != 0 ){
-                return luaL_error( L, "unable to dump given function" );
-            }
-            luaL_pushresult( &buf );
-            lua_replace( L, 1 );
-            lua_pop( L, 1 );
-        case LUA_TSTRING:
-            break;
-
-        default:
-            return luaL_error( L, "fn must be function or function string");
+    // check all options before taking the references since they raise the
+    // errors
+    lpt_opts_parse( L, lua_type( L, 1 ) == LUA_TTABLE ? 1 : 0, &opts );
+    lpt_attr_parse( L, opts.idx, &attr );
+    lpt_limit_parse( L, opts.idx, &limit );
+    sink = lpt_error_sink( L, opts.idx );
+    if( detached && opts.idx ){
+        lua_getfield( L, opts.idx, "timeout" );
+        slotabs = lpt_timeout_abstime( L, lua_gettop( L ), &slotts );
+        lua_pop( L, 1 );
     }
 
-    // get function string
-    fn = lua_tolstring( L, 1, &len );
+    // get dumped function or function string
+    if( opts.idx ){
+        lua_getfield( L, 1, "fn" );
+        chunk = lpt_checkfn( L, -1 );
+        lua_pop( L, 1 );
+    }
+    else {
+        chunk = lpt_checkfn( L, 1 );
+    }
 
+    // encode passed arguments that are decoded by the thread
+    if( ( err = lpt_encode( L, 2, &args ) ) ){
+        lpt_shared_release( (lpt_shared_t*)chunk );
+        return luaL_error( L, "%s", err );
+    }
+    // wait for a slot before creating the state and the thread
+    else if( detached && ( rc = detached_acquire( slotabs ) ) ){
+        freeargs( &args );
+        lpt_shared_release( (lpt_shared_t*)chunk );
+        if( rc == ECANCELED ){
+            return lpt_cancel_error( L );
+        }
+        lua_pushnil( L );
+        lua_pushliteral( L, "too many detached threads" );
+        return 2;
+    }
     // allocate
-    if( !( th = lpt_alloc( L ) ) ){
+    else if( !( th = lpt_alloc( L, &opts ) ) ){
+        if( detached ){
+            detached_release();
+        }
+        freeargs( &args );
+        lpt_shared_release( (lpt_shared_t*)chunk );
         lua_pushnil( L );
-        lua_pushstring( L, strerror( rc ) );
+        lua_insert( L, -2 );
         return 2;
     }
+    // the slot is released by lpt_free
+    th->limited = detached;
     // compile error
-    else if( ( rc = luaL_loadbuffer( th->L, fn, len, NULL ) ) ){
+    if( ( rc = luaL_loadbuffer( th->L, chunk->data, chunk->len,
+                                NULL ) ) ){
+        freeargs( &args );
+        lpt_shared_release( (lpt_shared_t*)chunk );
         lua_pushnil( L );
         lua_pushstring( L, lua_tostring( th->L, -1 ) );
-        lpt_dealloc( th );
+        lpt_free( th );
         return 2;
     }
+    lpt_shared_release( (lpt_shared_t*)chunk );
+    th->args = args;
+    th->bytes_in = args.len;
+    th->limit = limit;
+    if( ( th->errors = sink ) ){
+        lpt_shared_retain( sink );
+    }
+    th->gcstop = opts.gc.stop;
 
-    // copying passed arguments to thread state
-    for( int i = 2; i <= narg; i++ ){
-        lauxh_xcopy( L, th->L, i, 1 );
+    // no one waits for the detached thread
+    if( detached ){
+        th->detached = 1;
+    }
+    else if( opts.idx ){
+        lua_getfield( L, opts.idx, "handshake" );
+        th->handshake = lua_toboolean( L, -1 );
+        lua_pop( L, 1 );
     }
 
-    pthread_mutex_lock( &th->mutex );
+    // the thread runs the function of the id 1
+    atomic_store( &th->cancel.current, 1 );
+    th->created = lpt_now_ns();
+
     // create thread
-    if( ( rc = pthread_create( &th->id, NULL, on_start, (void*)th ) ) ){
-        pthread_mutex_unlock( &th->mutex );
-        lpt_dealloc( th );
+    if( ( rc = lpt_attr_init( &pattr, &attr, -1 ) ) ){
+        lpt_free( th );
         lua_pushnil( L );
         lua_pushstring( L, strerror( rc ) );
         return 2;
     }
-    // wait suspend
-    else if( ( rc = pthread_cond_timedwait( &th->cond, &th->mutex,
-                                            addabstime( &ts ) ) ) ){
-        pthread_mutex_unlock( &th->mutex );
-        pthread_cancel( th->id );
-        lpt_dealloc( th );
+    else if( detached && ( rc = pthread_attr_setdetachstate(
+                                    &pattr, PTHREAD_CREATE_DETACHED ) ) ){
+        pthread_attr_destroy( &pattr );
+        lpt_free( th );
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( rc ) );
+        return 2;
+    }
+    rc = pthread_create( &th->id, &pattr, on_start, (void*)th );
+    pthread_attr_destroy( &pattr );
+    if( rc ){
+        lpt_free( th );
         lua_pushnil( L );
         lua_pushstring( L, strerror( rc ) );
         return 2;
     }
+    // the thread frees the object on termination and the userdata is left
+    // without the metatable
+    else if( detached ){
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+    th->running = 1;
 
-    lauxh_setmetatable( L, MODULE_MT );
+    // the thread runs on its own unless handshake is requested
+    if( th->handshake )
+    {
+        pthread_mutex_lock( &th->mutex );
+        lpt_addabstime( &ts );
+        // wait suspend
+        while( !th->started ){
+            if( ( rc = pthread_cond_timedwait( &th->cond, &th->mutex,
+                                               &ts ) ) ){
+                // let the thread exit without calling the function
+                lpt_cancel_request( &th->cancel, 1 );
+                th->resumed = 1;
+                pthread_mutex_unlock( &th->mutex );
+                pthread_join( th->id, NULL );
+                lpt_free( th );
+                lua_pushnil( L );
+                lua_pushstring( L, strerror( rc ) );
+                return 2;
+            }
+        }
+        // resume thread
+        th->resumed = 1;
+        pthread_cond_signal( &th->cond );
+        pthread_mutex_unlock( &th->mutex );
+    }
 
-    // resume thread
-    pthread_cond_signal( &th->cond );
-    pthread_mutex_unlock( &th->mutex );
+    lauxh_setmetatable( L, MODULE_MT );
 
     return 1;
 }
 
 
-LUALIB_API int luaopen_pthread( lua_State *L )
+static int new_lua( lua_State *L )
+{
+    return spawn( L, 0 );
+}
+
+
+static int spawn_detached_lua( lua_State *L )
+{
+    return spawn( L, 1 );
+}
+
+
+static int setmaxdetached_lua( lua_State *L )
+{
+    lua_Integer n = luaL_optinteger( L, 1, 0 );
+
+    luaL_argcheck( L, n >= 0 && n <= INT_MAX, 1,
+                   "number of threads must be greater than or equal to 0" );
+    pthread_mutex_lock( &DETACHED_MUTEX );
+    DETACHED_MAX = (int)n;
+    pthread_cond_broadcast( &DETACHED_COND );
+    pthread_mutex_unlock( &DETACHED_MUTEX );
+
+    return 0;
+}
+
+
+void lpt_register_mt( lua_State *L, const char *tname, struct luaL_Reg *mmethod,
+                      struct luaL_Reg *method )
 {
-    struct luaL_Reg mmethod[] = {
-        { "__gc", gc_lua },
-        { "__tostring", tostring_lua },
-        { NULL, NULL }
-    };
-    struct luaL_Reg method[] = {
-        { "join", join_lua },
-        { "kill", kill_lua },
-        { NULL, NULL }
-    };
     struct luaL_Reg *ptr = mmethod;
 
     // register metatable
-    luaL_newmetatable( L, MODULE_MT );
+    luaL_newmetatable( L, tname );
     // add metamethods
     while( ptr->name ){
         lauxh_pushfn2tbl( L, ptr->name, ptr->func );
@@ -319,10 +839,61 @@ LUALIB_API int luaopen_pthread( lua_State *L )
     }
     lua_rawset( L, -3 );
     lua_pop( L, 1 );
+}
+
+
+LUALIB_API int luaopen_pthread( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", gc_lua },
+        { "__tostring", tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "join", join_lua },
+        { "tryjoin", tryjoin_lua },
+        { "is_running", is_running_lua },
+        { "fd", fd_lua },
+        { "cancel", cancel_lua },
+        { "stats", stats_lua },
+        { "kill", kill_lua },
+        { NULL, NULL }
+    };
+
+    pthread_once( &DETACHED_ONCE, detached_init );
+    lpt_register_mt( L, MODULE_MT, mmethod, method );
+    lpt_await_register( L, MODULE_MT, "thread" );
+    lpt_chunk_init( L );
+    lpt_transfer_init( L );
+    lpt_pool_init( L );
+    lpt_future_init( L );
+    lpt_channel_init( L );
+    lpt_buffer_init( L );
+    lpt_frozen_init( L );
+    lpt_atomic_init( L );
+    lpt_mutex_init( L );
+    lpt_barrier_init( L );
 
     // add new function
     lua_newtable( L );
     lauxh_pushfn2tbl( L, "new", new_lua );
+    lauxh_pushfn2tbl( L, "spawn_detached", spawn_detached_lua );
+    lauxh_pushfn2tbl( L, "setmaxdetached", setmaxdetached_lua );
+    lauxh_pushfn2tbl( L, "pool", lpt_pool_new );
+    lauxh_pushfn2tbl( L, "submit", lpt_pool_submit_lua );
+    lauxh_pushfn2tbl( L, "map", lpt_pool_map_lua );
+    lauxh_pushfn2tbl( L, "reduce", lpt_pool_reduce_lua );
+    lauxh_pushfn2tbl( L, "all", lpt_future_all_lua );
+    lauxh_pushfn2tbl( L, "any", lpt_future_any_lua );
+    lauxh_pushfn2tbl( L, "channel", lpt_channel_new );
+    lauxh_pushfn2tbl( L, "buffer", lpt_buffer_new );
+    lauxh_pushfn2tbl( L, "freeze", lpt_frozen_new );
+    lauxh_pushfn2tbl( L, "pairs", lpt_frozen_pairs_lua );
+    lauxh_pushfn2tbl( L, "atomic", lpt_atomic_new );
+    lauxh_pushfn2tbl( L, "mutex", lpt_mutex_new );
+    lauxh_pushfn2tbl( L, "barrier", lpt_barrier_new );
+    lauxh_pushfn2tbl( L, "setlibs", lpt_setlibs_lua );
+    lauxh_pushfn2tbl( L, "now_ns", now_ns_lua );
 
     return 1;
 }
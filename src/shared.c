@@ -0,0 +1,121 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  shared.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  reference counted objects that can be referred from multiple states.
+ *  each state holds a userdata that contains the pointer of the object.
+ */
+
+#include "lpthread.h"
+
+// address of this variable is used as a key of the metatable field
+static const char SHARED_KEY = 0;
+
+
+void lpt_shared_retain( lpt_shared_t *obj )
+{
+    atomic_fetch_add_explicit( &obj->refcnt, 1, memory_order_relaxed );
+}
+
+
+void lpt_shared_release( lpt_shared_t *obj )
+{
+    if( atomic_fetch_sub_explicit( &obj->refcnt, 1,
+                                   memory_order_acq_rel ) == 1 ){
+        obj->type->free( obj );
+    }
+}
+
+
+void lpt_shared_register_mt( lua_State *L, const lpt_shared_type_t *type,
+                             struct luaL_Reg *mmethod, struct luaL_Reg *method )
+{
+    lpt_register_mt( L, type->tname, mmethod, method );
+    // mark as shared object
+    luaL_getmetatable( L, type->tname );
+    lua_pushlightuserdata( L, (void*)&SHARED_KEY );
+    lua_pushlightuserdata( L, (void*)type );
+    lua_rawset( L, -3 );
+    lua_pop( L, 1 );
+}
+
+
+void lpt_shared_push( lua_State *L, lpt_shared_t *obj )
+{
+    lpt_shared_t **ref = lua_newuserdata( L, sizeof( lpt_shared_t* ) );
+
+    *ref = obj;
+    lpt_shared_retain( obj );
+    // register metatable if this state has not loaded it yet
+    luaL_getmetatable( L, obj->type->tname );
+    if( lua_isnil( L, -1 ) ){
+        lua_pop( L, 1 );
+        obj->type->init( L );
+        luaL_getmetatable( L, obj->type->tname );
+    }
+    lua_setmetatable( L, -2 );
+}
+
+
+lpt_shared_t *lpt_shared_test( lua_State *L, int idx )
+{
+    lpt_shared_t **ref = NULL;
+
+    if( lua_type( L, idx ) == LUA_TUSERDATA && lua_getmetatable( L, idx ) )
+    {
+        lua_pushlightuserdata( L, (void*)&SHARED_KEY );
+        lua_rawget( L, -2 );
+        if( lua_islightuserdata( L, -1 ) ){
+            ref = (lpt_shared_t**)lua_touserdata( L, idx );
+        }
+        lua_pop( L, 2 );
+    }
+
+    return ref ? *ref : NULL;
+}
+
+
+lpt_shared_t *lpt_shared_check( lua_State *L, int idx, const char *tname )
+{
+    lpt_shared_t **ref = (lpt_shared_t**)luaL_checkudata( L, idx, tname );
+
+    if( !*ref ){
+        luaL_error( L, "attempt to use a released %s object", tname );
+    }
+
+    return *ref;
+}
+
+
+int lpt_shared_gc( lua_State *L )
+{
+    lpt_shared_t **ref = (lpt_shared_t**)lua_touserdata( L, 1 );
+
+    if( *ref ){
+        lpt_shared_release( *ref );
+        *ref = NULL;
+    }
+
+    return 0;
+}
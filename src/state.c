@@ -0,0 +1,412 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  state.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  creation of the states that run on the threads.
+ */
+
+#include "lpthread.h"
+
+
+typedef struct {
+    const char *name;
+    const char *modname;
+    lua_CFunction fn;
+} lib_t;
+
+static const lib_t LIBS[] = {
+#if LUA_VERSION_NUM >= 502
+    { "base", "_G", luaopen_base },
+    { "coroutine", LUA_COLIBNAME, luaopen_coroutine },
+#else
+    // coroutine library is opened by the base library
+    { "base", "", luaopen_base },
+#endif
+    { "package", LUA_LOADLIBNAME, luaopen_package },
+    { "table", LUA_TABLIBNAME, luaopen_table },
+    { "io", LUA_IOLIBNAME, luaopen_io },
+    { "os", LUA_OSLIBNAME, luaopen_os },
+    { "string", LUA_STRLIBNAME, luaopen_string },
+    { "math", LUA_MATHLIBNAME, luaopen_math },
+    { "debug", LUA_DBLIBNAME, luaopen_debug },
+#if LUA_VERSION_NUM == 502 || defined(LUA_COMPAT_BITLIB)
+    { "bit32", LUA_BITLIBNAME, luaopen_bit32 },
+#endif
+#if LUA_VERSION_NUM >= 503
+    { "utf8", LUA_UTF8LIBNAME, luaopen_utf8 },
+#endif
+    { NULL, NULL, NULL }
+};
+
+// all libraries are opened by luaL_openlibs, so that the libraries that are
+// not listed above such as bit, ffi and jit of luajit are also opened
+#define LIBS_ALL    UINT_MAX
+
+// default libraries for the states. this value is shared by all states.
+static atomic_uint DEFAULT_LIBS = LIBS_ALL;
+
+
+static unsigned int checklibs( lua_State *L, int idx )
+{
+    unsigned int libs = 0;
+    int i = 1;
+
+    luaL_checktype( L, idx, LUA_TTABLE );
+    lua_rawgeti( L, idx, i );
+    while( !lua_isnil( L, -1 ) )
+    {
+        const char *name = lua_tostring( L, -1 );
+        int j = 0;
+
+        for(; LIBS[j].name; j++ )
+        {
+            if( name && strcmp( name, LIBS[j].name ) == 0 ){
+                libs |= 1U << j;
+                break;
+            }
+        }
+        if( !LIBS[j].name ){
+            luaL_error( L, "unknown library name: %s",
+                        name ? name : luaL_typename( L, -1 ) );
+        }
+        lua_pop( L, 1 );
+        lua_rawgeti( L, idx, ++i );
+    }
+    lua_pop( L, 1 );
+
+    return libs;
+}
+
+
+static int checkgcparam( lua_State *L, int idx, const char *name )
+{
+    lua_Integer v = 0;
+
+    lua_getfield( L, idx, name );
+    if( !lua_isnil( L, -1 ) ){
+        v = lauxh_checkinteger( L, -1 );
+        if( v <= 0 || v > INT_MAX ){
+            luaL_error( L, "gc.%s must be greater than 0", name );
+        }
+    }
+    lua_pop( L, 1 );
+
+    return (int)v;
+}
+
+
+static void checkgc( lua_State *L, int idx, lpt_gc_t *gc )
+{
+    luaL_checktype( L, idx, LUA_TTABLE );
+
+    lua_getfield( L, idx, "mode" );
+    if( !lua_isnil( L, -1 ) )
+    {
+        static const char *const names[] = {
+            "incremental", "generational", NULL
+        };
+        static const int modes[] = {
+            LPT_GC_INCREMENTAL, LPT_GC_GENERATIONAL
+        };
+
+        gc->mode = modes[luaL_checkoption( L, -1, NULL, names )];
+#if !defined(LUA_GCGEN)
+        if( gc->mode == LPT_GC_GENERATIONAL ){
+            luaL_error( L, "generational mode is not supported by %s",
+                        LUA_VERSION );
+        }
+#endif
+    }
+    lua_pop( L, 1 );
+
+    gc->pause = checkgcparam( L, idx, "pause" );
+    gc->stepmul = checkgcparam( L, idx, "stepmul" );
+    if( gc->mode == LPT_GC_GENERATIONAL && ( gc->pause || gc->stepmul ) ){
+        luaL_error( L, "gc.pause and gc.stepmul require the incremental "
+                    "mode" );
+    }
+
+    lua_getfield( L, idx, "stop" );
+    gc->stop = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+}
+
+
+void lpt_opts_parse( lua_State *L, int idx, lpt_opts_t *opts )
+{
+    opts->idx = idx;
+    opts->libs = atomic_load( &DEFAULT_LIBS );
+    opts->arena = 1;
+    opts->memlimit = 0;
+    memset( &opts->gc, 0, sizeof( lpt_gc_t ) );
+
+    if( idx )
+    {
+        luaL_checktype( L, idx, LUA_TTABLE );
+        lua_getfield( L, idx, "arena" );
+        if( !lua_isnil( L, -1 ) ){
+            luaL_checktype( L, -1, LUA_TBOOLEAN );
+            opts->arena = lua_toboolean( L, -1 );
+        }
+        lua_pop( L, 1 );
+
+        lua_getfield( L, idx, "memlimit" );
+        if( !lua_isnil( L, -1 ) ){
+            lua_Integer limit = lauxh_checkinteger( L, -1 );
+
+            if( limit < 0 ){
+                luaL_error( L, "memlimit must be greater than or equal to 0" );
+            }
+            opts->memlimit = (size_t)limit;
+        }
+        lua_pop( L, 1 );
+
+        lua_getfield( L, idx, "libs" );
+        if( !lua_isnil( L, -1 ) ){
+            opts->libs = checklibs( L, lua_gettop( L ) );
+        }
+        lua_pop( L, 1 );
+
+        lua_getfield( L, idx, "preload" );
+        if( !lua_isnil( L, -1 ) ){
+            luaL_checktype( L, -1, LUA_TTABLE );
+        }
+        lua_pop( L, 1 );
+
+        lua_getfield( L, idx, "gc" );
+        if( !lua_isnil( L, -1 ) ){
+            checkgc( L, lua_gettop( L ), &opts->gc );
+        }
+        lua_pop( L, 1 );
+    }
+}
+
+
+static void setgc( lua_State *L, const lpt_gc_t *gc )
+{
+#if LUA_VERSION_NUM >= 504
+    if( gc->mode == LPT_GC_GENERATIONAL ){
+        lua_gc( L, LUA_GCGEN, 0, 0 );
+    }
+    // LUA_GCINC also switches back from the generational mode
+    else if( gc->mode == LPT_GC_INCREMENTAL || gc->pause || gc->stepmul ){
+        lua_gc( L, LUA_GCINC, gc->pause, gc->stepmul, 0 );
+    }
+#else
+# if defined(LUA_GCGEN)
+    // lua 5.2
+    if( gc->mode == LPT_GC_GENERATIONAL ){
+        lua_gc( L, LUA_GCGEN, 0 );
+        return;
+    }
+    else if( gc->mode == LPT_GC_INCREMENTAL ){
+        lua_gc( L, LUA_GCINC, 0 );
+    }
+# endif
+    if( gc->pause ){
+        lua_gc( L, LUA_GCSETPAUSE, gc->pause );
+    }
+    if( gc->stepmul ){
+        lua_gc( L, LUA_GCSETSTEPMUL, gc->stepmul );
+    }
+#endif
+}
+
+
+static int openlibs_lua( lua_State *L )
+{
+    unsigned int libs = *(unsigned int*)lua_touserdata( L, 1 );
+    int i = 0;
+
+    lua_settop( L, 0 );
+
+    if( libs == LIBS_ALL ){
+        luaL_openlibs( L );
+        return 0;
+    }
+    for(; LIBS[i].name; i++ )
+    {
+        if( libs & ( 1U << i ) ){
+#if LUA_VERSION_NUM >= 502
+            luaL_requiref( L, LIBS[i].modname, LIBS[i].fn, 1 );
+            lua_pop( L, 1 );
+#else
+            lua_pushcfunction( L, LIBS[i].fn );
+            lua_pushstring( L, LIBS[i].modname );
+            lua_call( L, 1, 0 );
+#endif
+        }
+    }
+
+    return 0;
+}
+
+
+// open libraries in protected mode since the memory may be limited
+static int openlibs( lua_State *L, unsigned int libs )
+{
+#if LUA_VERSION_NUM >= 502
+    lua_pushcfunction( L, openlibs_lua );
+    lua_pushlightuserdata( L, &libs );
+    return lua_pcall( L, 1, 0, 0 );
+#else
+    return lua_cpcall( L, openlibs_lua, &libs );
+#endif
+}
+
+
+// require the modules listed in the preload option
+static int preload( lua_State *L, lua_State *nL, int idx )
+{
+    int i = 1;
+
+    lua_getfield( L, idx, "preload" );
+    if( lua_isnil( L, -1 ) ){
+        lua_pop( L, 1 );
+        return 0;
+    }
+
+    lua_rawgeti( L, -1, i );
+    while( !lua_isnil( L, -1 ) )
+    {
+        if( !lua_isstring( L, -1 ) ){
+            lua_pop( L, 2 );
+            lua_pushstring( L, "preload module name must be string" );
+            return -1;
+        }
+        lua_getglobal( nL, "require" );
+        if( !lua_isfunction( nL, -1 ) ){
+            lua_pop( nL, 1 );
+            lua_pop( L, 2 );
+            lua_pushstring( L, "preload requires the package library" );
+            return -1;
+        }
+        lua_pushstring( nL, lua_tostring( L, -1 ) );
+        if( lua_pcall( nL, 1, 0, 0 ) ){
+            lua_pop( L, 2 );
+            lua_pushstring( L, lua_tostring( nL, -1 ) );
+            lua_pop( nL, 1 );
+            return -1;
+        }
+        lua_pop( L, 1 );
+        lua_rawgeti( L, -1, ++i );
+    }
+    lua_pop( L, 2 );
+
+    return 0;
+}
+
+
+static int panic( lua_State *L )
+{
+    fprintf( stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+             lua_tostring( L, -1 ) );
+    return 0;
+}
+
+
+// returns the arena of the state or NULL if created by luaL_newstate
+static inline lpt_arena_t *getarena( lua_State *L )
+{
+    void *a = NULL;
+
+    if( lua_getallocf( L, &a ) != lpt_arena_alloc ){
+        return NULL;
+    }
+
+    return (lpt_arena_t*)a;
+}
+
+
+lua_State *lpt_newstate( lua_State *L, const lpt_opts_t *opts )
+{
+    lpt_arena_t *a = NULL;
+    lua_State *nL = NULL;
+
+    // use the default allocator of the lua since lua_newstate is not
+    // available on some platforms such as the luajit without gc64
+    if( !opts->arena && !opts->memlimit ){
+        if( !( nL = luaL_newstate() ) ){
+            lua_pushstring( L, strerror( ENOMEM ) );
+            return NULL;
+        }
+    }
+    else if( !( a = lpt_arena_new( opts->arena, opts->memlimit ) ) ){
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return NULL;
+    }
+    else if( !( nL = lua_newstate( lpt_arena_alloc, a ) ) ){
+        lpt_arena_free( a );
+        lua_pushstring( L, strerror( ENOMEM ) );
+        return NULL;
+    }
+    lua_atpanic( nL, panic );
+    setgc( nL, &opts->gc );
+
+    if( openlibs( nL, opts->libs ) ){
+        lua_pushstring( L, lua_tostring( nL, -1 ) );
+        lpt_closestate( nL );
+        return NULL;
+    }
+    else if( opts->idx && preload( L, nL, opts->idx ) ){
+        lpt_closestate( nL );
+        return NULL;
+    }
+
+    return nL;
+}
+
+
+void lpt_closestate( lua_State *L )
+{
+    lpt_arena_t *a = getarena( L );
+
+    lua_close( L );
+    if( a ){
+        lpt_arena_free( a );
+    }
+}
+
+
+size_t lpt_heapsize( lua_State *L )
+{
+    lpt_arena_t *a = getarena( L );
+
+    // the memory of the default allocator cannot be read by the other
+    // threads
+    return a ? lpt_arena_used( a ) : 0;
+}
+
+
+int lpt_setlibs_lua( lua_State *L )
+{
+    if( lua_isnoneornil( L, 1 ) ){
+        atomic_store( &DEFAULT_LIBS, LIBS_ALL );
+    }
+    else {
+        atomic_store( &DEFAULT_LIBS, checklibs( L, 1 ) );
+    }
+
+    return 0;
+}
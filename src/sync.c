@@ -0,0 +1,356 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  sync.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  mutexes and barriers that are shared by the threads. the mutex spins for
+ *  a while and then sleeps on the futex on linux, so that the uncontended
+ *  lock and unlock never enter the kernel.
+ */
+
+#include "lpthread.h"
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <sched.h>
+
+#define MUTEX_NSPIN 100
+
+enum {
+    UNLOCKED = 0,
+    LOCKED,
+    // locked and some threads may be sleeping
+    CONTENDED
+};
+
+
+typedef struct {
+    lpt_shared_t shared;
+    atomic_int state;
+} lpt_mutex_t;
+
+
+typedef struct {
+    lpt_shared_t shared;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int nparty;
+    int nwait;
+    // incremented each time all parties arrived
+    unsigned int gen;
+} lpt_barrier_t;
+
+
+void lpt_futex_wait( atomic_int *addr, int val )
+{
+#if defined(__linux__)
+    syscall( SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+#else
+    (void)addr;
+    (void)val;
+    sched_yield();
+#endif
+}
+
+
+void lpt_futex_wake( atomic_int *addr, int n )
+{
+#if defined(__linux__)
+    syscall( SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+#else
+    (void)addr;
+    (void)n;
+#endif
+}
+
+
+/* mutex */
+
+static void mutex_free( lpt_shared_t *obj )
+{
+    free( obj );
+}
+
+
+static const lpt_shared_type_t MUTEX_TYPE = {
+    .tname = MUTEX_MT,
+    .init = lpt_mutex_init,
+    .free = mutex_free
+};
+
+
+static inline lpt_mutex_t *checkmutex( lua_State *L )
+{
+    return (lpt_mutex_t*)lpt_shared_check( L, 1, MUTEX_MT );
+}
+
+
+static inline int trylock( lpt_mutex_t *m )
+{
+    int state = UNLOCKED;
+
+    return atomic_compare_exchange_strong_explicit( &m->state, &state, LOCKED,
+                                                    memory_order_acquire,
+                                                    memory_order_relaxed );
+}
+
+
+// returns ECANCELED if the running function is cancelled while sleeping
+static int lock( lpt_mutex_t *m )
+{
+    int i = 0;
+
+    for(; i < MUTEX_NSPIN; i++ )
+    {
+        if( trylock( m ) ){
+            return 0;
+        }
+        else if( atomic_load_explicit( &m->state,
+                                       memory_order_relaxed ) == CONTENDED ){
+            break;
+        }
+    }
+
+    // mark as contended and sleep until the owner unlocks
+    while( atomic_exchange_explicit( &m->state, CONTENDED,
+                                     memory_order_acquire ) != UNLOCKED ){
+        if( lpt_cancel_futex_wait( &m->state, CONTENDED ) == ECANCELED ){
+            return ECANCELED;
+        }
+    }
+
+    return 0;
+}
+
+
+// returns the previous state
+static int unlock( lpt_mutex_t *m )
+{
+    int state = atomic_exchange_explicit( &m->state, UNLOCKED,
+                                          memory_order_release );
+
+    if( state == CONTENDED ){
+        lpt_futex_wake( &m->state, 1 );
+    }
+
+    return state;
+}
+
+
+static int lock_lua( lua_State *L )
+{
+    if( lock( checkmutex( L ) ) ){
+        return lpt_cancel_error( L );
+    }
+
+    return 0;
+}
+
+
+static int trylock_lua( lua_State *L )
+{
+    lpt_mutex_t *m = checkmutex( L );
+
+    lua_pushboolean( L, trylock( m ) );
+
+    return 1;
+}
+
+
+static int unlock_lua( lua_State *L )
+{
+    if( unlock( checkmutex( L ) ) == UNLOCKED ){
+        return luaL_error( L, "attempt to unlock an unlocked mutex" );
+    }
+
+    return 0;
+}
+
+
+// call the function with the lock, and unlock it even if the function fails
+// or is cancelled
+static int with_lua( lua_State *L )
+{
+    lpt_mutex_t *m = checkmutex( L );
+    int rc = 0;
+
+    luaL_checktype( L, 2, LUA_TFUNCTION );
+    if( lock( m ) ){
+        return lpt_cancel_error( L );
+    }
+    rc = lua_pcall( L, lua_gettop( L ) - 2, LUA_MULTRET, 0 );
+    unlock( m );
+    if( rc ){
+        return lua_error( L );
+    }
+
+    return lua_gettop( L ) - 1;
+}
+
+
+static int mutex_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, MUTEX_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_mutex_new( lua_State *L )
+{
+    lpt_mutex_t *m = malloc( sizeof( lpt_mutex_t ) );
+
+    if( !m ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    atomic_init( &m->shared.refcnt, 0 );
+    m->shared.type = &MUTEX_TYPE;
+    atomic_init( &m->state, UNLOCKED );
+    lpt_shared_push( L, (lpt_shared_t*)m );
+
+    return 1;
+}
+
+
+void lpt_mutex_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__tostring", mutex_tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "lock", lock_lua },
+        { "trylock", trylock_lua },
+        { "unlock", unlock_lua },
+        { "with", with_lua },
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &MUTEX_TYPE, mmethod, method );
+}
+
+
+/* barrier */
+
+static void barrier_free( lpt_shared_t *obj )
+{
+    lpt_barrier_t *b = (lpt_barrier_t*)obj;
+
+    pthread_cond_destroy( &b->cond );
+    pthread_mutex_destroy( &b->mutex );
+    free( b );
+}
+
+
+static const lpt_shared_type_t BARRIER_TYPE = {
+    .tname = BARRIER_MT,
+    .init = lpt_barrier_init,
+    .free = barrier_free
+};
+
+
+static inline lpt_barrier_t *checkbarrier( lua_State *L )
+{
+    return (lpt_barrier_t*)lpt_shared_check( L, 1, BARRIER_MT );
+}
+
+
+static int wait_lua( lua_State *L )
+{
+    lpt_barrier_t *b = checkbarrier( L );
+    unsigned int gen = 0;
+
+    pthread_mutex_lock( &b->mutex );
+    gen = b->gen;
+    // last one releases the others
+    if( ++b->nwait == b->nparty ){
+        b->nwait = 0;
+        b->gen++;
+        pthread_cond_broadcast( &b->cond );
+        pthread_mutex_unlock( &b->mutex );
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+    while( gen == b->gen ){
+        if( lpt_cancel_wait( &b->cond, &b->mutex, NULL ) == ECANCELED &&
+            gen == b->gen ){
+            // leave the barrier to not release the others without this
+            b->nwait--;
+            pthread_mutex_unlock( &b->mutex );
+            return lpt_cancel_error( L );
+        }
+    }
+    pthread_mutex_unlock( &b->mutex );
+    lua_pushboolean( L, 0 );
+
+    return 1;
+}
+
+
+static int barrier_tostring_lua( lua_State *L )
+{
+    lua_pushfstring( L, BARRIER_MT ": %p", lua_touserdata( L, 1 ) );
+    return 1;
+}
+
+
+int lpt_barrier_new( lua_State *L )
+{
+    lua_Integer n = lauxh_checkinteger( L, 1 );
+    lpt_barrier_t *b = NULL;
+
+    luaL_argcheck( L, n > 0 && n <= INT_MAX, 1,
+                   "number of parties must be between 1 and INT_MAX" );
+    if( !( b = calloc( 1, sizeof( lpt_barrier_t ) ) ) ){
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ) );
+        return 2;
+    }
+    atomic_init( &b->shared.refcnt, 0 );
+    b->shared.type = &BARRIER_TYPE;
+    pthread_mutex_init( &b->mutex, NULL );
+    lpt_cond_init( &b->cond );
+    b->nparty = (int)n;
+    lpt_shared_push( L, (lpt_shared_t*)b );
+
+    return 1;
+}
+
+
+void lpt_barrier_init( lua_State *L )
+{
+    struct luaL_Reg mmethod[] = {
+        { "__gc", lpt_shared_gc },
+        { "__tostring", barrier_tostring_lua },
+        { NULL, NULL }
+    };
+    struct luaL_Reg method[] = {
+        { "wait", wait_lua },
+        { NULL, NULL }
+    };
+
+    lpt_shared_register_mt( L, &BARRIER_TYPE, mmethod, method );
+}
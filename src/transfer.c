@@ -0,0 +1,118 @@
+/*
+ *  Copyright (C) 2014 Masatoshi Teruya
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  transfer.c
+ *  lua-pthread
+ *  Created by Masatoshi Teruya on 14/09/12.
+ *
+ *  registry of the transfer hooks. the hooks are only appended, so that the
+ *  encoders look them up without the lock.
+ */
+
+#include "lpthread.h"
+
+static pthread_mutex_t HOOK_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static const lpt_transfer_t *HOOKS[LPT_MAXTRANSFER];
+static atomic_int NHOOK = 0;
+
+
+static int register_transfer( const lpt_transfer_t *hook )
+{
+    int n = 0;
+    int i = 0;
+
+    if( !hook || !hook->tname || !hook->pack || !hook->unpack ||
+        !hook->free ){
+        return EINVAL;
+    }
+
+    pthread_mutex_lock( &HOOK_MUTEX );
+    n = atomic_load_explicit( &NHOOK, memory_order_relaxed );
+    for(; i < n; i++ ){
+        if( strcmp( HOOKS[i]->tname, hook->tname ) == 0 ){
+            pthread_mutex_unlock( &HOOK_MUTEX );
+            return EEXIST;
+        }
+    }
+    if( n == LPT_MAXTRANSFER ){
+        pthread_mutex_unlock( &HOOK_MUTEX );
+        return ENOSPC;
+    }
+    HOOKS[n] = hook;
+    // publish the hook after it is stored
+    atomic_store_explicit( &NHOOK, n + 1, memory_order_release );
+    pthread_mutex_unlock( &HOOK_MUTEX );
+
+    return 0;
+}
+
+
+static const lpt_transfer_t *find_transfer( const char *tname )
+{
+    int n = atomic_load_explicit( &NHOOK, memory_order_acquire );
+    int i = 0;
+
+    for(; i < n; i++ ){
+        if( strcmp( HOOKS[i]->tname, tname ) == 0 ){
+            return HOOKS[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static const lpt_api_t API = {
+    .version = LPT_API_VERSION,
+    .register_transfer = register_transfer,
+    .find_transfer = find_transfer
+};
+
+
+const lpt_transfer_t *lpt_transfer_test( lua_State *L, int idx )
+{
+    int n = atomic_load_explicit( &NHOOK, memory_order_acquire );
+    int i = 0;
+
+    if( !n || !lua_checkstack( L, 2 ) || !lua_getmetatable( L, idx ) ){
+        return NULL;
+    }
+    // compare with the metatables of the registered names
+    for(; i < n; i++ )
+    {
+        lua_getfield( L, LUA_REGISTRYINDEX, HOOKS[i]->tname );
+        if( lua_rawequal( L, -1, -2 ) ){
+            lua_pop( L, 2 );
+            return HOOKS[i];
+        }
+        lua_pop( L, 1 );
+    }
+    lua_pop( L, 1 );
+
+    return NULL;
+}
+
+
+void lpt_transfer_init( lua_State *L )
+{
+    lua_pushlightuserdata( L, (void*)&API );
+    lua_setfield( L, LUA_REGISTRYINDEX, LPT_API_KEY );
+}
@@ -0,0 +1,118 @@
+--[[
+  test/cancel.lua
+  lua-pthread
+
+  cooperative cancellation of the threads and the pool tasks.
+--]]
+local pthread = require('pthread')
+
+
+local function spin()
+    while true do
+    end
+end
+
+
+return {
+    { 'cancel running thread', function( t )
+        local th = pthread.new({ fn = spin, handshake = true })
+
+        t.eq( th:cancel(), true )
+        local ok, err = th:join()
+        t.eq( ok, false )
+        t.match( err, 'cancelled' )
+        -- already terminated
+        t.eq( th:cancel(), false )
+    end },
+
+    { 'cancel is not caught by pcall', function( t )
+        local th = pthread.new({
+            fn = function()
+                while true do
+                    pcall( spin )
+                end
+            end,
+            handshake = true
+        })
+
+        t.ok( th:cancel() )
+        local ok, err = th:join()
+        t.eq( ok, false )
+        t.match( err, 'cancelled' )
+    end },
+
+    { 'cancel blocked recv', function( t )
+        local ch = pthread.channel()
+        local th = pthread.new({
+            fn = function( ch )
+                return ch:recv()
+            end,
+            handshake = true
+        }, ch )
+
+        t.ok( th:cancel() )
+        local ok, err = th:join()
+        t.eq( ok, false )
+        t.match( err, 'cancelled' )
+    end },
+
+    { 'cancel blocked mutex and barrier', function( t )
+        local m = pthread.mutex()
+        local b = pthread.barrier( 2 )
+
+        m:lock()
+        for _, th in ipairs({
+            pthread.new({
+                fn = function( m )
+                    m:lock()
+                end,
+                handshake = true
+            }, m ),
+            pthread.new({
+                fn = function( b )
+                    b:wait()
+                end,
+                handshake = true
+            }, b ),
+        }) do
+            t.ok( th:cancel() )
+            local ok, err = th:join()
+            t.eq( ok, false )
+            t.match( err, 'cancelled' )
+        end
+        m:unlock()
+        t.eq( m:trylock(), true )
+        m:unlock()
+
+        -- the cancelled thread has left the barrier
+        local th = pthread.new( function( b )
+            return b:wait()
+        end, b )
+        local serial = b:wait()
+        local ok, other = th:join()
+        t.eq( ok, true )
+        t.ok( serial ~= other, 'one serial thread' )
+    end },
+
+    { 'cancel pool task', function( t )
+        local pool = pthread.pool( 1, { results = true } )
+        local id = pool:submit( spin )
+
+        t.eq( t.numtype( id ), t.numtype( 1 ) )
+        t.eq( pool:cancel( id ), true )
+        local res = pool:collect( 1 )
+        t.eq( res[1][1], id )
+        t.eq( res[1][2], false )
+        t.match( res[1][3], 'cancelled' )
+
+        -- the worker continues to run the next tasks
+        id = pool:submit( function( a, b )
+            return a + b
+        end, 1, 2 )
+        res = pool:collect( 1 )
+        t.eq( res[1][1], id )
+        t.eq( res[1][2], true )
+        t.eq( res[1][3], 3 )
+        pool:close()
+    end },
+}
@@ -0,0 +1,151 @@
+--[[
+  test/channel.lua
+  lua-pthread
+
+  bounded queue, timeouts and close of the channels.
+--]]
+local pthread = require('pthread')
+
+
+return {
+    { 'capacity', function( t )
+        t.eq( pthread.channel( 3 ):cap(), 4 )
+        t.eq( pthread.channel():cap(), 1024 )
+        t.eq( pthread.channel( 1 ):cap(), 2 )
+        t.ok( not pcall( pthread.channel, 0 ), 'zero capacity' )
+        if math.maxinteger then
+            t.ok( not pcall( pthread.channel, math.maxinteger ),
+                  'huge capacity' )
+            t.ok( not pcall( pthread.channel, 2^62 + 1 ), 'huge capacity' )
+        end
+    end },
+
+    { 'close', function( t )
+        local ch = pthread.channel()
+
+        t.ok( ch:send( 'left' ) )
+        ch:close()
+        local ok, err = ch:send( 'more' )
+        t.eq( ok, false )
+        t.eq( type( err ), 'string' )
+        -- the queued values are received
+        t.eq( ch:recv(), 'left' )
+        local val
+        val, err = ch:recv()
+        t.eq( val, nil )
+        t.eq( type( err ), 'string' )
+        val, err = ch:try_recv()
+        t.eq( val, nil )
+        t.eq( type( err ), 'string' )
+    end },
+
+    { 'close wakes up the receivers', function( t )
+        local ch = pthread.channel()
+        local th = pthread.new( function( ch )
+            return ch:recv()
+        end, ch )
+
+        ch:close()
+        local ok, val = th:join()
+        t.eq( ok, true )
+        t.eq( val, nil )
+    end },
+
+    { 'producer and consumer', function( t )
+        local ch = pthread.channel( 4 )
+        local th = pthread.new( function( ch, n )
+            for i = 1, n do
+                ch:send( i )
+            end
+            ch:close()
+        end, ch, 1000 )
+        local sum = 0
+        local n = 0
+
+        while true do
+            local v = ch:recv()
+
+            if v == nil then
+                break
+            end
+            n = n + 1
+            t.eq( v, n, 'order' )
+            sum = sum + v
+        end
+        t.eq( sum, 500500 )
+        t.eq( th:join(), true )
+    end },
+
+    { 'try_send', function( t )
+        local ch = pthread.channel( 2 )
+
+        t.eq( ch:try_send( 1 ), true )
+        t.eq( ch:try_send( 2 ), true )
+        -- full
+        local ok, err = ch:try_send( 3 )
+        t.eq( ok, false )
+        t.eq( err, nil )
+        t.eq( ch:len(), 2 )
+        t.eq( ch:try_recv(), 1 )
+        t.eq( ch:try_recv(), 2 )
+        -- empty
+        local val
+        val, err = ch:try_recv()
+        t.eq( val, nil )
+        t.eq( err, nil )
+        ch:close()
+        t.eq( ch:try_send( 1 ), false )
+    end },
+
+    { 'timeouts', function( t )
+        local ch = pthread.channel( 2 )
+
+        t.ok( ch:send( 1 ) and ch:send( 2 ) )
+        local ok, err = ch:send( 3, 0.01 )
+        t.eq( ok, false )
+        t.eq( err, nil )
+        t.ok( not pcall( ch.send, ch, 3, -1 ), 'negative timeout' )
+
+        local vals = ch:recv_many( 10, 0.01 )
+        t.eq( #vals, 2 )
+        t.eq( vals[1], 1 )
+        t.eq( vals[2], 2 )
+        t.eq( #ch:recv_many( 10, 0.01 ), 0 )
+
+        local val
+        val, err = ch:recv( 0.01 )
+        t.eq( val, nil )
+        t.eq( err, nil )
+        -- huge timeouts are clamped
+        t.eq( ch:send( 1, 1e300 ), true )
+        t.eq( ch:recv( 1e300 ), 1 )
+        ch:close()
+        t.eq( ch:recv_many( 10 ), nil )
+    end },
+
+    { 'batched consumer', function( t )
+        local ch = pthread.channel( 4 )
+        local th = pthread.new( function( ch, n )
+            for i = 1, n do
+                ch:send( i )
+            end
+            ch:close()
+        end, ch, 1000 )
+        local n = 0
+
+        while true do
+            local vals = ch:recv_many( 16 )
+
+            if not vals then
+                break
+            end
+            t.ok( #vals > 0 and #vals <= 16, 'batch size' )
+            for _, v in ipairs( vals ) do
+                n = n + 1
+                t.eq( v, n, 'order' )
+            end
+        end
+        t.eq( n, 1000 )
+        t.eq( th:join(), true )
+    end },
+}
@@ -0,0 +1,113 @@
+--[[
+  test/codec.lua
+  lua-pthread
+
+  round trips of the values through the channels and the threads.
+--]]
+local pthread = require('pthread')
+
+
+-- pass the values through a channel in the same thread
+local function roundtrip( val )
+    local ch = pthread.channel()
+
+    assert( ch:send( val ) )
+    return ch:recv()
+end
+
+
+return {
+    { 'scalars', function( t )
+        t.eq( roundtrip( true ), true )
+        t.eq( roundtrip( false ), false )
+        t.eq( roundtrip( 'foo\0bar' ), 'foo\0bar' )
+        t.eq( roundtrip( 1.5 ), 1.5 )
+        t.eq( roundtrip( -123456789 ), -123456789 )
+        t.eq( roundtrip( 1 / 0 ), 1 / 0 )
+        -- negative zero keeps its sign
+        local zero = 0.0
+        t.eq( 1 / roundtrip( -zero ), -1 / 0 )
+        local nan = roundtrip( 0 / 0 )
+        t.ok( nan ~= nan, 'nan' )
+    end },
+
+    { 'integers and floats', function( t )
+        t.eq( t.numtype( roundtrip( 1 ) ), t.numtype( 1 ) )
+        t.eq( t.numtype( roundtrip( 1.0 ) ), t.numtype( 1.0 ) )
+        if math.maxinteger then
+            t.eq( roundtrip( math.maxinteger ), math.maxinteger )
+            t.eq( roundtrip( math.mininteger ), math.mininteger )
+        end
+        t.eq( roundtrip( 2^53 ), 2^53 )
+    end },
+
+    { 'tables', function( t )
+        local tbl = roundtrip({ 1, 2, 3, foo = 'bar', [1.5] = true,
+                                nested = { x = { y = 'z' } } })
+
+        t.eq( #tbl, 3 )
+        t.eq( tbl[3], 3 )
+        t.eq( tbl.foo, 'bar' )
+        t.eq( tbl[1.5], true )
+        t.eq( tbl.nested.x.y, 'z' )
+    end },
+
+    { 'cycles and shared references', function( t )
+        local shared = { 'shared' }
+        local long = string.rep( 'x', 100 )
+        local tbl = { a = shared, b = shared, s1 = long, s2 = long }
+
+        tbl.self = tbl
+        tbl = roundtrip( tbl )
+        t.eq( tbl.self, tbl, 'cycle' )
+        t.eq( tbl.a, tbl.b, 'identity' )
+        t.eq( tbl.a[1], 'shared' )
+        t.eq( tbl.s1, long )
+        t.eq( tbl.s2, long )
+    end },
+
+    { 'functions', function( t )
+        local fn = roundtrip( function( a, b )
+            return a + b
+        end )
+
+        t.eq( type( fn ), 'function' )
+        t.eq( fn( 1, 2 ), 3 )
+        t.ok( not pcall( roundtrip, print ), 'C function' )
+    end },
+
+    { 'unsupported values', function( t )
+        t.ok( not pcall( roundtrip, io.stdout ), 'userdata' )
+        t.ok( not pcall( roundtrip, coroutine.create( print ) ), 'thread' )
+    end },
+
+    { 'thread arguments and results', function( t )
+        local arg = { n = 1, list = { 'a', 'b' } }
+        local th = pthread.new( function( tbl, num, str )
+            tbl.n = tbl.n + num
+            return tbl, str, math.type and math.type( num ) or 'number'
+        end, arg, 41, 'foo' )
+        local ok, tbl, str, typ = th:join()
+
+        t.eq( ok, true )
+        t.eq( tbl.n, 42 )
+        t.eq( tbl.list[2], 'b' )
+        t.eq( str, 'foo' )
+        t.eq( typ, t.numtype( 41 ) )
+        -- modified copy
+        t.eq( arg.n, 1 )
+    end },
+
+    { 'shared objects', function( t )
+        local ch = pthread.channel()
+        local buf = pthread.buffer( 'foo' )
+        local th = pthread.new( function( ch, buf )
+            buf:write( 1, 'bar' )
+            ch:send( 'done' )
+        end, ch, buf )
+
+        t.eq( ch:recv(), 'done' )
+        t.eq( buf:read(), 'bar' )
+        t.eq( th:join(), true )
+    end },
+}
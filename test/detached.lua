@@ -0,0 +1,45 @@
+--[[
+  test/detached.lua
+  lua-pthread
+
+  detached threads and the limit of their number.
+--]]
+local pthread = require('pthread')
+
+
+return {
+    { 'spawn', function( t )
+        local ch = pthread.channel()
+
+        t.eq( pthread.spawn_detached( function( ch, v )
+            ch:send( v )
+        end, ch, 'done' ), true )
+        t.eq( ch:recv( 10 ), 'done' )
+    end },
+
+    { 'limit', function( t )
+        local ch = pthread.channel()
+        local function wait( ch )
+            ch:recv()
+        end
+
+        pthread.setmaxdetached( 1 )
+        t.eq( pthread.spawn_detached( wait, ch ), true )
+        local ok, err = pthread.spawn_detached({ fn = wait, timeout = 0 }, ch )
+        t.eq( ok, nil )
+        t.eq( err, 'too many detached threads' )
+        ok, err = pthread.spawn_detached({ fn = wait, timeout = 0.01 }, ch )
+        t.eq( ok, nil )
+        t.eq( err, 'too many detached threads' )
+        t.ok( not pcall( pthread.spawn_detached, {
+            fn = wait,
+            timeout = -1
+        }, ch ), 'negative timeout' )
+
+        -- the slot is released by the termination
+        t.ok( ch:send( true ) )
+        t.eq( pthread.spawn_detached({ fn = wait, timeout = 10 }, ch ), true )
+        t.ok( ch:send( true ) )
+        pthread.setmaxdetached()
+    end },
+}
@@ -0,0 +1,111 @@
+--[[
+  test/frozen.lua
+  lua-pthread
+
+  access and iteration of the frozen tables.
+--]]
+local pthread = require('pthread')
+
+
+return {
+    { 'index and length', function( t )
+        local ft = pthread.freeze({
+            10, 20, 30, name = 'foo', [1.5] = true, nested = { x = 'y' }
+        })
+
+        t.eq( #ft, 3 )
+        t.eq( ft[1], 10 )
+        t.eq( ft[3], 30 )
+        t.eq( ft[4], nil )
+        t.eq( ft.name, 'foo' )
+        t.eq( ft[1.5], true )
+        t.eq( ft.nested.x, 'y' )
+        -- same object for the same nested table
+        t.eq( ft.nested, ft.nested )
+    end },
+
+    { 'shared subtables', function( t )
+        local node = { 'leaf' }
+
+        -- each level refers to the node of the next level twice
+        for _ = 1, 64 do
+            node = { a = node, b = node }
+        end
+        local ft = pthread.freeze( node )
+        t.eq( ft.a, ft.b, 'identity' )
+        t.eq( ft.a.b.a.b, ft.b.a.b.a )
+    end },
+
+    { 'immutable', function( t )
+        local ft = pthread.freeze({ 1 })
+
+        t.ok( not pcall( function()
+            ft[1] = 2
+        end ), 'assignment' )
+        t.eq( ft[1], 1 )
+    end },
+
+    { 'invalid tables', function( t )
+        local cyclic = {}
+
+        cyclic.self = cyclic
+        t.ok( not pcall( pthread.freeze, cyclic ), 'cycle' )
+        t.ok( not pcall( pthread.freeze, { print } ), 'C function value' )
+    end },
+
+    { 'pairs', function( t )
+        local ft = pthread.freeze({ 'a', 'b', 'c', x = 1, y = 2 })
+        local keys = {}
+        local n = 0
+
+        for k, v in pthread.pairs( ft ) do
+            n = n + 1
+            keys[n] = k
+            if type( k ) == 'number' then
+                t.eq( v, ( 'abc' ):sub( k, k ) )
+            else
+                t.eq( v, k == 'x' and 1 or 2 )
+            end
+        end
+        t.eq( n, 5 )
+        -- the array part is traversed first in order
+        t.eq( keys[1], 1 )
+        t.eq( keys[2], 2 )
+        t.eq( keys[3], 3 )
+
+        -- plain tables are also traversed
+        n = 0
+        for _ in pthread.pairs({ 1, 2, z = 3 }) do
+            n = n + 1
+        end
+        t.eq( n, 3 )
+        -- without the global next
+        local next = _G.next
+        _G.next = nil
+        n = 0
+        local ok = pcall( function()
+            for _ in pthread.pairs({ 1, 2 }) do
+                n = n + 1
+            end
+        end )
+        _G.next = next
+        t.eq( ok, true )
+        t.eq( n, 2 )
+    end },
+
+    { 'shared by threads', function( t )
+        local ft = pthread.freeze({ list = { 1, 2, 3 } })
+        local th = pthread.new( function( ft )
+            local sum = 0
+
+            for i = 1, #ft.list do
+                sum = sum + ft.list[i]
+            end
+            return sum
+        end, ft )
+        local ok, sum = th:join()
+
+        t.eq( ok, true )
+        t.eq( sum, 6 )
+    end },
+}
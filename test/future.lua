@@ -0,0 +1,111 @@
+--[[
+  test/future.lua
+  lua-pthread
+
+  futures of the pool tasks and their combinators.
+--]]
+local pthread = require('pthread')
+
+
+local function double( v )
+    return v * 2
+end
+
+
+local function fail()
+    error( 'boom' )
+end
+
+
+return {
+    { 'get', function( t )
+        local pool = pthread.pool( 2 )
+        local fut = pool:future( double, 21 )
+
+        t.eq( t.numtype( fut:id() ), t.numtype( 1 ) )
+        local ok, val = fut:get()
+        t.eq( ok, true )
+        t.eq( val, 42 )
+        t.eq( fut:is_done(), true )
+        -- the values can be got repeatedly
+        ok, val = fut:get()
+        t.eq( ok, true )
+        t.eq( val, 42 )
+        pool:close()
+    end },
+
+    { 'get timeout', function( t )
+        local pool = pthread.pool( 1 )
+        local ch = pthread.channel()
+        local fut = pool:future( function( ch )
+            return ch:recv()
+        end, ch )
+
+        t.eq( fut:get( 0.01 ), false )
+        t.eq( fut:is_done(), false )
+        t.ok( ch:send( 'done' ) )
+        local ok, val = fut:get()
+        t.eq( ok, true )
+        t.eq( val, 'done' )
+        pool:close()
+    end },
+
+    { 'failure', function( t )
+        local pool = pthread.pool( 1 )
+        local ok, err = pool:future( fail ):get()
+
+        t.eq( ok, false )
+        t.match( err, 'boom' )
+        pool:close()
+    end },
+
+    { 'then_', function( t )
+        local pool = pthread.pool( 2 )
+        local fut = pool:future( double, 1 ):then_( double ):then_( double )
+        local ok, val = fut:get()
+
+        t.eq( ok, true )
+        t.eq( val, 8 )
+
+        -- the failure is propagated without running the tasks
+        ok, val = pool:future( fail ):then_( double ):get()
+        t.eq( ok, false )
+        t.match( val, 'boom' )
+        pool:close()
+    end },
+
+    { 'all', function( t )
+        local pool = pthread.pool( 2 )
+        local futs = {}
+
+        for i = 1, 8 do
+            futs[i] = pool:future( double, i )
+        end
+        local res = { pthread.all( futs ):get() }
+        t.eq( res[1], true )
+        for i = 1, 8 do
+            t.eq( res[i + 1], i * 2 )
+        end
+
+        futs[9] = pool:future( fail )
+        local ok, err = pthread.all( futs ):get()
+        t.eq( ok, false )
+        t.match( err, 'boom' )
+        t.ok( not pcall( pthread.all, {} ), 'empty list' )
+        pool:close()
+    end },
+
+    { 'any', function( t )
+        local pool = pthread.pool( 2 )
+        local ok, val = pthread.any({
+            pool:future( fail ), pool:future( double, 2 )
+        }):get()
+
+        t.eq( ok, true )
+        t.eq( val, 4 )
+        ok, val = pthread.any({ pool:future( fail ), pool:future( fail ) }):get()
+        t.eq( ok, false )
+        t.match( val, 'boom' )
+        pool:close()
+    end },
+}
@@ -0,0 +1,67 @@
+--[[
+  test/limit.lua
+  lua-pthread
+
+  cpu time and instruction limits of the threads and the pool tasks.
+--]]
+local pthread = require('pthread')
+
+
+local function spin()
+    while true do
+    end
+end
+
+
+return {
+    { 'instruction limit', function( t )
+        local th = pthread.new({ fn = spin, instructions = 100000 })
+        local ok, err = th:join()
+
+        t.eq( ok, false )
+        t.match( err, 'instruction limit exceeded' )
+    end },
+
+    { 'cpu time limit', function( t )
+        local th = pthread.new({ fn = spin, cpu_ms = 10 })
+        local ok, err = th:join()
+
+        t.eq( ok, false )
+        t.match( err, 'cpu time limit exceeded' )
+    end },
+
+    { 'clamped cpu time limit', function( t )
+        local th = pthread.new({
+            fn = function()
+                return 'done'
+            end,
+            cpu_ms = 1e300
+        })
+        local ok, val = th:join()
+
+        t.eq( ok, true )
+        t.eq( val, 'done' )
+        -- less than a nanosecond is not unlimited
+        th = pthread.new({ fn = spin, cpu_ms = 1e-9 })
+        ok, val = th:join()
+        t.eq( ok, false )
+        t.match( val, 'cpu time limit exceeded' )
+    end },
+
+    { 'invalid limits', function( t )
+        t.ok( not pcall( pthread.new, { fn = spin, instructions = 0 } ) )
+        t.ok( not pcall( pthread.new, { fn = spin, cpu_ms = -1 } ) )
+        t.ok( not pcall( pthread.new, { fn = spin, cpu_ms = 0 / 0 } ), 'nan' )
+        t.ok( not pcall( pthread.new, { fn = spin, errors = {} } ) )
+    end },
+
+    { 'pool task limits', function( t )
+        local pool = pthread.pool( 1, { results = true } )
+
+        pool:submit({ fn = spin, instructions = 100000 })
+        local res = pool:collect( 1 )
+        t.eq( res[1][2], false )
+        t.match( res[1][3], 'instruction limit exceeded' )
+        pool:close()
+    end },
+}
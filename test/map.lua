@@ -0,0 +1,63 @@
+--[[
+  test/map.lua
+  lua-pthread
+
+  parallel map and reduce over the pool workers.
+--]]
+local pthread = require('pthread')
+
+
+local function range( n )
+    local arr = {}
+
+    for i = 1, n do
+        arr[i] = i
+    end
+    return arr
+end
+
+
+return {
+    { 'map', function( t )
+        local pool = pthread.pool( 2 )
+        local res = pthread.map( function( v, i )
+            return { v * 2, math.type and math.type( i ) or 'number' }
+        end, range( 100 ), { pool = pool, chunk = 7 } )
+
+        t.eq( #res, 100 )
+        for i = 1, 100 do
+            t.eq( res[i][1], i * 2 )
+            t.eq( res[i][2], t.numtype( 1 ), 'index type' )
+        end
+        t.eq( #pthread.map( function( v )
+            return v
+        end, {}, { pool = pool } ), 0 )
+        pool:close()
+    end },
+
+    { 'reduce', function( t )
+        local pool = pthread.pool( 2 )
+        local function add( acc, v )
+            return acc + v
+        end
+
+        t.eq( pthread.reduce( add, range( 100 ), 0, { pool = pool } ), 5050 )
+        t.eq( pthread.reduce( add, range( 100 ), nil, {
+            pool = pool,
+            chunk = 3
+        }), 5050 )
+        pool:close()
+    end },
+
+    { 'failed slice', function( t )
+        local res, err = pthread.map( function( v )
+            if v == 50 then
+                error( 'boom' )
+            end
+            return v
+        end, range( 100 ), { threads = 2 } )
+
+        t.eq( res, nil )
+        t.match( err, 'boom' )
+    end },
+}
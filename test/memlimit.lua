@@ -0,0 +1,73 @@
+--[[
+  test/memlimit.lua
+  lua-pthread
+
+  memory limits of the states.
+--]]
+local pthread = require('pthread')
+
+
+local function alloc( n )
+    return #string.rep( 'x', n )
+end
+
+
+return {
+    { 'allocation beyond the limit', function( t )
+        local th = pthread.new({
+            fn = alloc,
+            memlimit = 1024 * 1024
+        }, 4 * 1024 * 1024 )
+        local ok, err = th:join()
+
+        t.eq( ok, false )
+        t.match( err, 'not enough memory' )
+    end },
+
+    { 'allocation within the limit', function( t )
+        local th = pthread.new({
+            fn = alloc,
+            memlimit = 8 * 1024 * 1024
+        }, 1024 * 1024 )
+        local ok, n = th:join()
+
+        t.eq( ok, true )
+        t.eq( n, 1024 * 1024 )
+    end },
+
+    { 'without the arena', function( t )
+        local th = pthread.new({ fn = alloc, arena = false }, 1024 )
+        local ok, n = th:join()
+
+        t.eq( ok, true )
+        t.eq( n, 1024 )
+        th = pthread.new({
+            fn = alloc,
+            arena = false,
+            memlimit = 1024 * 1024
+        }, 4 * 1024 * 1024 )
+        t.eq( th:join(), false )
+    end },
+
+    { 'pool worker limit', function( t )
+        local pool = pthread.pool( 1, {
+            memlimit = 1024 * 1024,
+            results = true
+        })
+
+        pool:submit( alloc, 4 * 1024 * 1024 )
+        local res = pool:collect( 1 )
+        t.eq( res[1][2], false )
+        t.match( res[1][3], 'not enough memory' )
+        -- the worker is still usable
+        pool:submit( alloc, 1024 )
+        res = pool:collect( 1 )
+        t.eq( res[1][2], true )
+        t.eq( res[1][3], 1024 )
+        pool:close()
+    end },
+
+    { 'invalid limit', function( t )
+        t.ok( not pcall( pthread.new, { fn = alloc, memlimit = -1 } ) )
+    end },
+}
@@ -0,0 +1,95 @@
+--[[
+  test/run.lua
+  lua-pthread
+
+  run the tests and exit with a nonzero status if any test failed.
+
+  usage: lua test/run.lua [name ...]
+
+    name  names of the tests to run. all tests are run if omitted.
+--]]
+local NAMES = {
+    'channel', 'memlimit', 'thread', 'map', 'codec', 'frozen', 'cancel',
+    'limit', 'future', 'sync', 'detached',
+}
+
+
+local function dirname( path )
+    return path:match('^(.*)[/\\]') or '.'
+end
+
+
+local function repr( val )
+    if type( val ) == 'string' then
+        return string.format( '%q', val )
+    end
+    return tostring( val )
+end
+
+
+-- assertions for the tests
+local t = {}
+
+
+function t.ok( val, msg )
+    if not val then
+        error( msg or 'assertion failed', 2 )
+    end
+    return val
+end
+
+
+function t.eq( act, exp, msg )
+    if act ~= exp then
+        error( string.format( '%sexpected %s but got %s',
+                              msg and msg .. ': ' or '', repr( exp ),
+                              repr( act ) ), 2 )
+    end
+end
+
+
+-- the error messages may have the position and the traceback
+function t.match( str, pattern, msg )
+    if type( str ) ~= 'string' or not str:find( pattern, 1, true ) then
+        error( string.format( '%sexpected %s in %s',
+                              msg and msg .. ': ' or '', repr( pattern ),
+                              repr( str ) ), 2 )
+    end
+end
+
+
+-- integers and floats are distinguished on lua 5.3 or later
+function t.numtype( val )
+    return math.type and math.type( val ) or 'number'
+end
+
+
+local function main( args )
+    local names = #args > 0 and args or NAMES
+    local npass = 0
+    local nfail = 0
+
+    for _, name in ipairs( names ) do
+        local cases = dofile( dirname( arg[0] ) .. '/' .. name .. '.lua' )
+
+        for _, case in ipairs( cases ) do
+            local ok, err = pcall( case[2], t )
+
+            if ok then
+                npass = npass + 1
+                io.stdout:write( 'ok    ', name, ': ', case[1], '\n' )
+            else
+                nfail = nfail + 1
+                io.stdout:write( 'FAIL  ', name, ': ', case[1], '\n      ',
+                                 tostring( err ), '\n' )
+            end
+        end
+    end
+
+    io.stdout:write( string.format( '\n%d passed, %d failed\n', npass,
+                                    nfail ) )
+    os.exit( nfail == 0 and 0 or 1 )
+end
+
+
+main({ ... })
@@ -0,0 +1,85 @@
+--[[
+  test/sync.lua
+  lua-pthread
+
+  atomic integers, mutexes and barriers.
+--]]
+local pthread = require('pthread')
+
+
+return {
+    { 'atomic', function( t )
+        local a = pthread.atomic( 1 )
+
+        t.eq( a:load(), 1 )
+        t.eq( a:add(), 2 )
+        t.eq( a:add( 10 ), 12 )
+        t.eq( a:sub( 2 ), 10 )
+        t.eq( a:exchange( 5 ), 10 )
+        local ok, val = a:cas( 5, 6 )
+        t.eq( ok, true )
+        t.eq( val, 5 )
+        ok, val = a:cas( 5, 7 )
+        t.eq( ok, false )
+        t.eq( val, 6 )
+    end },
+
+    { 'atomic wraps around', function( t )
+        if not math.maxinteger then
+            return
+        end
+        local a = pthread.atomic( math.maxinteger )
+
+        t.eq( a:add(), math.mininteger )
+        t.eq( a:sub(), math.maxinteger )
+    end },
+
+    { 'atomic counter of threads', function( t )
+        local a = pthread.atomic( 0 )
+        local ths = {}
+
+        for i = 1, 4 do
+            ths[i] = pthread.new( function( a )
+                for _ = 1, 10000 do
+                    a:add()
+                end
+            end, a )
+        end
+        for i = 1, 4 do
+            t.eq( ths[i]:join(), true )
+        end
+        t.eq( a:load(), 40000 )
+    end },
+
+    { 'mutex', function( t )
+        local m = pthread.mutex()
+
+        m:lock()
+        t.eq( m:trylock(), false )
+        m:unlock()
+        t.eq( select( 2, m:with( function( a, b )
+            return a, b
+        end, 1, 2 ) ), 2 )
+        -- unlocked on the errors
+        t.ok( not pcall( m.with, m, error, 'boom' ) )
+        t.eq( m:trylock(), true )
+        m:unlock()
+    end },
+
+    { 'barrier', function( t )
+        local b = pthread.barrier( 2 )
+        local th = pthread.new( function( b )
+            return b:wait()
+        end, b )
+        local serial = b:wait()
+        local ok, other = th:join()
+
+        t.eq( ok, true )
+        t.ok( serial ~= other, 'one serial thread' )
+        t.ok( not pcall( pthread.barrier, 0 ), 'zero parties' )
+        if math.maxinteger then
+            t.ok( not pcall( pthread.barrier, math.maxinteger ),
+                  'too many parties' )
+        end
+    end },
+}
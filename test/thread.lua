@@ -0,0 +1,48 @@
+--[[
+  test/thread.lua
+  lua-pthread
+
+  timed and non-blocking joins of the threads.
+--]]
+local pthread = require('pthread')
+
+
+local function wait( ch )
+    return ch:recv()
+end
+
+
+return {
+    { 'join timeout', function( t )
+        local ch = pthread.channel()
+        local th = pthread.new( wait, ch )
+
+        t.eq( th:join( 0.01 ), false )
+        t.ok( not pcall( th.join, th, -1 ), 'negative timeout' )
+        t.ok( ch:send( 'done' ) )
+        local ok, val = th:join()
+        t.eq( ok, true )
+        t.eq( val, 'done' )
+    end },
+
+    { 'tryjoin and is_running', function( t )
+        local ch = pthread.channel()
+        local th = pthread.new( wait, ch )
+
+        t.eq( th:is_running(), true )
+        t.eq( th:tryjoin(), false )
+        t.ok( ch:send( 'done' ) )
+        t.eq( th:join(), true )
+        t.eq( th:is_running(), false )
+    end },
+
+    { 'error of the thread', function( t )
+        local th = pthread.new( function()
+            error( 'boom' )
+        end )
+        local ok, err = th:join()
+
+        t.eq( ok, false )
+        t.match( err, 'boom' )
+    end },
+}